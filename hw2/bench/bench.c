@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "const.h"
+#include "sequitur.h"
+
+/*
+ * Benchmark for compress() and decompress().
+ *
+ * Generates a corpus with one file of each kind of data below, then compresses and
+ * decompresses every file at each of a range of block sizes, and reports the
+ * throughput of both directions, the compression ratio, the peak resident set size,
+ * and statistics on the probe sequences of the digram table.  Every measurement runs
+ * in a child process of its own, so that the peak RSS is that of the one run.
+ * The corpus is generated from a fixed seed, so results are comparable across builds.
+ *
+ * Usage: sequitur_bench [-d DIR] [-n MBYTES] [-b KB,KB,...]
+ *   -d  directory in which the corpus is generated (default "bench_corpus")
+ *   -n  size of each file of the corpus, in megabytes (default 1)
+ *   -b  block sizes to be used, in kilobytes (default 1,4,16,64,256,1024)
+ */
+
+#define BENCH_MAX_BLOCKSIZES 16
+
+typedef struct bench_kind {
+    char *name;
+    void (*fill)(unsigned char *buf, size_t len);
+} BENCH_KIND;
+
+static unsigned long long bench_seed = 0x9e3779b97f4a7c15ULL;
+
+/* Next number from a xorshift64* generator. */
+static unsigned long long bench_rand(void) {
+    bench_seed ^= bench_seed >> 12;
+    bench_seed ^= bench_seed << 25;
+    bench_seed ^= bench_seed >> 27;
+    return bench_seed * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniformly random bytes: essentially incompressible. */
+static void fill_random(unsigned char *buf, size_t len) {
+    for(size_t i = 0; i < len; i++)
+        *(buf + i) = bench_rand() >> 56;
+}
+
+/* English-like text: words drawn with a skewed distribution, in lines. */
+static void fill_text(unsigned char *buf, size_t len) {
+    const char *list =
+        "the of and to a in that is was he for it "
+        "with as his on be at by had not are but from "
+        "or have an they which one you were her all she "
+        "there would their we him been has when who will "
+        "more no if out so said what up its about into "
+        "than them can only other new some could time these "
+        "two may then do first any my now such like our "
+        "over man me even most made after also did many "
+        "before must through back years where much your way "
+        "compression grammar sequence symbol digram rule block";
+    // Find where each word of the list starts.
+    size_t nwords = 1;
+    for(const char *c = list; *c; c++)
+        nwords += *c == ' ';
+    const char **words = malloc(nwords * sizeof(*words));
+    if(words == NULL) {
+        memset(buf, ' ', len);
+        return;
+    }
+    *words = list;
+    for(size_t n = 1; n < nwords; n++)
+        *(words + n) = strchr(*(words + n - 1), ' ') + 1;
+
+    size_t i = 0, col = 0;
+    while(i < len) {
+        // The minimum of two uniform picks favors the words early in the list.
+        size_t a = bench_rand() % nwords, b = bench_rand() % nwords;
+        const char *w = *(words + (a < b ? a : b));
+        for(; *w && *w != ' ' && i < len; w++, col++)
+            *(buf + i++) = *w;
+        if(i < len)
+            *(buf + i++) = col > 72 ? '\n' : ' ';
+        col = col > 72 ? 0 : col + 1;
+    }
+    free(words);
+}
+
+/* A short phrase repeated over and over, with an occasional changed byte. */
+static void fill_repetitive(unsigned char *buf, size_t len) {
+    const char *phrase = "All work and no play makes Jack a dull boy.\n";
+    size_t plen = strlen(phrase);
+    for(size_t i = 0; i < len; i++)
+        *(buf + i) = *(phrase + i % plen);
+    for(size_t i = 0; i < len / 4096; i++)
+        *(buf + bench_rand() % len) = 'a' + bench_rand() % 26;
+}
+
+/**
+ * The range of code points of one of the scripts used by fill_utf8().
+ */
+static void utf8_range(int r, unsigned int *lo, unsigned int *hi) {
+    switch(r) {
+    case 0: *lo = 0x00e0; *hi = 0x00ff; break;     // Latin-1 letters (2 bytes)
+    case 1: *lo = 0x03b1; *hi = 0x03c9; break;     // Greek (2 bytes)
+    case 2: *lo = 0x4e00; *hi = 0x4eff; break;     // CJK ideographs (3 bytes)
+    default: *lo = 0x1f600; *hi = 0x1f64f; break;  // Emoji (4 bytes)
+    }
+}
+
+/* UTF-8 text made mostly of multibyte characters from a few scripts. */
+static void fill_utf8(unsigned char *buf, size_t len) {
+    size_t i = 0;
+    while(i + 4 < len) {
+        if(bench_rand() % 8 == 0) {
+            *(buf + i++) = ' ';
+            continue;
+        }
+        unsigned int lo, hi;
+        utf8_range(bench_rand() % 4, &lo, &hi);
+        unsigned int c = lo + bench_rand() % (hi - lo + 1);
+        if(c < 0x800) {
+            *(buf + i++) = 0xc0 | c >> 6;
+        }
+        else if(c < 0x10000) {
+            *(buf + i++) = 0xe0 | c >> 12;
+            *(buf + i++) = 0x80 | ((c >> 6) & 0x3f);
+        }
+        else {
+            *(buf + i++) = 0xf0 | c >> 18;
+            *(buf + i++) = 0x80 | ((c >> 12) & 0x3f);
+            *(buf + i++) = 0x80 | ((c >> 6) & 0x3f);
+        }
+        *(buf + i++) = 0x80 | (c & 0x3f);
+    }
+    while(i < len)
+        *(buf + i++) = '\n';
+}
+
+#define BENCH_NKINDS 4
+
+/* The k-th kind of data in the corpus. */
+static BENCH_KIND bench_kind(size_t k) {
+    switch(k) {
+    case 0: return (BENCH_KIND){ "random", fill_random };
+    case 1: return (BENCH_KIND){ "text", fill_text };
+    case 2: return (BENCH_KIND){ "repetitive", fill_repetitive };
+    default: return (BENCH_KIND){ "utf8", fill_utf8 };
+    }
+}
+
+/* The current time in seconds, on a monotonic clock. */
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Generate the corpus file for a kind of data, unless it already exists with the
+ * right size.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int bench_generate(const BENCH_KIND *kind, const char *path, size_t len) {
+    struct stat st;
+    if(stat(path, &st) == 0 && (size_t)st.st_size == len)
+        return 0;
+    unsigned char *buf = malloc(len);
+    FILE *f = fopen(path, "w");
+    int ret = -1;
+    if(buf && f) {
+        kind->fill(buf, len);
+        ret = fwrite(buf, 1, len, f) == len ? 0 : -1;
+    }
+    if(f && fclose(f))
+        ret = -1;
+    free(buf);
+    return ret;
+}
+
+/**
+ * Check that a stream holds the same data as a file.
+ *
+ * @return 1 if it does, 0 if not.
+ */
+static int bench_same(FILE *a, const char *path) {
+    FILE *b = fopen(path, "r");
+    if(b == NULL)
+        return 0;
+    rewind(a);
+    int ca, cb;
+    do {
+        ca = getc(a);
+        cb = getc(b);
+    } while(ca == cb && ca != EOF);
+    fclose(b);
+    return ca == cb;
+}
+
+/**
+ * Run one measurement (in a child process): compress a corpus file with a given
+ * block size, decompress the result, check it and print a line of results.
+ */
+static void bench_run(const char *name, const char *path, int kb) {
+    FILE *in = fopen(path, "r");
+    FILE *comp = tmpfile();
+    FILE *decomp = tmpfile();
+    if(in == NULL || comp == NULL || decomp == NULL) {
+        fprintf(stderr, "%s: could not open files\n", name);
+        exit(EXIT_FAILURE);
+    }
+    fseek(in, 0, SEEK_END);
+    long len = ftell(in);
+    rewind(in);
+
+    current_ctx->digram_stats = (DIGRAM_STATS){ 0 };
+    double t0 = bench_now();
+    int clen = compress(in, comp, kb * 1024);
+    double t1 = bench_now();
+    DIGRAM_STATS st = current_ctx->digram_stats;
+    unsigned long ops = st.lookups + st.inserts + st.deletes;
+    rewind(comp);
+    double t2 = bench_now();
+    int dlen = decompress(comp, decomp);
+    double t3 = bench_now();
+    int ok = clen != EOF && dlen == len && bench_same(decomp, path);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double mb = len / 1048576.0;
+    printf("%-10s %5d KB %8.2f %8.2f %8.3f %9ld KB %9.2f %9lu  %s\n",
+           name, kb, mb / (t1 - t0), mb / (t3 - t2),
+           clen > 0 ? (double)len / clen : 0.0, ru.ru_maxrss,
+           ops ? (double)st.probes / ops : 0.0, st.max_probes,
+           ok ? "ok" : "FAILED");
+    fflush(stdout);
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = "bench_corpus";
+    int mbytes = 1;
+    int *blocksizes = malloc(BENCH_MAX_BLOCKSIZES * sizeof(int));
+    int nblocksizes = 0;
+    int opt;
+
+    if(blocksizes == NULL)
+        return EXIT_FAILURE;
+    for(int kb = 1; kb <= 1024; kb *= 4)
+        *(blocksizes + nblocksizes++) = kb;
+
+    while((opt = getopt(argc, argv, "d:n:b:")) != -1) {
+        if(opt == 'd') {
+            dir = optarg;
+        }
+        else if(opt == 'n' && (mbytes = atoi(optarg)) > 0) {
+            continue;
+        }
+        else if(opt == 'b') {
+            nblocksizes = 0;
+            for(char *s = strtok(optarg, ","); s; s = strtok(NULL, ",")) {
+                int kb = atoi(s);
+                if(kb < 1 || kb > 1024 || nblocksizes == BENCH_MAX_BLOCKSIZES)
+                    goto usage;
+                *(blocksizes + nblocksizes++) = kb;
+            }
+        }
+        else {
+            goto usage;
+        }
+    }
+    if(optind != argc || nblocksizes == 0)
+        goto usage;
+
+    mkdir(dir, 0777);
+    printf("%-10s %8s %8s %8s %8s %12s %9s %9s  %s\n", "data", "block", "c MB/s",
+           "d MB/s", "ratio", "peak RSS", "probes/op", "max probe", "check");
+    int failed = 0;
+    for(size_t k = 0; k < BENCH_NKINDS; k++) {
+        BENCH_KIND kind = bench_kind(k);
+        int plen = snprintf(NULL, 0, "%s/%s.%dM", dir, kind.name, mbytes);
+        char *path = malloc(plen + 1);
+        if(path != NULL)
+            snprintf(path, plen + 1, "%s/%s.%dM", dir, kind.name, mbytes);
+        if(path == NULL || bench_generate(&kind, path, (size_t)mbytes << 20)) {
+            fprintf(stderr, "Could not generate the %s data\n", kind.name);
+            free(path);
+            free(blocksizes);
+            return EXIT_FAILURE;
+        }
+        for(int b = 0; b < nblocksizes; b++) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if(pid == 0)
+                bench_run(kind.name, path, *(blocksizes + b));
+            int status;
+            if(pid < 0 || waitpid(pid, &status, 0) < 0 ||
+               !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                fprintf(stderr, "%s at %d KB failed\n", kind.name, *(blocksizes + b));
+                failed = 1;
+            }
+        }
+        free(path);
+    }
+    free(blocksizes);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "Usage: %s [-d DIR] [-n MBYTES] [-b KB,KB,...]\n", *argv);
+    free(blocksizes);
+    return EXIT_FAILURE;
+}
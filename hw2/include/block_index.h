@@ -0,0 +1,64 @@
+#ifndef BLOCK_INDEX_H
+#define BLOCK_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bufio.h"
+
+/*
+ * BLOCK INDEX
+ *
+ * Blocks in a compressed transmission can only be found by scanning for their
+ * SOB and EOB marks, and the amount of data a block expands to is only known once
+ * it has been expanded.  A transmission can optionally carry an index giving,
+ * for every block, the offset of its SOB mark in the transmission and the number
+ * of bytes of data it represents, so that a decompressor can locate the blocks
+ * up front and expand them concurrently, each straight into its place in the output.
+ *
+ * So that decompressors that know nothing about the index can still read such a
+ * transmission, the index is written as one extra rule at the end of the last block.
+ * This rule is never referred to by any other rule, so it is never expanded, and
+ * its body consists only of terminal symbols in the range [0x40, 0x7F], each of
+ * which is encoded as a single byte:
+ *
+ *    RD  H  E1 E2 ... En  L1 ... L8  'S' 'Q' 'I' 'X'  EOB  EOT
+ *
+ * H is the head of the rule (BLOCK_INDEX_HEAD).  Each entry Ei consists of two
+ * numbers: the distance from the SOB mark of the previous block (or from the start
+ * of the transmission, for the first block) to the SOB mark of block i, and the
+ * number of bytes of data in block i.  L1 ... L8 give the total length, in bytes,
+ * of E1 ... En.  Numbers are written most significant digit first, in base 32:
+ * every digit but the last is written as 0x40 + d and the last one as 0x60 + d.
+ * L1 ... L8 always has exactly eight digits, so that a reader can find the index
+ * by looking at a fixed number of bytes at the end of the transmission.
+ */
+
+/* Value of the head of the index rule (the largest Unicode code point). */
+#define BLOCK_INDEX_HEAD 0x10FFFF
+
+/* Length of the fixed-size trailer: L1 ... L8, the magic string, EOB and EOT. */
+#define BLOCK_INDEX_TRAILER 14
+
+/*
+ * Largest number of bytes of entries that will be written.  Every byte of the
+ * index costs a symbol when a transmission is read, so for input that is split
+ * into very many blocks the index is left out rather than allowed to exhaust
+ * the symbol storage of a decompressor.
+ */
+#define BLOCK_INDEX_MAX_BYTES (1 << 18)
+
+typedef struct block_index {
+    size_t count;              // Number of blocks in the index.
+    size_t cap;                // Number of entries allocated.
+    uint64_t *offset;          // Offset of the SOB mark of each block in the transmission.
+    uint64_t *length;          // Number of bytes of data in each block.
+    size_t bytes;              // Number of bytes the entries take up when written.
+} BLOCK_INDEX;
+
+int block_index_add(BLOCK_INDEX *ix, uint64_t offset, uint64_t length);
+int block_index_write(BLOCK_INDEX *ix, SEQ_WRITER *out);
+int block_index_read(BLOCK_INDEX *ix, int fd);
+void block_index_free(BLOCK_INDEX *ix);
+
+#endif
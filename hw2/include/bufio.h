@@ -0,0 +1,100 @@
+#ifndef BUFIO_H
+#define BUFIO_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * BLOCK-BUFFERED I/O
+ *
+ * The compressor and decompressor used to move every byte through fgetc()/fputc(),
+ * which takes the stdio stream lock once per byte.  The types below replace that
+ * with plain memory buffers that are refilled with a single fread() and drained
+ * with a single fwrite(), so the per-byte cost in the hot loops is a bounds check
+ * and a load or store.
+ *
+ * A SEQ_READER pulls bytes from a stream in chunks of up to "cap" bytes, or
+ * just reads from a buffer that already holds all of its input.
+ * A SEQ_WRITER collects bytes in a buffer of "cap" bytes; it is drained to its
+ * stream when it fills up, or explicitly by seq_writer_flush() (the compressor
+ * flushes once at the end of each block).  A SEQ_WRITER with no stream collects
+ * everything written to it in memory, growing its buffer instead of draining it.
+ */
+
+/* Default capacity for reader and writer buffers. */
+#define SEQ_IOBUF_SIZE (1 << 16)
+
+typedef struct seq_reader {
+    FILE *fp;                  // Underlying stream, or NULL if reading from memory.
+    unsigned char *buf;        // Buffered input.
+    size_t cap;                // Capacity of buf.
+    size_t pos;                // Index of the next byte to be returned.
+    size_t len;                // Number of valid bytes in buf.
+    int pipe;                  // Nonzero if fp is a pipe or FIFO (see seq_reader_fill()).
+} SEQ_READER;
+
+typedef struct seq_writer {
+    FILE *fp;                  // Underlying stream, or NULL to collect output in memory.
+    unsigned char *buf;        // Pending output.
+    size_t cap;                // Capacity of buf.
+    size_t len;                // Number of pending bytes in buf.
+    size_t total;              // Total number of bytes accepted since the writer was opened.
+    int err;                   // Nonzero once a write to fp has failed.
+} SEQ_WRITER;
+
+int seq_reader_open(SEQ_READER *r, FILE *fp, size_t cap);
+void seq_reader_open_buffer(SEQ_READER *r, unsigned char *buf, size_t len);
+void seq_reader_close(SEQ_READER *r);
+int seq_reader_fill(SEQ_READER *r);
+
+int seq_writer_open(SEQ_WRITER *w, FILE *fp, size_t cap);
+int seq_writer_close(SEQ_WRITER *w);
+int seq_writer_flush(SEQ_WRITER *w);
+int seq_writer_grow(SEQ_WRITER *w, size_t n);
+int seq_write(SEQ_WRITER *w, const void *src, size_t n);
+
+/**
+ * Get the next byte from a reader.
+ *
+ * @return  The byte, as an unsigned char converted to int, or EOF at end of input.
+ */
+static inline int seq_getc(SEQ_READER *r) {
+    if(r->pos == r->len && seq_reader_fill(r) <= 0)
+        return EOF;
+    return *(r->buf + r->pos++);
+}
+
+/**
+ * Make room for at least n bytes in a writer, flushing pending output if needed.
+ * The caller must have n <= w->cap.
+ *
+ * @return  A pointer to the free space in the buffer, or NULL on a write error.
+ */
+static inline unsigned char *seq_writer_reserve(SEQ_WRITER *w, size_t n) {
+    if(w->cap - w->len < n && seq_writer_flush(w))
+        return NULL;
+    return w->buf + w->len;
+}
+
+/**
+ * Commit n bytes previously written into space obtained from seq_writer_reserve().
+ */
+static inline void seq_writer_commit(SEQ_WRITER *w, size_t n) {
+    w->len += n;
+    w->total += n;
+}
+
+/**
+ * Append one byte to a writer.
+ *
+ * @return  The byte written, or EOF on a write error.
+ */
+static inline int seq_putc(SEQ_WRITER *w, int c) {
+    if(w->len == w->cap && seq_writer_flush(w))
+        return EOF;
+    *(w->buf + w->len++) = (unsigned char)c;
+    w->total++;
+    return (unsigned char)c;
+}
+
+#endif
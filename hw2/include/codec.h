@@ -0,0 +1,33 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+#include "sequitur.h"
+
+/*
+ * IN-MEMORY CODEC
+ *
+ * compress() and decompress() work on stdio streams and on the calling thread's
+ * current context.  The functions below do the same work between memory buffers,
+ * on a context given by the caller, so that the codec can be embedded in another
+ * program: they never touch stdio, and any number of threads can use them at the
+ * same time, as long as no two of them use the same context at once.  A context
+ * (from seq_ctx_new()) can be used for any number of calls, one after another, and
+ * is released with seq_ctx_free().
+ *
+ * Of the options in a context, seq_compress_buf() honours only ENTROPY_OPTION
+ * (see entropy.h), which the caller may set in ctx->options before the call;
+ * VERBOSE_OPTION is ignored, since reporting statistics would mean writing to
+ * stderr.
+ *
+ * The output buffer is allocated with malloc() and belongs to the caller, who must
+ * free() it; it is only allocated if the call succeeds.
+ */
+
+int seq_compress_buf(SEQ_CTX *ctx, const unsigned char *in, size_t n, int bsize,
+                     unsigned char **out, size_t *outlen);
+int seq_decompress_buf(SEQ_CTX *ctx, const unsigned char *in, size_t n,
+                       unsigned char **out, size_t *outlen);
+
+#endif
@@ -13,16 +13,40 @@
 
 #define USAGE(program_name, retcode) do { \
 fprintf(stderr, "USAGE: %s %s\n", program_name, \
-"[-h] -c|-d [-b]\n" \
+"[-h] -c|-d [-b BLOCKSIZE] [-e] [-i] [-j JOBS] [-s MSEC] [-v] [-r OFFSET:LENGTH]\n" \
 "   -h       Help: displays this help menu.\n" \
 "   -c       Compress: read bytes from standard input, output compressed data to standard output.\n" \
 "   -d       Decompress: read compressed data from standard input, output raw data to standard output.\n" \
-"            Optional additional parameter for -c (not permitted with -d):\n" \
+"            Optional additional parameters for -c (not permitted with -d):\n" \
 "               -b           BLOCKSIZE is the blocksize (in Kbytes, range [1, 1024])\n" \
-"                            to be used in compression.\n"); \
+"                            to be used in compression, or \"auto\" to let the size of\n" \
+"                            each block follow the data (not with -j or -s).\n" \
+"               -e           Entropy code the rules of each block, for smaller output.\n" \
+"               -i           Write a block index, which lets -d -j expand blocks in parallel.\n" \
+"               -s           Streaming: also end a block once MSEC milliseconds (range\n" \
+"                            [1, 60000]) have passed since its first byte was read,\n" \
+"                            and write each block out at once (not with -i or -j).\n" \
+"               -v           Verbose: after each block, print statistics on the digram\n" \
+"                            table (and, with -b auto, why the block was ended) to\n" \
+"                            standard error (not with -j).\n" \
+"            Optional additional parameter for -d (not permitted with -c):\n" \
+"               -r           Range: write only LENGTH bytes of the data, starting\n" \
+"                            OFFSET bytes in (not with -j).\n" \
+"            Optional additional parameter for -c and -d:\n" \
+"               -j           JOBS is the number of blocks (range [1, 64]) to be\n" \
+"                            processed at the same time, each on its own thread.\n"); \
 exit(retcode); \
 } while(0)
 
+/* The largest number of worker threads that can be requested with -j. */
+#define MAX_JOBS 64
+
+/* The longest interval, in milliseconds, that can be given with -s. */
+#define MAX_STREAM_INTERVAL 60000
+
+/* The largest end of a range (offset plus length) that can be given with -r. */
+#define RANGE_MAX ((uint64_t)1 << 62)
+
 /*
  * The following global variables have been provided for you.
  * You MUST use them for their stated purposes, because you are not permitted
@@ -34,25 +58,25 @@ exit(retcode); \
 /* Options info, set by validargs. */
 int global_options;
 
-/* Statically allocated storage for symbols. */
-SYMBOL symbol_storage[MAX_SYMBOLS];
-
-/* Total number of symbols allocated from symbol_storage. */
-int num_symbols;
-
-/* Storage for the digram hash table, which maps pairs of symbol values to digrams. */
-SYMBOL *digram_table[MAX_DIGRAMS];
-
 /*
- * The "main rule", which heads the list of rules generated by the compression algorithm
- * (during compression) or read in as input (during decompression).
+ * The symbol storage, digram table, main rule and rule map are held in the current
+ * context (see SEQ_CTX in sequitur.h) and are accessed under the names
+ * num_symbols, next_nonterminal_value, digram_table and main_rule defined there, and
+ * rule_map defined below.
  */
-SYMBOL *main_rule;
 
 /*
  * Array, used during decompression, that maps symbol values to nonterminal symbols.
+ * Entries should be set with map_rule(), which keeps track of them so that
+ * init_rules() only has to clear the entries that have actually been used.
  */
-SYMBOL *rule_map[SYMBOL_VALUE_MAX];
+#define rule_map (current_ctx->rule_index)
+
+/*
+ * Number of rule_map entries that are kept track of for init_rules(); if more are
+ * used in one block, init_rules() clears the whole rule_map instead.
+ */
+#define RULE_DIRTY_MAX (1 << 16)
 
 /*
  * Below this line are prototypes for functions that MUST occur in your program.
@@ -80,10 +104,31 @@ void add_rule(SYMBOL *rule);
 void delete_rule(SYMBOL *rule);
 SYMBOL *ref_rule(SYMBOL *rule);
 void unref_rule(SYMBOL *rule);
+void map_rule(SYMBOL *rule);
 
 void init_digram_hash(void);
 SYMBOL *digram_get(int v1, int v2);
 int digram_delete(SYMBOL *first);
+int digram_forget(SYMBOL *first);
 int digram_put(SYMBOL *first);
 
+/*
+ * Additional functions, beyond the required ones above.
+ */
+
+int compress_parallel(FILE *in, FILE *out, int bsize, int jobs, int index);
+int decompress_parallel(FILE *in, FILE *out, int jobs);
+int compress_streaming(FILE *in, FILE *out, int bsize, int interval);
+int compress_adaptive(FILE *in, FILE *out, int index);
+int decompress_range(FILE *in, FILE *out, uint64_t offset, uint64_t len);
+void digram_rehash(void);
+void digram_report(FILE *f, size_t len);
+
+/* Interval given with -s, in milliseconds (0 if not streaming); set by validargs. */
+int stream_interval;
+
+/* Offset and length, in bytes, of the range given with -r; set by validargs. */
+uint64_t range_offset;
+uint64_t range_length;
+
 #endif
@@ -0,0 +1,107 @@
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#include <stdint.h>
+
+#include "sequitur.h"
+#include "bufio.h"
+
+/*
+ * ENTROPY CODING
+ *
+ * In a plain transmission every symbol of a rule body is written as a UTF-8 sequence
+ * of its own, so a reference to a rule costs two to four bytes however often the rule
+ * is used, and a byte of text costs a whole byte however predictable it is.  With -e,
+ * the compressor instead entropy codes the rules of each block, and marks the
+ * transmission by starting it with ENTROPY_SOT instead of SOT.  The framing is
+ * otherwise the same: every block still lies between an SOB mark and an EOB mark,
+ * and the block index, if any, is still a plain rule at the end of the last block,
+ * after the coded rules:
+ *
+ *    ENTROPY_SOT  SOB C1 EOB  SOB C2 EOB  ...  SOB Cn [RD index] EOB  EOT
+ *
+ * Within a block, the rules are numbered in the order in which they are coded,
+ * starting with the main rule, and the other rules come in decreasing order of the
+ * number of times they are used, so that the rules used most have the smallest
+ * numbers.  Rule k gets the head FIRST_NONTERMINAL + k, which is therefore not
+ * transmitted.  Each rule body is coded as a sequence of symbols from an alphabet
+ * of ENTROPY_ALPHABET symbols, and is followed by ENTROPY_END:
+ *
+ *    0 ... 255                  a terminal symbol;
+ *    ENTROPY_END                the end of the rule;
+ *    ENTROPY_RULE + b           a reference to rule j, where 2^b <= j < 2^(b+1),
+ *                               followed by the b low-order bits of j.
+ *
+ * The symbols of a block are coded with rANS (range asymmetric numeral systems),
+ * using the order-0 frequencies of the symbols in the block, scaled so that they
+ * add up to a power of two (ENTROPY_SCALE, for all but small blocks).  The low-order
+ * bits of a rule number, and the header of the block, are coded as if every value
+ * were equally likely.  The header comes first, and gives the number of rules and, for every symbol that occurs, its
+ * distance from the previous such symbol and its number of occurrences, each as an
+ * Elias gamma code; the decoder scales the counts just as the encoder did.  Since
+ * the whole grammar of a block is known before it is written, the frequencies are
+ * those of the block itself, rather than adapted as it goes.  A decoder turns them
+ * into a table with a slot for every unit of the scale, so that a symbol is decoded
+ * with one lookup.
+ *
+ * A coded block takes exactly the bytes that its decoder consumes, so no length is
+ * recorded; the decoder checks that the symbols it decoded are exactly those the
+ * header counted, and that it ended in the state in which the encoder started.
+ */
+
+/* Mark that starts a transmission whose blocks are entropy coded, in place of SOT. */
+#define ENTROPY_SOT 0x86
+
+/* Option bit (in global_options and in a context's options) that selects entropy coding (-e). */
+#define ENTROPY_OPTION 0x80
+
+/* Mark with which the compressor starts a transmission, given the current context. */
+#define SOT_MARK ((current_ctx->options & ENTROPY_OPTION) ? ENTROPY_SOT : 0x81)
+
+/* Symbols of the coding alphabet other than terminals. */
+#define ENTROPY_END 256
+#define ENTROPY_RULE 257
+#define ENTROPY_RULE_CLASSES 21
+#define ENTROPY_ALPHABET (ENTROPY_RULE + ENTROPY_RULE_CLASSES)
+
+/*
+ * Frequencies are scaled to add up to ENTROPY_SCALE, or for a block of fewer than
+ * ENTROPY_SCALE / 2 symbols, to the smallest power of two that is at least twice
+ * the number of symbols, but no less than 2^ENTROPY_SCALE_BITS_MIN.
+ */
+#define ENTROPY_SCALE_BITS 12
+#define ENTROPY_SCALE_BITS_MIN 9
+#define ENTROPY_SCALE (1 << ENTROPY_SCALE_BITS)
+
+/* The coder state is kept in [ENTROPY_STATE_LOW, 256 * ENTROPY_STATE_LOW). */
+#define ENTROPY_STATE_LOW (1U << 23)
+
+/* Largest number of symbols (body symbols and ends of rules) in a coded block. */
+#define ENTROPY_MAX_SYMBOLS (MAX_SYMBOLS / 2)
+
+/* A slot of the decoding table. */
+typedef struct entropy_slot {
+    uint16_t symbol;           // The symbol whose range the slot is in.
+    uint16_t freq;             // The scaled frequency of the symbol.
+    uint16_t start;            // The first slot of the symbol's range.
+} ENTROPY_SLOT;
+
+/* Storage used to code the rules of a block, kept by a context from block to block. */
+typedef struct entropy_coder {
+    SYMBOL **rules;            // Rules in the order in which they are coded (encoder).
+    size_t rules_cap;          // Number of entries allocated in rules.
+    int *number;               // Number of each rule, by value - FIRST_NONTERMINAL (encoder).
+    size_t number_cap;         // Number of entries allocated in number.
+    unsigned char *buf;        // Coded block, written from the end backwards (encoder).
+    size_t buf_cap;            // Number of bytes allocated in buf.
+    uint32_t *count;           // Number of occurrences of each symbol (ENTROPY_ALPHABET).
+    uint32_t *freq;            // Scaled frequency of each symbol (ENTROPY_ALPHABET).
+    uint32_t *start;           // First slot of the range of each symbol (ENTROPY_ALPHABET).
+    ENTROPY_SLOT *slots;       // Decoding table (ENTROPY_SCALE).
+} ENTROPY_CODER;
+
+int entropy_write_block(SYMBOL *head, SEQ_WRITER *out);
+int entropy_read_block(SEQ_READER *in);
+void entropy_coder_free(ENTROPY_CODER *coder);
+
+#endif
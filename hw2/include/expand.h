@@ -0,0 +1,74 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sequitur.h"
+#include "bufio.h"
+
+/*
+ * RULE EXPANSION
+ *
+ * Decompressing a block means writing out the expansion of its main rule.  Expanding
+ * every nonterminal by walking its rule again each time it occurs repeats the same work
+ * for every occurrence of a shared rule, and recursing on nested rules lets the depth
+ * of a grammar decide the depth of the C stack.  Instead, the rules that can be reached
+ * from the main rule are first put in dependency order, using an explicit stack, and
+ * each one is then flattened exactly once into a byte string in an arena, built by
+ * copying the already flattened strings of the rules it refers to.  Every occurrence
+ * of a nonterminal in the main rule is then written out with a single copy.
+ *
+ * A rule is only flattened if its expansion is at most EXPAND_RULE_MAX bytes and the
+ * arena has room for it (EXPAND_ARENA_MAX bytes in total), so that a small grammar
+ * whose expansion is huge cannot exhaust memory.  Rules that are not flattened are
+ * expanded as they are written, again using an explicit stack.
+ *
+ * The same walk also detects references to undefined rules and rules that refer
+ * (directly or indirectly) to themselves, either of which make a block malformed.
+ *
+ * When only part of a block is wanted (see decompress_range()), no rule is flattened;
+ * the walk just finds the length of the expansion of every rule, and the part is then
+ * written by descending only into the rules whose expansions overlap it.
+ */
+
+/* Largest expansion of a single rule that is flattened. */
+#define EXPAND_RULE_MAX (1 << 20)
+
+/* Largest total size of the flattened expansions kept for one block. */
+#define EXPAND_ARENA_MAX (1 << 24)
+
+/* Offset recorded for a rule whose expansion is not flattened. */
+#define EXPAND_UNCACHED ((size_t)-1)
+
+/* What is known about the expansion of one rule. */
+typedef struct rule_expansion {
+    SYMBOL *rule;              // Head of the rule.
+    uint64_t length;           // Length of the expansion (saturating at UINT64_MAX).
+    size_t offset;             // Offset of the flattened expansion in the arena, or EXPAND_UNCACHED.
+    int done;                  // Nonzero once the rules it refers to have all been handled.
+} RULE_EXPANSION;
+
+/* A rule being walked, and the next symbol of its body to be looked at. */
+typedef struct expand_frame {
+    SYMBOL *rule;
+    SYMBOL *pos;
+} EXPAND_FRAME;
+
+/* Storage used to expand the rules of a block, kept by a context from block to block. */
+typedef struct expand_cache {
+    RULE_EXPANSION *rules;     // One entry for every rule reached from the main rule.
+    size_t nrules;             // Number of entries in use.
+    size_t rules_cap;          // Number of entries allocated.
+    unsigned char *arena;      // Flattened expansions.
+    size_t arena_len;          // Number of bytes of the arena in use.
+    size_t arena_cap;          // Number of bytes allocated.
+    EXPAND_FRAME *stack;       // Explicit stack used to walk rules.
+    size_t stack_cap;          // Number of frames allocated.
+} EXPAND_CACHE;
+
+int expand_rule(SYMBOL *rule, SEQ_WRITER *out);
+int expand_rule_range(SYMBOL *rule, uint64_t *skip, uint64_t *len, SEQ_WRITER *out);
+void expand_cache_free(EXPAND_CACHE *cache);
+
+#endif
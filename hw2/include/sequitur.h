@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "debug.h"
 
@@ -27,23 +28,29 @@
  *
  * Each symbol also has some pointer fields, which we will use to chain symbols together
  * into lists.  The "next" and "prev" fields will be used to chain symbols together
- * as a doubly linked list to form the body of a rule.  The "nextr" and "prevr" fields
- * will be used to link the heads of rules (which will be represented by nonterminal
- * symbols) into a doubly linked list.  There is also a "refcnt" field, which is used
- * by the compression algorithm to maintain a count of the number of times a rule has
- * been used.  Refer to the assignment document for further discussion on the use of these
- * various fields.
+ * as a doubly linked list to form the body of a rule.  The heads of rules (which will be
+ * represented by nonterminal symbols) are also linked into a doubly linked list, but
+ * as only a few symbols are rule heads, those links ("nextr" and "prevr") are kept in a
+ * separate table (see RULES below) rather than in every symbol.  This keeps a SYMBOL
+ * down to 32 bytes, so that two of them fit in a cache line.  There is also a "refcnt"
+ * field, which is used by the compression algorithm to maintain a count of the number
+ * of times a rule has been used.  Refer to the assignment document for further
+ * discussion on the use of these various fields.
  */
 typedef struct symbol {
     unsigned int value;        // The value that uniquely identifies the symbol.
-    unsigned int refcnt;       // Reference count if symbol is head of a rule, otherwise 0
+    unsigned int refcnt;       // Reference count if symbol is head of a rule, otherwise a flag (see digram_forget())
     struct symbol *rule;       // NULL for terminal, non-NULL for nonterminal or sentinel
     struct symbol *next;       // Next symbol in rule body (or the sentinel, in case of last symbol)
     struct symbol *prev;       // Previous symbol in rule body (or the sentinel, in case of first symbol)
-    struct symbol *nextr;      // If sentinel, next rule in list of all rules.
-    struct symbol *prevr;      // If sentinel, previous rule in list of all rules.
 } SYMBOL;
 
+/* The links of a rule head in the list of all rules. */
+typedef struct rule_links {
+    struct symbol *nextr;      // Next rule in list of all rules.
+    struct symbol *prevr;      // Previous rule in list of all rules.
+} RULE_LINKS;
+
 /* The first symbol value that is used for nonterminal symbols. */
 #define FIRST_NONTERMINAL 256
 
@@ -52,40 +59,121 @@ typedef struct symbol {
 #define IS_NONTERMINAL(s) (!IS_TERMINAL(s))
 #define IS_RULE_HEAD(s) ((s)->rule == (s))
 
+/*
+ * Statistics on the use of the digram table (see DIGRAMS below), which a context
+ * accumulates until they are reset (see digram_report()); init_digram_hash() does
+ * not reset them.
+ */
+typedef struct digram_stats {
+    unsigned long lookups;     // Number of calls to digram_get().
+    unsigned long inserts;     // Number of calls to digram_put().
+    unsigned long deletes;     // Number of calls to digram_delete().
+    unsigned long probes;      // Number of table slots examined by those calls.
+    unsigned long max_probes;  // Largest number of slots examined by a single call.
+    unsigned long rehashes;    // Number of times the table was rebuilt to clear tombstones.
+} DIGRAM_STATS;
+
+/*
+ * CONTEXTS
+ *
+ * All of the state used to build or read the grammar for one block (symbol storage,
+ * rules, the digram table and the rule map) is kept together in a SEQ_CTX, so that
+ * several blocks can be worked on at once, each by its own thread with its own context.
+ * Each thread works on the context pointed to by "current_ctx", which initially is a
+ * default context whose tables are allocated on the heap before main() runs (see
+ * seq_ctx_default_init() in context.c).  The names that the rest of the program uses
+ * for this state (num_symbols, main_rule, digram_table, and so on) are defined below
+ * as macros that refer to the corresponding fields of current_ctx.
+ */
+typedef struct seq_ctx {
+    struct symbol **slabs;             // Slabs of SYMBOL_SLAB_SIZE symbols each.
+    int nslabs;                        // Number of slabs allocated.
+    int slabs_cap;                     // Number of entries allocated in slabs.
+    int nsymbols;                      // Number of symbols handed out from the slabs.
+    int next_nonterminal;              // Value for the next nonterminal symbol to be created.
+    struct symbol *free_symbols;       // Recycled symbols available for re-use, linked by "next".
+    int nfree;                         // Number of symbols on free_symbols.
+    struct symbol *rules;              // Main rule, heading the list of all rules.
+    struct rule_links *links;          // Links of rule heads, indexed by value.
+    struct digram_entry *digrams;      // Digram hash table (MAX_DIGRAMS entries).
+    int *digram_dirty;                 // Slots of digrams filled since it was cleared.
+    int digram_dirty_count;            // Number of entries in digram_dirty.
+    int digram_dirty_overflow;         // Nonzero if digram_dirty overflowed.
+    int digram_live;                   // Number of digram table entries holding a digram.
+    int digram_tombstones;             // Number of digram table entries holding TOMBSTONE.
+    struct digram_stats digram_stats;  // Statistics on the use of the digram table.
+    struct symbol **rule_index;        // Map from symbol values to rules (decompression).
+    int *rule_dirty;                   // Values entered in rule_index since it was cleared.
+    int rule_dirty_count;              // Number of entries in rule_dirty.
+    int rule_dirty_overflow;           // Nonzero if rule_dirty overflowed.
+    struct expand_cache *expansion;    // Expansions of rules (decompression), or NULL.
+    struct entropy_coder *coder;       // Storage for entropy coding (see entropy.h), or NULL.
+    struct check_frame *checks;        // Work stack of check_digram() (see sequitur.c).
+    int checks_cap;                    // Number of frames allocated in checks.
+    int *values;                       // Values decoded in a run (UTF8_DECODE_BATCH, see utf8.h).
+    int options;                       // Compression options (VERBOSE_OPTION, ENTROPY_OPTION).
+} SEQ_CTX;
+
+/* Option bit (in global_options and in a context's options) that reports statistics (-v). */
+#define VERBOSE_OPTION 0x20
+
+/* The context in use by the calling thread. */
+extern __thread SEQ_CTX *current_ctx;
+
+SEQ_CTX *seq_ctx_new(void);
+void seq_ctx_free(SEQ_CTX *ctx);
+int seq_reserve(void **array, size_t *cap, size_t n, size_t size);
+
 /*
  * The following counter is used to allocate fresh values when new nonterminal symbols
- * need to be created.  It is initialized elsewhere, because to initialize it here
- * would result in a "multiple definition" link error, due to the inclusion of this
- * header in multiple source files.
+ * need to be created.  It is reset to FIRST_NONTERMINAL by init_symbols().
  */
-extern int next_nonterminal_value /* = FIRST_NONTERMINAL */;
+#define next_nonterminal_value (current_ctx->next_nonterminal)
 
 /*
- * We will not use general-purpose dynamic storage allocation (i.e. "malloc").
- * Instead, we statically declare an array of a fixed number of SYMBOL structures.
- * We will keep track of the number of such structures that are in use, and when
- * we need another one, we will use the first unused one.  This will suffice for
- * the decompression algorithm, where we only ever allocate symbols and never
- * free them.  The compression algorithm, on the other hand, does free symbols
- * from time to time, and in order to avoid running out of symbols unnecessarily
- * we will implement a "recyling facility" for symbols that are not currently
- * being used.
+ * Symbols are not allocated one at a time with "malloc".  Instead, each context keeps
+ * a pool of symbols, which is carved out of "slabs" of SYMBOL_SLAB_SIZE structures.
+ * We keep track of the number of symbols that have been handed out, and when we need
+ * another one, we use the first unused one, allocating a fresh slab once all of the
+ * existing ones are in use.  Slabs are kept from one block to the next, so the pool
+ * only grows as large as the largest block needs, and it costs little for small input.
+ * The decompression algorithm only ever allocates symbols and never frees them.
+ * The compression algorithm, on the other hand, does free symbols from time to time,
+ * and in order to avoid running out of symbols unnecessarily we implement a
+ * "recycling facility": symbols that are not currently being used are kept on a free
+ * list, linked through their own "next" fields, and are handed out again first.
  */
 
-/* The total number of pre-allocated symbols that we have at our disposal. */
-#define MAX_SYMBOLS 1000000
+/*
+ * In a debugging build, the value and reference count of a recycled symbol are set
+ * to SYMBOL_POISON, which no live symbol has, and its rule and prev links to
+ * SYMBOL_POISON_PTR, which is not a valid address.
+ */
+#ifdef DEBUG
+#define SYMBOL_POISON 0xdeadbeefU
+#define SYMBOL_POISON_PTR ((struct symbol *)0xdeadbeefdeadbeefULL)
+#endif
+
+/* The largest number of symbols that can be handed out from the slabs for a single block. */
+#define MAX_SYMBOLS (1 << 24)
+
+/* Symbols are allocated in slabs of this many structures. */
+#define SYMBOL_SLAB_SHIFT 14
+#define SYMBOL_SLAB_SIZE (1 << SYMBOL_SLAB_SHIFT)
 
 /* The maximum number of nonterminal symbols (limited by 2^21 Unicode code points). */
 #define SYMBOL_VALUE_MAX (1 << 21)
 
-/* Statically allocated storage for symbols (definition is in const.h). */
-extern SYMBOL symbol_storage[/*MAX_SYMBOLS*/];
-
-/* Total number of symbols that have been allocated from symbol_storage. */
-extern int num_symbols;
+/* Total number of symbols that have been handed out from the slabs of the current context. */
+#define num_symbols (current_ctx->nsymbols)
 
-/* Given a pointer to a symbol, obtain the index of the symbol in the symbol_storage array. */
-#define SYMBOL_INDEX(s) ((s) - symbol_storage)
+/*
+ * Given a pointer to a symbol, obtain the index of the symbol in the pool of the current
+ * context (the order in which it was first handed out), for use in debugging output.
+ * This searches the slabs, so it should not be used elsewhere.
+ */
+#define SYMBOL_INDEX(s) symbol_index(s)
+unsigned long symbol_index(struct symbol *s);
 
 /*
  * RULES
@@ -107,7 +195,7 @@ extern int num_symbols;
  * a non-NULL "rule" field that points back to the sentinel node itself.
  *
  * We also link rule heads together into a circular, doubly linked list of all rules,
- * using the "nextr" and "prevr" fields of the SYMBOL structure.  This list does not
+ * using the "nextr" and "prevr" links of the rule heads.  This list does not
  * use a sentinel node, but the global variable "main_rule" is used to point to a
  * distinguished "main rule" in the list, from which the other rules can be accessed:
  *
@@ -118,12 +206,20 @@ extern int num_symbols;
  */
 
 /*
- * The following variable (defined in const.h) points to the "main rule".
+ * The following variable (a field of the current context) points to the "main rule".
  * Note that when the first rule is assigned to it, the "nextr" and "prevr" fields
  * of that rule must be initialized to point back to the rule itself, in order
  * to properly represent a circular, doubly linked list with one element in it.
  */
-extern SYMBOL *main_rule;
+#define main_rule (current_ctx->rules)
+
+/*
+ * The "nextr" and "prevr" links of a rule head.  They are held by the current context,
+ * in a table indexed by the value of the head; this relies on no two rules of a block
+ * having heads with the same value.
+ */
+#define NEXTR(r) ((current_ctx->links + (r)->value)->nextr)
+#define PREVR(r) ((current_ctx->links + (r)->value)->prevr)
 
 /*
  * DIGRAMS
@@ -137,34 +233,72 @@ extern SYMBOL *main_rule;
  * currently exist in the rules being constructed.  For that purpose, we will use
  * a hash table.  For simplicity, and to avoid the need to be able to dynamically allocate
  * additional data structures for use in constructing the table, we will use an
- * "open-addressed" hash table, which simply consists of an array, each of whose entries
- * can be set to point to a digram currently in the table.  Completely unused entries
- * in the hash table have value NULL.  Deletions in an open-addressed hash table have
- * to be handled by leaving a "tombstone" (distinguishable from NULL) in place of the
- * deleted entry.  We define a special value TOMBSTONE for this purpose.
+ * "open-addressed" hash table, which simply consists of an array of entries, each of
+ * which can be set to point to a digram currently in the table.
+ *
+ * Each entry also carries the pair of symbol values of its digram, packed into a single
+ * 64-bit key, so that a probe can compare keys without following the digram's pointers
+ * into symbol storage.  Entries are 16 bytes, so four consecutive entries share a
+ * cache line and a typical lookup touches only one line of the table.
+ *
+ * Completely unused entries in the hash table have a NULL digram pointer.  Deletions
+ * in an open-addressed hash table have to be handled by leaving a "tombstone"
+ * (distinguishable from NULL) in place of the deleted entry.  We define a special
+ * value TOMBSTONE for this purpose.  A deleted entry that is followed by an unused
+ * one does not need a tombstone, however, because no probe sequence continues past it;
+ * such entries (and any tombstones immediately before them) are returned to the unused
+ * state on the spot.  The tombstones that remain lengthen the probe sequences of every
+ * later lookup, so once they make up more than a fixed fraction of the table, the table
+ * is rebuilt in place without them (see digram_rehash()).
  */
 
-/* The size of the digram hash table, which must be a prime number. */
-#define MAX_DIGRAMS 999983
+/* The size of the digram hash table, which must be a power of two. */
+#define MAX_DIGRAMS (1 << 21)
+
+/* Number of tombstones beyond which digram_put() first rebuilds the table. */
+#define DIGRAM_REHASH_TOMBSTONES (MAX_DIGRAMS / 8)
 
 /* Definition of the value to be used as a "tombstone" for deleted entries. */
 #define TOMBSTONE ((SYMBOL *)-1)
 
+/* An entry in the digram hash table. */
+typedef struct digram_entry {
+    uint64_t key;              // DIGRAM_KEY of the digram, or 0 if unused or a tombstone.
+    struct symbol *digram;     // First symbol of the digram, NULL if unused, or TOMBSTONE.
+} DIGRAM_ENTRY;
+
+/*
+ * Storage (held by the current context) for the digram hash table, which maps pairs
+ * of symbol values to digrams.
+ */
+#define digram_table (current_ctx->digrams)
+
 /*
- * Statically allocated storage (the actual definition is in const.h) for the digram
- * hash table, which maps pairs of symbol values to digrams.
+ * Packs the values of the two symbols of a digram into a table key.  Symbol values
+ * are less than SYMBOL_VALUE_MAX, so both fit; the top bit keeps every valid key nonzero.
  */
-extern SYMBOL *digram_table[/*MAX_DIGRAMS*/];
+#define DIGRAM_KEY(v1, v2) \
+    ((uint64_t)1 << 63 | (uint64_t)(unsigned int)(v1) << 32 | (uint64_t)(unsigned int)(v2))
 
 /*
  * Digram hash function: takes the two symbols of a digram and returns an
  * index into the hash table.  This index will serve as the starting point for
- * a "linear probing" search for a matching digram.  For further information on
- * open-addressed hash tables, linear probing, and deletion using tombstones,
- * refer to your favorite Data Structures book or to
+ * a "linear probing" search for a matching digram.  The key is run through a
+ * 64-bit finalizer (from MurmurHash3), so that every bit of both values affects
+ * the index and digrams such as (a,b) and (b,a) do not collide.  For further
+ * information on open-addressed hash tables, linear probing, and deletion using
+ * tombstones, refer to your favorite Data Structures book or to
  * https://en.wikipedia.org/wiki/Open_addressing
  */
-#define DIGRAM_HASH(v1, v2) (((v1) + (v2)) % MAX_DIGRAMS)
+static inline unsigned int digram_hash_key(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (unsigned int)k & (MAX_DIGRAMS - 1);
+}
+#define DIGRAM_HASH(v1, v2) digram_hash_key(DIGRAM_KEY(v1, v2))
 
 /*
  * FORMAT OF A COMPRESSED DATA TRANSMISSION
@@ -182,6 +316,9 @@ extern SYMBOL *digram_table[/*MAX_DIGRAMS*/];
  * is a Unicode code point (in the valid Unicode code space of U+0000 to U+10FFFF)
  * encoded as a sequence of one to four bytes using UTF-8 encoding.  The first symbol
  * is the head of the rule and the remaining symbols constitute the body of the rule.
+ * The first rule of a block is its main rule, which may consist of just two symbols,
+ * as it does for a block of a single byte; every other rule has at least two
+ * symbols in its body.
  * Symbols with values in the range U+0000 to U+00FF are terminal symbols, and must
  * not occur as the head of a rule.  Other symbols are nonterminal symbols.
  *
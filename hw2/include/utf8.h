@@ -0,0 +1,39 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+#include "sequitur.h"
+#include "bufio.h"
+
+/*
+ * UTF-8 CODING OF SYMBOLS
+ *
+ * Every symbol of a compressed block is written as the UTF-8 sequence (1 to 4 bytes)
+ * of its value.  Encoding and decoding one symbol at a time, through a handful of
+ * small functions and a bounds check per byte, costs far more than the work itself,
+ * so symbols are handled in runs instead.  The encoder writes a whole rule into space
+ * reserved in the writer in large chunks, and the decoder turns the bytes at hand in
+ * the reader's buffer into an array of values, classifying sixteen lead bytes at a
+ * time with SIMD instructions (or eight at a time with word operations where SSE2
+ * is not available) so that runs of single-byte sequences are copied without being
+ * looked at one by one.
+ *
+ * The decoder stops, without consuming it, at the first byte that does not begin a
+ * complete and well-formed sequence: a marker (a byte of the form 10xxxxxx), a lead
+ * byte that is not valid, a sequence with a bad continuation byte or that decodes
+ * to zero, or one that is cut off by the end of the bytes at hand.  The caller deals
+ * with that byte in the usual way.
+ */
+
+/* Number of bytes reserved in the writer at a time by utf8_encode_rule(). */
+#define UTF8_ENCODE_CHUNK 4096
+
+/* Number of values decoded at a time while reading the body of a rule. */
+#define UTF8_DECODE_BATCH 256
+
+int utf8_encode_rule(SYMBOL *rule, SEQ_WRITER *out);
+size_t utf8_decode_run(const unsigned char *p, size_t len, int *values, size_t max,
+                       size_t *used);
+
+#endif
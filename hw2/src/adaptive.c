@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "const.h"
+#include "sequitur.h"
+#include "debug.h"
+#include "bufio.h"
+#include "block_index.h"
+#include "entropy.h"
+
+/*
+ * Adaptive block size.
+ *
+ * With "-b auto", compress_adaptive() decides where each block ends as it goes,
+ * instead of cutting the input every "bsize" bytes.  The grammar for a block is
+ * built a byte at a time, as usual, and after every ADAPT_WINDOW bytes the cost of
+ * the grammar (an estimate of the number of bytes it would take to write it out)
+ * is taken again.  What the last window has added to it is what those bytes cost
+ * in this block; what the first window added is about what they would cost at the
+ * start of a new one.  As long as the data keeps repeating what the block has
+ * already seen, the last window costs much less than the first, and the block goes
+ * on.  Once it costs ADAPT_GAIN_PCT percent of the first or more, a larger block
+ * has stopped paying for itself, and a new one is started.  A block is not ended that way before it
+ * has ADAPT_MIN bytes, and it is always ended at ADAPT_MAX bytes, or once its
+ * grammar reaches the memory budget: more than ADAPT_SYMBOLS symbols, a digram
+ * table more than half full, or more than ADAPT_RULES nonterminals (which must
+ * stay below BLOCK_INDEX_HEAD).
+ *
+ * Data that does not compress gains nothing from a large block, and costs more in
+ * one, as its nonterminals get wider.  So if a block is ended at ADAPT_MIN bytes,
+ * or at the end of the input before that, and its grammar takes no fewer bytes to
+ * write out than its data as plain terminals would, the grammar is dropped, and
+ * the data is written in blocks of ADAPT_FALLBACK bytes, as it would have been
+ * without "-b auto".
+ *
+ * The transmission is an ordinary one, which any decompressor can read; with -v,
+ * the size of each block and the reason it was ended are reported to stderr.
+ */
+
+int compressBlock(unsigned char *block, size_t len, SEQ_WRITER *out);
+int compressWriteBlock(SYMBOL *head, SEQ_WRITER *out);
+SYMBOL *compressInitBlockFunctions();
+void compressBlockRules(int byte, SYMBOL *head);
+extern int compressedbytes;
+
+/* Number of bytes read from the input at a time. */
+#define ADAPT_READ (64 * 1024)
+
+/* Number of bytes between checks of the growth of the grammar. */
+#define ADAPT_WINDOW (16 * 1024)
+
+/* Smallest and largest number of bytes in a block that is not the last one. */
+#define ADAPT_MIN (32 * 1024)
+#define ADAPT_MAX (8 * 1024 * 1024)
+
+/* Size of the blocks in which data that does not compress is written: the default. */
+#define ADAPT_FALLBACK 1024
+
+/* Cost of a window, in percent of that of the first one, at which a block is ended. */
+#define ADAPT_GAIN_PCT 100
+
+/* Memory budget for the grammar of a block. */
+#define ADAPT_SYMBOLS (1 << 22)
+#define ADAPT_DIGRAMS (MAX_DIGRAMS / 2)
+#define ADAPT_RULES (1 << 19)
+
+/* The reasons for which a block can be ended. */
+#define ADAPT_EOF 0
+#define ADAPT_GAIN 1
+#define ADAPT_MEMORY 2
+#define ADAPT_SIZE 3
+#define ADAPT_NO_GAIN 4
+
+/* The name of a reason for which a block was ended, for -v. */
+static const char *adapt_reason(int why) {
+    switch(why) {
+    case ADAPT_EOF: return "end of input";
+    case ADAPT_GAIN: return "gain";
+    case ADAPT_MEMORY: return "memory";
+    case ADAPT_SIZE: return "size";
+    default: return "no gain";
+    }
+}
+
+/*
+ * Input buffer, holding the bytes at [pos, len) that have been read but not yet
+ * added to a grammar, and a copy of the first ADAPT_MIN bytes of the current block.
+ */
+typedef struct adapt_input {
+    FILE *in;
+    unsigned char *buf;
+    size_t pos;
+    size_t len;
+    unsigned char *start;
+} ADAPT_INPUT;
+
+/**
+ * Make sure that there is input in the buffer, reading more if it is empty.
+ *
+ * @return  Nonzero if there is input, 0 at the end of the input (or on an error).
+ */
+static int adapt_fill(ADAPT_INPUT *ai) {
+    if(ai->pos == ai->len) {
+        ai->pos = 0;
+        ai->len = fread(ai->buf, 1, ADAPT_READ, ai->in);
+    }
+    return ai->len > 0;
+}
+
+/**
+ * Estimate the number of bytes it would take to write out the grammar of the
+ * current block, taking every symbol to be as wide as the widest nonterminal.
+ */
+static unsigned long adapt_cost(void) {
+    SEQ_CTX *ctx = current_ctx;
+    int v = next_nonterminal_value;
+    int width = v < 0x800 ? 2 : v < 0x10000 ? 3 : 4;
+    return (unsigned long)(ctx->nsymbols - ctx->nfree) * width;
+}
+
+/**
+ * The number of bytes it takes to write out the grammar of the current block
+ * (without entropy coding): the UTF-8 sequences of its rules, and the marks
+ * between them.
+ */
+static unsigned long adapt_size(SYMBOL *head) {
+    unsigned long size = 0;
+    SYMBOL *rule = head;
+    do {
+        SYMBOL *s = rule;
+        do {
+            unsigned int v = s->value;
+            size += v < 0x80 ? 1 : v < 0x800 ? 2 : v < 0x10000 ? 3 : 4;
+            s = s->next;
+        } while(s != rule);
+        rule = NEXTR(rule);
+        size += rule != head;  // RD
+    } while(rule != head);
+    return size;
+}
+
+/**
+ * The number of bytes it would take to write out data as plain terminals, each
+ * encoded in UTF-8.
+ */
+static unsigned long adapt_plain(const unsigned char *data, size_t n) {
+    unsigned long cost = n;
+    for(const unsigned char *end = data + n; data < end; data++)
+        cost += *data >= 0x80;
+    return cost;
+}
+
+/**
+ * Decide, at the end of a window, whether the current block is to be ended.
+ *
+ * @param n  The number of bytes in the block so far.
+ * @param cost  The cost of the last window (see adapt_cost()).
+ * @param fresh  The cost of the first window of the block.
+ * @return  The reason for ending the block, or -1 if it is to go on.
+ */
+static int adapt_check(size_t n, unsigned long cost, unsigned long fresh) {
+    SEQ_CTX *ctx = current_ctx;
+    if(ctx->nsymbols >= ADAPT_SYMBOLS || ctx->digram_live >= ADAPT_DIGRAMS ||
+       next_nonterminal_value - FIRST_NONTERMINAL >= ADAPT_RULES) {
+        return ADAPT_MEMORY;
+    }
+    if(n >= ADAPT_MIN && cost * 100 >= fresh * ADAPT_GAIN_PCT) {
+        return ADAPT_GAIN;
+    }
+    return -1;
+}
+
+/**
+ * Build the grammar for one block, taking bytes from the input until the block is
+ * to be ended.
+ *
+ * @param head  The main rule of the block.
+ * @param len  Set to the number of bytes in the block.
+ * @return  The reason the block was ended; for ADAPT_NO_GAIN, a copy of the
+ * data of the block is in ai->start.
+ */
+static int adapt_block(ADAPT_INPUT *ai, SYMBOL *head, size_t *len) {
+    SEQ_CTX *ctx = current_ctx;
+    size_t n = 0;
+    unsigned long mark = 0;   // The cost of the grammar at the start of the window.
+    unsigned long fresh = 0;  // The cost of the first window.
+    int why = -1;
+
+    while(why < 0) {
+        if(!adapt_fill(ai)) {
+            why = ADAPT_EOF;
+            break;
+        }
+        // Take bytes up to the end of the window, the buffer, or the largest block.
+        size_t k = ADAPT_WINDOW - n % ADAPT_WINDOW;
+        if(k > ai->len - ai->pos)
+            k = ai->len - ai->pos;
+        if(k > ADAPT_MAX - n)
+            k = ADAPT_MAX - n;
+        if(n < ADAPT_MIN)
+            memcpy(ai->start + n, ai->buf + ai->pos, k);
+        for(unsigned char *p = ai->buf + ai->pos, *end = p + k; p < end; p++)
+            compressBlockRules(*p, head);
+        ai->pos += k;
+        n += k;
+
+        if(n == ADAPT_MAX) {
+            why = ADAPT_SIZE;
+        }
+        else if(n % ADAPT_WINDOW == 0) {
+            unsigned long cost = adapt_cost();
+            if(n == ADAPT_WINDOW)
+                fresh = cost;
+            // The grammar can shrink over a window, as rules are found.
+            why = adapt_check(n, cost > mark ? cost - mark : 0, fresh);
+            mark = cost;
+        }
+    }
+    if(n <= ADAPT_MIN && adapt_size(head) >= adapt_plain(ai->start, n)) {
+        why = ADAPT_NO_GAIN;
+    }
+    *len = n;
+    return why;
+}
+
+/**
+ * End a block whose grammar has been written out: enter it in the index, write the
+ * index if this is the last block of the transmission, and write the EOB mark.
+ *
+ * @param ix  The block index, or NULL if there is none.
+ * @param offset  The offset in the transmission at which the block starts.
+ * @param len  The number of bytes of data in the block.
+ * @param more  Nonzero if another block is known to follow.
+ * @return 0 on success, EOF if the output could not be written.
+ */
+static int adapt_end_block(ADAPT_INPUT *ai, SEQ_WRITER *w, BLOCK_INDEX *ix, size_t offset,
+                           size_t len, int more) {
+    if(ix != NULL && (block_index_add(ix, offset, len) ||
+                      (!more && !adapt_fill(ai) && block_index_write(ix, w)))) {
+        return EOF;
+    }
+    // One write per block.
+    if(seq_putc(w, 0x84) == EOF || seq_writer_flush(w)) { // EOB
+        return EOF;
+    }
+    return 0;
+}
+
+/**
+ * Write data that does not compress in blocks of ADAPT_FALLBACK bytes.
+ *
+ * @param ix  The block index, or NULL if there is none.
+ * @param len  The number of bytes of data, which are in ai->start.
+ * @return 0 on success, EOF if the output could not be written.
+ */
+static int adapt_write_fallback(ADAPT_INPUT *ai, SEQ_WRITER *w, BLOCK_INDEX *ix, size_t len) {
+    for(size_t pos = 0; pos < len; pos += ADAPT_FALLBACK) {
+        size_t offset = w->total;
+        size_t k = len - pos < ADAPT_FALLBACK ? len - pos : ADAPT_FALLBACK;
+        if(compressBlock(ai->start + pos, k, w) ||
+           adapt_end_block(ai, w, ix, offset, k, pos + k < len)) {
+            return EOF;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compression function for "-b auto".
+ * Produces a transmission like that of compress(), but with blocks whose sizes are
+ * chosen as described above.
+ *
+ * @param in  The stream from which input is to be read.
+ * @param out  The stream to which the compressed data is to be written.
+ * @param index  Nonzero if a block index is to be written at the end of the
+ * transmission (see block_index.h).
+ * @return  The number of bytes written, in case of success, otherwise EOF.
+ */
+int compress_adaptive(FILE *in, FILE *out, int index) {
+    ADAPT_INPUT ai = { .in = in };
+    BLOCK_INDEX ix = { 0 };
+    SEQ_WRITER w;
+    int failed = 0;
+
+    if(seq_writer_open(&w, out, SEQ_IOBUF_SIZE)) {
+        return EOF;
+    }
+    ai.buf = malloc(ADAPT_READ);
+    ai.start = malloc(ADAPT_MIN);
+    if(ai.buf == NULL || ai.start == NULL) {
+        free(ai.buf);
+        free(ai.start);
+        seq_writer_close(&w);
+        return EOF;
+    }
+
+    seq_putc(&w, SOT_MARK); // SOT
+    while(!failed && adapt_fill(&ai)) {
+        size_t offset = w.total;
+        size_t len;
+        SYMBOL *head = compressInitBlockFunctions();
+        int why = adapt_block(&ai, head, &len);
+        if(current_ctx->options & VERBOSE_OPTION) { // -v
+            fprintf(stderr, "block of %lu bytes ended by %s: %d symbols, %d nonterminal values\n",
+                    len, adapt_reason(why), current_ctx->nsymbols - current_ctx->nfree,
+                    next_nonterminal_value - FIRST_NONTERMINAL);
+            digram_report(stderr, len);
+        }
+        if(why == ADAPT_NO_GAIN) {
+            failed = adapt_write_fallback(&ai, &w, index ? &ix : NULL, len);
+        }
+        else {
+            failed = compressWriteBlock(head, &w) ||
+                     adapt_end_block(&ai, &w, index ? &ix : NULL, offset, len, 0);
+        }
+    }
+    free(ai.buf);
+    free(ai.start);
+    block_index_free(&ix);
+    seq_putc(&w, 0x82); // EOT
+
+    if(seq_writer_close(&w) || failed || ferror(in) || fflush(out) == EOF) {
+        return EOF;
+    }
+    compressedbytes = w.total;
+    return compressedbytes;
+}
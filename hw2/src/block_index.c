@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block_index.h"
+#include "debug.h"
+
+/*
+ * Reading and writing the optional block index.
+ * See block_index.h for the format.
+ */
+
+static const char *block_index_magic = "SQIX";
+
+/* Number of bytes in the RD mark and the head of the index rule that precede the entries. */
+#define INDEX_HEAD_BYTES 5
+
+/* Write the RD mark and the head of the index rule. */
+static void index_put_head(unsigned char *p) {
+    *p++ = 0x85; // RD
+    *p++ = 0xf0 | (BLOCK_INDEX_HEAD >> 18);
+    *p++ = 0x80 | ((BLOCK_INDEX_HEAD >> 12) & 0x3f);
+    *p++ = 0x80 | ((BLOCK_INDEX_HEAD >> 6) & 0x3f);
+    *p = 0x80 | (BLOCK_INDEX_HEAD & 0x3f);
+}
+
+/* Number of base-32 digits needed to write a number. */
+static int index_digits(uint64_t n) {
+    int d = 1;
+    while(n >>= 5)
+        d++;
+    return d;
+}
+
+/* Write a number using exactly "digits" base-32 digits. */
+static void index_put_number(unsigned char *p, uint64_t n, int digits) {
+    for(int i = digits - 1; i >= 0; i--) {
+        *(p + i) = (i == digits - 1 ? 0x60 : 0x40) | (n & 0x1f);
+        n >>= 5;
+    }
+}
+
+/*
+ * Read a number starting at *pp, not going past end, and advance *pp past it.
+ * Returns 0 on success, -1 if the bytes there do not form a number.
+ */
+static int index_get_number(const unsigned char **pp, const unsigned char *end, uint64_t *np) {
+    uint64_t n = 0;
+    for(const unsigned char *p = *pp; p < end; p++) {
+        if(*p < 0x40 || *p > 0x7f || n >> 59)
+            return -1;
+        n = n << 5 | (*p & 0x1f);
+        if(*p >= 0x60) {
+            *pp = p + 1;
+            *np = n;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Add an entry for the next block to an index.
+ *
+ * @param ix  The index, which should be zeroed before the first call.
+ * @param offset  The offset of the SOB mark of the block in the transmission.
+ * @param length  The number of bytes of data in the block.
+ * @return 0 on success, -1 if memory for the entry could not be allocated.
+ */
+int block_index_add(BLOCK_INDEX *ix, uint64_t offset, uint64_t length) {
+    if(ix->count == ix->cap) {
+        size_t cap = ix->cap ? 2 * ix->cap : 64;
+        uint64_t *o = realloc(ix->offset, cap * sizeof(uint64_t));
+        if(o == NULL)
+            return -1;
+        ix->offset = o;
+        uint64_t *l = realloc(ix->length, cap * sizeof(uint64_t));
+        if(l == NULL)
+            return -1;
+        ix->length = l;
+        ix->cap = cap;
+    }
+    uint64_t prev = ix->count ? *(ix->offset + ix->count - 1) : 0;
+    *(ix->offset + ix->count) = offset;
+    *(ix->length + ix->count) = length;
+    ix->count++;
+    ix->bytes += index_digits(offset - prev) + index_digits(length);
+    return 0;
+}
+
+/**
+ * Write an index, as the final rule of the last block of a transmission.
+ * The output must be positioned just before the EOB mark of the last block;
+ * the RD mark that separates the index from the preceding rule is written here.
+ * Nothing is written if the index is empty or too large (see BLOCK_INDEX_MAX_BYTES).
+ *
+ * @return 0 on success, EOF on a write error.
+ */
+int block_index_write(BLOCK_INDEX *ix, SEQ_WRITER *out) {
+    if(ix->count == 0 || ix->bytes > BLOCK_INDEX_MAX_BYTES)
+        return 0;
+    // RD, the four-byte head, the entries and the trailer up to the EOB mark.
+    size_t len = INDEX_HEAD_BYTES + ix->bytes + BLOCK_INDEX_TRAILER - 2;
+    unsigned char *buf = malloc(len);
+    if(buf == NULL)
+        return EOF;
+    index_put_head(buf);
+    unsigned char *p = buf + INDEX_HEAD_BYTES;
+    uint64_t prev = 0;
+    for(size_t i = 0; i < ix->count; i++) {
+        uint64_t delta = *(ix->offset + i) - prev;
+        uint64_t length = *(ix->length + i);
+        index_put_number(p, delta, index_digits(delta));
+        p += index_digits(delta);
+        index_put_number(p, length, index_digits(length));
+        p += index_digits(length);
+        prev = *(ix->offset + i);
+    }
+    index_put_number(p, ix->bytes, 8);
+    p += 8;
+    memcpy(p, block_index_magic, 4);
+    int ret = seq_write(out, buf, len);
+    free(buf);
+    return ret;
+}
+
+/**
+ * Read the index, if there is one, from the end of a transmission in a regular file.
+ *
+ * @param ix  The index to be filled in, which should be zeroed beforehand.
+ * @param fd  A file descriptor for the file, which is read using pread(), so that
+ * its offset is not disturbed.
+ * @return 0 on success, -1 if the file has no (valid) index or could not be read.
+ */
+int block_index_read(BLOCK_INDEX *ix, int fd) {
+    struct stat st;
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < 1 + BLOCK_INDEX_TRAILER)
+        return -1;
+    off_t end = st.st_size - BLOCK_INDEX_TRAILER;
+    unsigned char *trailer = malloc(BLOCK_INDEX_TRAILER);
+    if(trailer == NULL || pread(fd, trailer, BLOCK_INDEX_TRAILER, end) != BLOCK_INDEX_TRAILER ||
+       memcmp(trailer + 8, block_index_magic, 4) || *(trailer + 12) != 0x84 ||
+       *(trailer + 13) != 0x82) {
+        free(trailer);
+        return -1;
+    }
+    const unsigned char *p = trailer;
+    uint64_t bytes;
+    int bad = index_get_number(&p, trailer + 8, &bytes) || p != trailer + 8 ||
+              bytes > BLOCK_INDEX_MAX_BYTES;
+    free(trailer);
+    if(bad || bytes + INDEX_HEAD_BYTES > (uint64_t)end)
+        return -1;
+
+    // The entries are preceded by an RD mark and the head of the index rule, which
+    // are checked against a copy made after them in the same buffer.
+    size_t len = INDEX_HEAD_BYTES + bytes;
+    unsigned char *buf = malloc(len + INDEX_HEAD_BYTES);
+    if(buf == NULL || pread(fd, buf, len, end - len) != (ssize_t)len) {
+        free(buf);
+        return -1;
+    }
+    index_put_head(buf + len);
+    if(memcmp(buf, buf + len, INDEX_HEAD_BYTES)) {
+        free(buf);
+        return -1;
+    }
+    const unsigned char *q = buf + INDEX_HEAD_BYTES;
+    const unsigned char *stop = buf + len;
+    uint64_t offset = 0;
+    int ret = 0;
+    while(q < stop) {
+        uint64_t delta, length;
+        if(index_get_number(&q, stop, &delta) || index_get_number(&q, stop, &length) ||
+           delta == 0 || offset + delta >= (uint64_t)end ||
+           block_index_add(ix, offset + delta, length)) {
+            ret = -1;
+            break;
+        }
+        offset += delta;
+    }
+    free(buf);
+    if(ret || ix->count == 0) {
+        debug("Ignoring malformed block index");
+        block_index_free(ix);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release the storage held by an index, leaving it empty.
+ */
+void block_index_free(BLOCK_INDEX *ix) {
+    free(ix->offset);
+    free(ix->length);
+    memset(ix, 0, sizeof(BLOCK_INDEX));
+}
@@ -0,0 +1,193 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bufio.h"
+#include "debug.h"
+
+/*
+ * Block-buffered readers and writers for the compressed and uncompressed streams.
+ * See bufio.h for the rationale.
+ */
+
+/**
+ * Initialize a reader on a stream.
+ *
+ * @param r  The reader to initialize.
+ * @param fp  The stream to be read.  Input that has already been read from it
+ * through stdio, or pushed back onto it, is still seen by the reader.
+ * @param cap  The number of bytes to request from the stream per refill.
+ * @return 0 on success, -1 if the buffer could not be allocated.
+ */
+int seq_reader_open(SEQ_READER *r, FILE *fp, size_t cap) {
+    struct stat st;
+    int fd = fileno(fp);
+    r->fp = fp;
+    r->cap = cap;
+    r->pos = r->len = 0;
+    r->pipe = fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    r->buf = malloc(cap);
+    return r->buf ? 0 : -1;
+}
+
+/**
+ * Initialize a reader on data that is already in memory.  The reader does not
+ * take ownership of the data, and must not be closed with seq_reader_close().
+ *
+ * @param r  The reader to initialize.
+ * @param buf  The data to be read.
+ * @param len  The number of bytes of data.
+ */
+void seq_reader_open_buffer(SEQ_READER *r, unsigned char *buf, size_t len) {
+    r->fp = NULL;
+    r->buf = buf;
+    r->cap = r->len = len;
+    r->pos = 0;
+    r->pipe = 0;
+}
+
+/**
+ * Release the buffer held by a reader.  Any unread buffered input is discarded.
+ */
+void seq_reader_close(SEQ_READER *r) {
+    free(r->buf);
+    r->buf = NULL;
+    r->pos = r->len = 0;
+}
+
+/**
+ * Refill a reader whose buffer has been consumed.
+ * A pipe or FIFO is read without waiting for a full buffer, as a plain fread() would,
+ * so that input arriving through it can be handled as it comes in: one byte is read
+ * with fread(), which waits for input if there is none, and then whatever else is
+ * ready is taken with fread() on the descriptor in non-blocking mode.  All of the
+ * reading goes through stdio, so anything it has buffered or had pushed back is
+ * returned first.  For other streams, a short fread() means the end of the input.
+ *
+ * @return  The number of bytes now available, 0 at end of input or on error.
+ */
+int seq_reader_fill(SEQ_READER *r) {
+    if(r->fp == NULL)
+        return 0;
+    r->pos = 0;
+    if(!r->pipe) {
+        r->len = fread(r->buf, 1, r->cap, r->fp);
+        return (int)r->len;
+    }
+    int fd = fileno(r->fp);
+    int flags;
+    r->len = fread(r->buf, 1, 1, r->fp);
+    if(r->len && r->cap > 1 && (flags = fcntl(fd, F_GETFL)) != -1 &&
+       fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0) {
+        r->len += fread(r->buf + 1, 1, r->cap - 1, r->fp);
+        // Running out of ready input shows up as an error (EAGAIN) on the stream;
+        // any real error will be met again by the next, blocking, read.
+        if(ferror(r->fp))
+            clearerr(r->fp);
+        fcntl(fd, F_SETFL, flags);
+    }
+    return (int)r->len;
+}
+
+/**
+ * Initialize a writer on a stream.
+ *
+ * @param w  The writer to initialize.
+ * @param fp  The stream to which output is to be written, or NULL for a writer
+ * that just collects its output in memory, growing its buffer as needed.
+ * @param cap  The size of the output buffer (the initial size, if fp is NULL).
+ * @return 0 on success, -1 if the buffer could not be allocated.
+ */
+int seq_writer_open(SEQ_WRITER *w, FILE *fp, size_t cap) {
+    w->fp = fp;
+    w->cap = cap;
+    w->len = 0;
+    w->total = 0;
+    w->err = 0;
+    w->buf = malloc(cap);
+    return w->buf ? 0 : -1;
+}
+
+/**
+ * Write any pending output to the underlying stream.
+ *
+ * @return 0 on success, EOF if the write failed (in which case the writer stays
+ * in an error state and all further output is refused).
+ */
+int seq_writer_flush(SEQ_WRITER *w) {
+    if(w->err)
+        return EOF;
+    if(w->fp == NULL)
+        return seq_writer_grow(w, w->cap);
+    if(w->len && fwrite(w->buf, 1, w->len, w->fp) != w->len) {
+        debug("Short write while flushing %lu bytes", w->len);
+        w->err = 1;
+        return EOF;
+    }
+    w->len = 0;
+    return 0;
+}
+
+/**
+ * Enlarge the buffer of a memory writer (one with no stream) by at least n bytes.
+ * Flushing such a writer just makes more room, so that it never loses output.
+ *
+ * @return 0 on success, EOF if the buffer could not be enlarged.
+ */
+int seq_writer_grow(SEQ_WRITER *w, size_t n) {
+    size_t cap = w->cap + (n > w->cap ? n : w->cap);
+    unsigned char *buf = realloc(w->buf, cap);
+    if(buf == NULL) {
+        debug("Could not grow output buffer to %lu bytes", cap);
+        w->err = 1;
+        return EOF;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return 0;
+}
+
+/**
+ * Flush a writer and release its buffer.  The underlying stream is not closed.
+ *
+ * @return 0 on success, EOF if any write performed through this writer failed.
+ */
+int seq_writer_close(SEQ_WRITER *w) {
+    int ret = w->fp ? seq_writer_flush(w) : (w->err ? EOF : 0);
+    free(w->buf);
+    w->buf = NULL;
+    return ret;
+}
+
+/**
+ * Append a run of bytes to a writer.  Runs larger than the buffer are passed
+ * straight through to the stream.
+ *
+ * @return 0 on success, EOF on a write error.
+ */
+int seq_write(SEQ_WRITER *w, const void *src, size_t n) {
+    const unsigned char *p = src;
+    if(w->err)
+        return EOF;
+    if(w->cap - w->len < n) {
+        if(w->fp == NULL) {
+            if(seq_writer_grow(w, n))
+                return EOF;
+        }
+        else if(seq_writer_flush(w))
+            return EOF;
+        else if(n >= w->cap) {
+            if(fwrite(p, 1, n, w->fp) != n) {
+                w->err = 1;
+                return EOF;
+            }
+            w->total += n;
+            return 0;
+        }
+    }
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+    w->total += n;
+    return 0;
+}
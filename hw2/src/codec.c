@@ -0,0 +1,106 @@
+#include "const.h"
+#include "sequitur.h"
+#include "debug.h"
+#include "bufio.h"
+#include "codec.h"
+#include "entropy.h"
+
+/*
+ * In-memory codec.
+ * See codec.h for an overview.
+ *
+ * Both functions make the given context current for the calling thread while they
+ * run (current_ctx is thread-local), and put back the one that was current before.
+ * Compression also masks VERBOSE_OPTION out of the context's options for the
+ * duration, so that compressBlock() never reports to stderr.
+ */
+
+int compressBlock(unsigned char *block, size_t len, SEQ_WRITER *out);
+int decompressBlocks(SEQ_READER *in, SEQ_WRITER *out);
+
+/**
+ * Hand the contents of a memory writer over to the caller, or release them if
+ * the call has failed.
+ *
+ * @return 0 on success, -1 if the call had failed or the writer is in error.
+ */
+static int codec_finish(SEQ_WRITER *w, int failed, unsigned char **out, size_t *outlen) {
+    if(failed || w->err) {
+        seq_writer_close(w);
+        return -1;
+    }
+    *out = w->buf;
+    *outlen = w->len;
+    return 0;
+}
+
+/**
+ * Compress a buffer, as compress() would compress a stream with the same contents.
+ *
+ * @param ctx  The context to be used, which no other thread may be using; its
+ * options select entropy coding.
+ * @param in  The data to be compressed.
+ * @param n  The number of bytes of data.
+ * @param bsize  The maximum number of bytes of data represented by each block.
+ * @param out  Set to a newly allocated buffer holding the transmission.
+ * @param outlen  Set to the length of the transmission.
+ * @return 0 on success, -1 on error (bad arguments, or storage could not be allocated).
+ */
+int seq_compress_buf(SEQ_CTX *ctx, const unsigned char *in, size_t n, int bsize,
+                     unsigned char **out, size_t *outlen) {
+    SEQ_WRITER w;
+    int failed = 0;
+
+    if(ctx == NULL || (in == NULL && n > 0) || bsize <= 0 ||
+       seq_writer_open(&w, NULL, 4 * (n < (size_t)bsize ? n : (size_t)bsize) + 16)) {
+        return -1;
+    }
+    SEQ_CTX *saved = current_ctx;
+    int options = ctx->options;
+    current_ctx = ctx;
+    ctx->options &= ~VERBOSE_OPTION;
+
+    seq_putc(&w, SOT_MARK); // SOT
+    for(size_t pos = 0; pos < n && !failed; pos += bsize) {
+        size_t len = n - pos < (size_t)bsize ? n - pos : (size_t)bsize;
+        // compressBlock() only reads the block.
+        failed = compressBlock((unsigned char *)in + pos, len, &w) ||
+                 seq_putc(&w, 0x84) == EOF; // EOB
+    }
+    seq_putc(&w, 0x82); // EOT
+
+    ctx->options = options;
+    current_ctx = saved;
+    return codec_finish(&w, failed, out, outlen);
+}
+
+/**
+ * Decompress a buffer holding a transmission, as decompress() would decompress a
+ * stream with the same contents.
+ *
+ * @param ctx  The context to be used, which no other thread may be using.
+ * @param in  The transmission.
+ * @param n  The number of bytes in the transmission.
+ * @param out  Set to a newly allocated buffer holding the data.
+ * @param outlen  Set to the length of the data.
+ * @return 0 on success, -1 if the transmission is malformed or storage could not
+ * be allocated.
+ */
+int seq_decompress_buf(SEQ_CTX *ctx, const unsigned char *in, size_t n,
+                       unsigned char **out, size_t *outlen) {
+    SEQ_READER r;
+    SEQ_WRITER w;
+
+    if(ctx == NULL || (in == NULL && n > 0) || seq_writer_open(&w, NULL, SEQ_IOBUF_SIZE)) {
+        return -1;
+    }
+    SEQ_CTX *saved = current_ctx;
+    current_ctx = ctx;
+
+    // The reader only reads from the buffer.
+    seq_reader_open_buffer(&r, (unsigned char *)in, n);
+    int failed = decompressBlocks(&r, &w) != 0;
+
+    current_ctx = saved;
+    return codec_finish(&w, failed, out, outlen);
+}
@@ -1,6 +1,11 @@
 #include "const.h"
 #include "sequitur.h"
 #include "debug.h"
+#include "bufio.h"
+#include "block_index.h"
+#include "expand.h"
+#include "utf8.h"
+#include "entropy.h"
 
 // Function prototoypes
 static inline int isMarker(int byte);
@@ -12,33 +17,35 @@ static inline int isSOB(int b);
 static inline int isEOB(int b);
 static inline int isRD(int b);
 int isNonterminalStart(int byte);
-int getNextNonterminalByte(FILE *in, FILE *out);
-int makeNonterminalNext(int span, int prevbyte, FILE *in, FILE *out);
+int getNextNonterminalByte(SEQ_READER *in, SEQ_WRITER *out);
+int makeNonterminalNext(int span, int prevbyte, SEQ_READER *in, SEQ_WRITER *out);
 int isTerminalSingle(int byte);
 int isTerminalDouble(int byte);
-int getNextTerminalByte(FILE *in, FILE *out);
-int makeTerminalNext(int prevbyte, FILE *in, FILE *out);
+int getNextTerminalByte(SEQ_READER *in, SEQ_WRITER *out);
+int makeTerminalNext(int prevbyte, SEQ_READER *in, SEQ_WRITER *out);
 static inline int getUTF1(int num);
 int getUTF2(int num);
 int getUTF3(int num);
 int getUTF4(int num);
-int readRuleData(FILE *in, FILE *out);
-int readBlockData(FILE *in, FILE *out);
-int mapBodyRules(SYMBOL *head, FILE *in, FILE *out);
+int readRuleData(SEQ_READER *in, SEQ_WRITER *out, int mainrule);
+int readBlockData(SEQ_READER *in, SEQ_WRITER *out, int coded);
+int mapBodyRules(SYMBOL *head, SEQ_READER *in, SEQ_WRITER *out);
+int decompressBlocks(SEQ_READER *in, SEQ_WRITER *out);
 
-int determineUTFByteSize(int value);
-int convertToUTF(int value, int bytesize, FILE *out);
 static int mask0 = 0b00111111;
 static int mask1 = 0b0011111100000000;
 static int mask2 = 0b001111110000000000000000;
 static int mask3 = 0b00000111000000000000000000000000;
-static const int UTF_MASK_1_1 = 0b11000000;
-static const int UTF_MASK_1_2 = 0b10000000;
-static const int UTF_MASK_2_1 = 0b11100000;
-static const int UTF_MASK_3_1 = 0b11110000;
 SYMBOL *compressInitBlockFunctions();
-int compressBlockRules(int byte, SYMBOL *head, FILE *in);
-int compressWriteRuleBody(SYMBOL *rule, FILE *out);
+void compressBlockRules(int byte, SYMBOL *head);
+int compressWriteRuleBody(SYMBOL *rule, SEQ_WRITER *out);
+int compressBlock(unsigned char *block, size_t len, SEQ_WRITER *out);
+int compressWriteBlock(SYMBOL *head, SEQ_WRITER *out);
+int compressStream(FILE *in, FILE *out, int bsize, BLOCK_INDEX *ix);
+int decompressBlock(SEQ_READER *in, SEQ_WRITER *out, int coded);
+int decompressBlockRange(SEQ_READER *in, SEQ_WRITER *out, uint64_t *skip, uint64_t *len,
+                         int coded);
+int parseNumber(char *string, int max);
 
 int writeouts = 0;
 int compressedbytes = 0;
@@ -71,115 +78,133 @@ int compressedbytes = 0;
  * otherwise EOF.
  */
 int compress(FILE *in, FILE *out, int bsize) {
-    if(fputc(0x81, out) == EOF) {
-        return EOF;
-    }
-    int byte = fgetc(in);
-    compressedbytes++;
+    return compressStream(in, out, bsize, NULL);
+}
 
+/**
+ * Compression function behind compress().
+ *
+ * @param ix  If not NULL, an (initially empty) index that is filled in with an entry
+ * for each block and written at the end of the last block (see block_index.h).
+ * @return  The number of bytes written, in case of success, otherwise EOF.
+ */
+int compressStream(FILE *in, FILE *out, int bsize, BLOCK_INDEX *ix) {
+    SEQ_WRITER w;
+    unsigned char *block;
+    size_t nread;
+    int failed = 0;
 
-    while(byte != EOF) {
-        SYMBOL *head = compressInitBlockFunctions();
+    if(bsize <= 0) {
+        return EOF;
+    }
+    // Each input byte costs at most one 4-byte symbol in the output, so this
+    // capacity lets a whole block be encoded before the buffer is drained.
+    if(seq_writer_open(&w, out, 4 * (size_t)bsize + SEQ_IOBUF_SIZE)) {
+        return EOF;
+    }
+    block = malloc(bsize);
+    if(block == NULL) {
+        seq_writer_close(&w);
+        return EOF;
+    }
 
-        // Loop for reading text file of blocksize
-        int bsizeCounter = 0;
-        while(bsizeCounter < bsize){
-            int cbrRet = compressBlockRules(byte, head, in);
-            if(!cbrRet) { // Break out of the loop when the byte is EOF
-                break;
-            }
-            bsizeCounter++;
-            byte = fgetc(in);
-            if(byte == EOF) {
-                break;
-            }
-            // debug("Got byte: %d", byte);
-            // debug("bsizeCounter: %d", bsizeCounter);
+    seq_putc(&w, SOT_MARK); // SOT
+    nread = fread(block, 1, bsize, in);
+    while(nread > 0) {
+        size_t offset = w.total;
+        if(compressBlock(block, nread, &w) || (ix && block_index_add(ix, offset, nread))) {
+            failed = 1;
+            break;
         }
-
-        if( fputc(0x83, out) == EOF) {// SOB
-            return EOF;
+        // Read ahead, to find out whether this was the last block.
+        nread = fread(block, 1, bsize, in);
+        if(ix && nread == 0 && block_index_write(ix, &w)) {
+            failed = 1;
+            break;
         }
-        compressedbytes++;
-
-
-
-        SYMBOL *ruleptr = head;
-        do { // Loop to write output file with existing rules
-            if(!compressWriteRuleBody(ruleptr, out)) {
-                return EOF;
-            }
-            ruleptr = ruleptr->nextr;
-            if(ruleptr != head) { // RD
-                if(fputc(0x85, out) == EOF) {
-                    return EOF;
-                }
-                compressedbytes++;
-
-            }
-        } while(ruleptr != head);
-
-        if( fputc(0x84, out) == EOF) {// EOB
-            return EOF;
+        // One write per block.
+        if(seq_putc(&w, 0x84) == EOF || seq_writer_flush(&w)) { // EOB
+            failed = 1;
+            break;
         }
-                compressedbytes++;
-
     }
-    if( fputc(0x82, out) == EOF) {
+    free(block);
+    seq_putc(&w, 0x82); // EOT
+
+    if(seq_writer_close(&w) || failed || fflush(out) == EOF) {
         return EOF;
     }
-    compressedbytes++;
-
-
-    fflush(out);
+    compressedbytes = w.total;
     return compressedbytes;
 }
 
 
 /**
- * Writes out the rule body to FILE out
+ * Compresses one block of input, using the current context, and appends the
+ * resulting block, from its SOB mark up to but not including its EOB mark, to
+ * the output buffer.  The caller writes the EOB mark, so that it can first
+ * add anything else that belongs at the end of the block.
  *
- * @return 0 if fail write, 1 if success
+ * @param block  The uncompressed data.
+ * @param len  The number of bytes of data in the block.
+ * @param out  The buffer to which the compressed block is to be written.
+ * @return 0 on success, EOF if the output could not be written.
  */
-int compressWriteRuleBody(SYMBOL *rule, FILE *out) {
-    debug("compressWriteRuleBody value of rule: %d", rule->value);
-    SYMBOL *symptr = rule;
-    int value = rule->value;
-    int bytesize = determineUTFByteSize(value);
-    int convtoUTF = convertToUTF(value, bytesize, out);
-    if(!convtoUTF) {
-        return 0;
+int compressBlock(unsigned char *block, size_t len, SEQ_WRITER *out) {
+    SYMBOL *head = compressInitBlockFunctions();
+    for(size_t i = 0; i < len; i++) {
+        compressBlockRules(*(block + i), head);
     }
-    symptr = symptr->next;
-    while(symptr != rule) {
-        value = symptr->value;
-        bytesize = determineUTFByteSize(value);
-        convtoUTF = convertToUTF(value, bytesize, out);
-        if(!convtoUTF) {
-            return 0;
-        }
-        symptr = symptr->next;
+    if(current_ctx->options & VERBOSE_OPTION) { // -v
+        digram_report(stderr, len);
     }
-    return 1;
+    return compressWriteBlock(head, out);
 }
 
-
 /**
- * Processes the inner body of the while loop for each block
+ * Writes the grammar built for a block, from its SOB mark up to but not including
+ * its EOB mark, to the output buffer.
  *
- * @return 1 If successfully completed the inner functions
- * @return 0 If the
+ * @param head  The main rule of the block.
+ * @param out  The buffer to which the compressed block is to be written.
+ * @return 0 on success, EOF if the output could not be written.
  */
-int compressBlockRules(int byte, SYMBOL *head, FILE *in) {
-    if(byte == EOF) {
-        return 0;
+int compressWriteBlock(SYMBOL *head, SEQ_WRITER *out) {
+    seq_putc(out, 0x83); // SOB
+    if(current_ctx->options & ENTROPY_OPTION) {
+        return entropy_write_block(head, out);
     }
+    SYMBOL *ruleptr = head;
+    do { // Loop to write output file with existing rules
+        if(!compressWriteRuleBody(ruleptr, out)) {
+            return EOF;
+        }
+        ruleptr = NEXTR(ruleptr);
+        if(ruleptr != head) { // RD
+            seq_putc(out, 0x85);
+        }
+    } while(ruleptr != head);
+    return out->err ? EOF : 0;
+}
+
+/**
+ * Writes out the rule body to the output buffer
+ *
+ * @return 0 if fail write, 1 if success
+ */
+int compressWriteRuleBody(SYMBOL *rule, SEQ_WRITER *out) {
+    debug("compressWriteRuleBody value of rule: %d", rule->value);
+    return utf8_encode_rule(rule, out) == 0;
+}
+
+/**
+ * Processes the inner body of the while loop for each block:
+ * appends one input byte to the main rule and restores the grammar invariants.
+ */
+void compressBlockRules(int byte, SYMBOL *head) {
     SYMBOL *sym = new_symbol(byte, NULL);
     insert_after(head->prev, sym);
-    // debug("Before check");
     check_digram(sym->prev);
-    // debug("Previous head value: %d", head->prev->value);
-    return 1;
 }
 
 /**
@@ -197,77 +222,6 @@ SYMBOL *compressInitBlockFunctions() {
     return head;
 }
 
-/**
- * Given a value, convert the value to bytes in UTF and fputc it
- *
- * @return 0 fail file write, 1 for success file write
- */
-int convertToUTF(int value, int bytesize, FILE *out) {
-    if (value <= 0x7F) {
-        // 1-byte UTF-8
-        if (fputc(value, out) == EOF) return 0;
-        compressedbytes++;
-        return 1;
-    }
-    
-    if (value <= 0x7FF) {
-        // 2-byte UTF-8 - optimized bit manipulation
-        int byte1 = UTF_MASK_1_1 | (value >> 6);
-        int byte2 = UTF_MASK_1_2 | (value & 0x3F);
-        
-        if (fputc(byte1, out) == EOF || fputc(byte2, out) == EOF) return 0;
-        compressedbytes += 2;
-        return 1;
-    }
-    
-    if (value <= 0xFFFF) {
-        // 3-byte UTF-8
-        int byte1 = UTF_MASK_2_1 | (value >> 12);
-        int byte2 = UTF_MASK_1_2 | ((value >> 6) & 0x3F);
-        int byte3 = UTF_MASK_1_2 | (value & 0x3F);
-        
-        if (fputc(byte1, out) == EOF || fputc(byte2, out) == EOF || 
-            fputc(byte3, out) == EOF) return 0;
-        compressedbytes += 3;
-        return 1;
-    }
-    
-    if (value <= 0x10FFFF) {
-        // 4-byte UTF-8
-        int byte1 = UTF_MASK_3_1 | (value >> 18);
-        int byte2 = UTF_MASK_1_2 | ((value >> 12) & 0x3F);
-        int byte3 = UTF_MASK_1_2 | ((value >> 6) & 0x3F);
-        int byte4 = UTF_MASK_1_2 | (value & 0x3F);
-        
-        if (fputc(byte1, out) == EOF || fputc(byte2, out) == EOF || 
-            fputc(byte3, out) == EOF || fputc(byte4, out) == EOF) return 0;
-        compressedbytes += 4;
-        return 1;
-    }
-    
-    return 0;
-}
-
-/**
- * Given a value, determine the length of the UTF value in bytes
- */
-int determineUTFByteSize(int value) {
-    if(value <= 0x7f) {
-        return 1;
-    }
-    else if(value <= 0x7ff) {
-        return 2;
-    }
-    else if(value < 0xffff) {
-        return 3;
-    }
-    else if(value < 0x10ffff) {
-        return 4;
-    }
-    debug("Invalid return.");
-    return 0;
-}
-
 /**
  * Main decompression function.
  * Reads a compressed data transmission from an input stream, expands it,
@@ -279,102 +233,145 @@ int determineUTFByteSize(int value) {
  * @return  The number of bytes written, in case of success, otherwise EOF.
  */
 int decompress(FILE *in, FILE *out) {
+    SEQ_READER r;
+    SEQ_WRITER w;
+    int ret;
+
     writeouts = 0;
-    init_symbols();
-    init_rules();
+    if(seq_reader_open(&r, in, SEQ_IOBUF_SIZE)) {
+        return EOF;
+    }
+    if(seq_writer_open(&w, out, SEQ_IOBUF_SIZE)) {
+        seq_reader_close(&r);
+        return EOF;
+    }
+
+    // Whatever was expanded before an error is still delivered to the output.
+    ret = decompressBlocks(&r, &w);
+    seq_reader_close(&r);
+    writeouts = w.total;
+    if(seq_writer_close(&w) || ret == EOF) {
+        return EOF;
+    }
+
+    fflush(out);
+
+    return writeouts;
+}
+
+/**
+ * Parses the transmission from the reader and expands each block to the writer.
+ *
+ * @return 0 on success, EOF on a malformed transmission or write error.
+ */
+int decompressBlocks(SEQ_READER *in, SEQ_WRITER *out) {
     int byte;
-    int rbdflag;
-    int ret;
 
-    // Start of transmission
-    byte = fgetc(in);
-    if(!isSOT(byte)) {
+    // Start of transmission, which says whether the blocks are entropy coded
+    byte = seq_getc(in);
+    if(!isSOT(byte) && byte != ENTROPY_SOT) {
         return EOF;
     }
+    int coded = byte == ENTROPY_SOT;
 
     // Parse blocks, check using isSOB
-    byte = fgetc(in);
+    byte = seq_getc(in);
     while(isSOB(byte)) {
-        rbdflag = readBlockData(in, out);
-        if(!rbdflag) {
+        if(decompressBlock(in, out, coded)) {
             return EOF;
         }
-
-        ret = mapBodyRules(main_rule, in, out);
-        if(!ret) {
+        // If no more input is at hand, deliver what has been expanded so far
+        // rather than holding it back while waiting (e.g. for a streaming compressor).
+        if(in->pos == in->len && out->fp &&
+           (seq_writer_flush(out) || fflush(out->fp) == EOF)) {
             return EOF;
         }
-
-        init_symbols();
-        init_rules();
-        byte = fgetc(in);
+        byte = seq_getc(in);
     }
 
     // End of transmission
     if(!isEOT(byte)) {
         return EOF;
     }
-    byte = fgetc(in);
+    byte = seq_getc(in);
     if(byte != EOF) {
         return EOF;
     }
+    return 0;
+}
 
-    fflush(out);
 
-    return writeouts;
+/**
+ * Reads one block, whose SOB mark has already been consumed, into the current
+ * context and expands it to the writer.
+ *
+ * @param coded  Nonzero if the block is entropy coded (see entropy.h).
+ * @return 0 on success, EOF on a malformed block or write error.
+ */
+int decompressBlock(SEQ_READER *in, SEQ_WRITER *out, int coded) {
+    init_symbols();
+    init_rules();
+    if(!readBlockData(in, out, coded) || !mapBodyRules(main_rule, in, out)) {
+        return EOF;
+    }
+    return 0;
 }
 
+/**
+ * Reads one block, whose SOB mark has already been consumed, into the current
+ * context and writes part of its expansion to the writer: the part that begins
+ * *skip bytes in and is at most *len bytes long.  Both are reduced by the number
+ * of bytes passed over and written (see expand_rule_range()).
+ *
+ * @param coded  Nonzero if the block is entropy coded (see entropy.h).
+ * @return 0 on success, EOF on a malformed block or write error.
+ */
+int decompressBlockRange(SEQ_READER *in, SEQ_WRITER *out, uint64_t *skip, uint64_t *len,
+                         int coded) {
+    init_symbols();
+    init_rules();
+    if(!readBlockData(in, out, coded) || expand_rule_range(main_rule, skip, len, out)) {
+        return EOF;
+    }
+    return 0;
+}
 
 /**
  * Maps the body symbol's rule variable the rules in the rule_map.
  * After this, expansion will happen
  *
+ * Each rule reachable from head is expanded only once (see expand.h), and every
+ * occurrence of it is written by copying that expansion.
+ *
  * @precondition The link list of all rules, along with their body. The
  * rule_map is also made and should contain the rules of this block.
  * @return 0 on fail, 1 on success
  */
-int mapBodyRules(SYMBOL *head, FILE *in, FILE *out) {
-    int max = (1 << 21);
-    int ret = 0;
-    int puttedc = 0;
-    SYMBOL *ptr = (*head).next;
-    while(ptr != head) {
-        if((*ptr).value < FIRST_NONTERMINAL) {
-            writeouts++;
-            
-            puttedc = fputc((*ptr).value, out);
-            if(puttedc == EOF) {
-                return 0;
-            }
-            compressedbytes++;
-            ptr = (*ptr).next;
-        }
-        else if((*ptr).value > max || (*(rule_map + (*ptr).value) == NULL)) {
-            return 0;
-        }
-        else {
-            SYMBOL *nonterm = *(rule_map + ((*ptr).value));
-            ret = mapBodyRules(nonterm, in, out);
-            if(!ret) {
-                return 0;
-            }
-            ptr = (*ptr).next;
-        }
-    }
-    return 1;
+int mapBodyRules(SYMBOL *head, SEQ_READER *in, SEQ_WRITER *out) {
+    return expand_rule(head, out) == 0;
 }
 
 /**
- * Reads the block of data and parses it
+ * Reads the block of data and parses it.  In an entropy coded block, the
+ * coded rules may be followed by plain ones (the block index).
  *
  * @return 1 on successful parse
  * 0 on unsuccessful parse
  */
-int readBlockData(FILE *in, FILE *out) {
+int readBlockData(SEQ_READER *in, SEQ_WRITER *out, int coded) {
     debug("reached readBlockData");
     int rrdflag = 0x85;
+    if(coded) {
+        if(entropy_read_block(in)) {
+            return 0;
+        }
+        rrdflag = seq_getc(in);
+    }
+    // The first plain rule is the main rule, unless the rules were entropy coded.
+    int mainrule = !coded;
     while(isRD(rrdflag)) {
-        rrdflag = readRuleData(in, out);
+        rrdflag = readRuleData(in, out, mainrule);
+        mainrule = 0;
     }
 
     if(isEOB(rrdflag)) {
@@ -386,36 +383,57 @@ int readBlockData(FILE *in, FILE *out) {
 /**
  * Reads and checks the single rule in the block after the SOB or RD
  *
+ * @param mainrule  Nonzero if this is the main rule of the block, whose body may have
+ * a single symbol.
  * @return EOB or RD if sucussful, 0 if unsuccessful
  */
-int readRuleData(FILE *in, FILE *out) {
+int readRuleData(SEQ_READER *in, SEQ_WRITER *out, int mainrule) {
     debug("reached readRuleData");
     void add_body(SYMBOL *bodysym, SYMBOL *rule);
     SYMBOL *head;
     int byte;
     int symval = 0;
-    int symcount = 0; // Return 0 if this is less than 3
+    int symcount = 0; // Return 0 if this is less than 3 (2 for the main rule)
     int nonterminalspan = 0;
     int terminalspan = 0;
 
     // Valid rule head
-    byte = fgetc(in);
+    byte = seq_getc(in);
     nonterminalspan = isNonterminalStart(byte);
     symval = makeNonterminalNext(nonterminalspan, byte, in, out);
     if(!(nonterminalspan && symval)) {
         return 0;
     }
+    if(*(rule_map + symval) != NULL) {
+        debug("Rule %d is defined more than once", symval);
+        return 0;
+    }
     head = new_rule(symval); // make the symbol of the rule head
     add_rule(head);
     symcount++;
 
-    // Make rule body
-    // TODO: Make debug print statements of conditional body and value calculated
+    // Make rule body.  Whatever part of it is already in the reader's buffer is
+    // decoded in runs (see utf8.h); the symbol that ends a run, which may be a
+    // marker, is malformed, or straddles the end of the buffer, is handled on its own.
+    int *values = current_ctx->values;
     while(1) {
-        byte = fgetc(in);
+        size_t used;
+        size_t n = utf8_decode_run(in->buf + in->pos, in->len - in->pos, values,
+                                   UTF8_DECODE_BATCH, &used);
+        in->pos += used;
+        for(size_t i = 0; i < n; i++) {
+            add_body(new_symbol(*(values + i), NULL), head);
+        }
+        symcount += n;
+        if(n == UTF8_DECODE_BATCH) {
+            continue;
+        }
+
+        byte = seq_getc(in);
         if(isMarker(byte)) {
             debug("Reached isMarker() in readRuleData()\n");
-            if(symcount < 3 || !isValidMarker(byte)) {
+            // The head and at least two body symbols, or one for the main rule.
+            if(symcount < (mainrule ? 2 : 3) || !isValidMarker(byte)) {
                 return 0;
             }
             else if(isEOB(byte) || isRD(byte)) {
@@ -432,7 +450,6 @@ int readRuleData(FILE *in, FILE *out) {
             }
             SYMBOL *body = new_symbol(symval, NULL);
             add_body(body, head);
-            // debug("Created a nonterminal value: %d", symval);
         }
         else if((terminalspan = isTerminalDouble(byte))) {
             symval = makeTerminalNext(byte, in, out);
@@ -441,25 +458,19 @@ int readRuleData(FILE *in, FILE *out) {
             }
             SYMBOL *body = new_symbol(symval, NULL);
             add_body(body, head);
-            // debug("Created a terminal 2 byte value: %d", symval);
         }
         else if(isTerminalSingle(byte)) {
             SYMBOL *body = new_symbol(byte, NULL);
             add_body(body, head);
-            symcount++;
-            // debug("Created a terminal 1 byte value: %d", byte);
         }
         else {
-            // debug("Else case in readRuleData()");
             return 0;
         }
         symcount++;
-
     }
 
     // Add to rule to rule_map
-    int offset = (*head).value;
-    *(rule_map + offset) = head;
+    map_rule(head);
 
     if(isEOB(byte) || isRD(byte)) {
         return byte;
@@ -491,7 +502,7 @@ int getUTF2(int num) {
 int getUTF3(int num) {
     int byte0 = mask0 & num;
     int byte1 = mask1 & num;
-    int byte2 = mask2 & num;
+    int byte2 = mask2 & num & 0x0f0000; // Only four bits of the lead byte are data.
     byte1 = byte1 >> 2;
     byte2 = byte2 >> 4;
     int word = byte0 | byte1 | byte2;
@@ -557,7 +568,7 @@ int isTerminalDouble(int byte) {
  * @return the terminal symbol value extracted from utf.
  * 0 if failed representation of terminal.
  */
-int makeTerminalNext(int prevbyte, FILE *in, FILE *out) {
+int makeTerminalNext(int prevbyte, SEQ_READER *in, SEQ_WRITER *out) {
     int byte = prevbyte << 8;
     int nextbyte = getNextTerminalByte(in, out);
     if(!nextbyte) {
@@ -574,8 +585,8 @@ int makeTerminalNext(int prevbyte, FILE *in, FILE *out) {
  * @return the value of the next terminal byte
  * 0 if invlaid byte
  */
-int getNextTerminalByte(FILE *in, FILE *out) {
-    int byte = fgetc(in);
+int getNextTerminalByte(SEQ_READER *in, SEQ_WRITER *out) {
+    int byte = seq_getc(in);
     int shiftedbyte = byte >> 6;
     int mask = 0b10;
     if(mask == shiftedbyte) {
@@ -644,7 +655,7 @@ int isNonterminalStart(int byte) {
  * @return the value of the full nonterminal.
  * 0 if failed representation of nonterminal.
  */
-int makeNonterminalNext(int span, int prevbyte, FILE *in, FILE *out) {
+int makeNonterminalNext(int span, int prevbyte, SEQ_READER *in, SEQ_WRITER *out) {
     int utfspan = span + 1;
     int shiftamount = 8 * span;
     int byte = prevbyte << shiftamount;
@@ -669,8 +680,8 @@ int makeNonterminalNext(int span, int prevbyte, FILE *in, FILE *out) {
  * @return The value of the next nonterminal byte
  * 0 if invalid byte
  */
-int getNextNonterminalByte(FILE *in, FILE *out) {
-    int byte = fgetc(in);
+int getNextNonterminalByte(SEQ_READER *in, SEQ_WRITER *out) {
+    int byte = seq_getc(in);
     int shiftedbyte = byte >> 6;
     int mask = 0b10;
     if(mask == shiftedbyte) {
@@ -755,6 +766,8 @@ int validargs(int argc, char **argv) {
     // Include helpers
     int stringCompare(char *string1, char *string2);
     int parseBlocksize(char *string);
+    int parseNumber(char *string, int max);
+    int parseRange(char *string);
     void modifyGlobalOptions(int blocksize, char *flag);
 
     // Variables
@@ -762,6 +775,12 @@ int validargs(int argc, char **argv) {
     char *flagC = "-c";
     char *flagD = "-d";
     char *flagB = "-b";
+    char *flagJ = "-j";
+    char *flagI = "-i";
+    char *flagS = "-s";
+    char *flagV = "-v";
+    char *flagR = "-r";
+    char *flagE = "-e";
     int defaultblocksize = 1024;
 
     // Return PASS and modify global_options if -h is the first flag.
@@ -785,15 +804,75 @@ int validargs(int argc, char **argv) {
         }
     }
 
-    // Return PASS and modify global options if -c is the first flag,
-    // -b is the second flag, and the third input is a number in [1, 1024].
-    // There are 3 additional arguments to the initial function.
-    if(argc == 4 && stringCompare(flagC, *(argv + 1)) && stringCompare(flagB, *(argv + 2))) {
-        int blocksize = parseBlocksize(*(argv + 3));
-        if(blocksize != -1) {
-            modifyGlobalOptions(blocksize, flagC);
-            return 0;
+    // Return PASS and modify global options if -c or -d is the first flag and is
+    // followed only by optional flags that go with it, each at most once:
+    // "-j JOBS" (a number in [1, MAX_JOBS]) with either, and
+    // "-b BLOCKSIZE" (a number in [1, 1024], or "auto", not together with -j or -s),
+    // "-e", "-i", "-v" (not together with -j, whose blocks are done out of order) and
+    // "-s MSEC" (a number in [1, MAX_STREAM_INTERVAL], not together with -i or -j) with
+    // -c, and "-r OFFSET:LENGTH" (not together with -j) with -d.
+    // With "-b auto", the blocksize in global_options is 0.
+    stream_interval = 0;
+    range_offset = 0;
+    range_length = 0;
+    if(argc >= 3 && (stringCompare(flagC, *(argv + 1)) || stringCompare(flagD, *(argv + 1)))) {
+        int compress = stringCompare(flagC, *(argv + 1));
+        int blocksize = 0;
+        int automatic = 0;
+        int jobs = 0;
+        int index = 0;
+        int interval = 0;
+        int verbose = 0;
+        int range = 0;
+        int entropy = 0;
+        for(int i = 2; i < argc; i++) {
+            if(compress && !index && stringCompare(flagI, *(argv + i))) {
+                index = 1;
+                continue;
+            }
+            if(compress && !verbose && stringCompare(flagV, *(argv + i))) {
+                verbose = 1;
+                continue;
+            }
+            if(compress && !entropy && stringCompare(flagE, *(argv + i))) {
+                entropy = 1;
+                continue;
+            }
+            if(i + 1 == argc) {
+                return -1;
+            }
+            if(compress && !blocksize && !automatic && stringCompare(flagB, *(argv + i))) {
+                if(stringCompare("auto", *(argv + ++i)))
+                    automatic = 1;
+                else
+                    blocksize = parseBlocksize(*(argv + i));
+            }
+            else if(!jobs && stringCompare(flagJ, *(argv + i))) {
+                jobs = parseNumber(*(argv + ++i), MAX_JOBS);
+            }
+            else if(compress && !interval && stringCompare(flagS, *(argv + i))) {
+                interval = parseNumber(*(argv + ++i), MAX_STREAM_INTERVAL);
+            }
+            else if(!compress && !range && stringCompare(flagR, *(argv + i))) {
+                range = parseRange(*(argv + ++i));
+            }
+            else {
+                return -1;
+            }
+            if(blocksize == -1 || jobs == -1 || interval == -1 || range == -1) {
+                return -1;
+            }
+        }
+        if((interval && (index || jobs)) || (range && jobs) || (automatic && (jobs || interval)) ||
+           (verbose && jobs)) {
+            return -1;
         }
+        modifyGlobalOptions(automatic ? 0 : blocksize ? blocksize : defaultblocksize, *(argv + 1));
+        global_options |= jobs << 8 | (index ? 0x8 : 0) | (interval ? 0x10 : 0) |
+                          (verbose ? 0x20 : 0) | (range ? 0x40 : 0) |
+                          (entropy ? ENTROPY_OPTION : 0);
+        stream_interval = interval;
+        return 0;
     }
 
     // Else return FAIL;
@@ -841,6 +920,18 @@ void modifyGlobalOptions(int blocksize, char *flag) {
  * blocksize.
  */
 int parseBlocksize(char *string) {
+    return parseNumber(string, 1024);
+}
+
+/**
+ * @brief Parses a given decimal string and returns an integer.
+ * @details Accepts only strings of digits whose value is in the range [1, max].
+ *
+ * @param string Pointer to the string
+ * @param max The largest value accepted
+ * @return The value if successful, -1 if it is not valid.
+ */
+int parseNumber(char *string, int max) {
    int number = 0;
 
     for (int i = 0; string[i] != '\0'; i++) {
@@ -849,7 +940,7 @@ int parseBlocksize(char *string) {
         }
         number = number * 10 + (string[i] - '0');
 
-        if (number > 1024) {
+        if (number > max) {
             return -1; // Early exit for out-of-range
         }
     }
@@ -857,6 +948,44 @@ int parseBlocksize(char *string) {
     return (number >= 1) ? number : -1;
 }
 
+/**
+ * @brief Parses a range of the form "OFFSET:LENGTH".
+ * @details OFFSET and LENGTH must be strings of digits, with LENGTH at least 1
+ * and OFFSET + LENGTH at most RANGE_MAX.  On success, they are stored in
+ * range_offset and range_length.
+ *
+ * @param string Pointer to the string
+ * @return 1 if successful, -1 if it is not a valid range.
+ */
+int parseRange(char *string) {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint64_t *number = &offset;
+    int digits = 0;
+
+    for(; *string != '\0'; string++) {
+        if(*string == ':' && number == &offset && digits > 0) {
+            number = &length;
+            digits = 0;
+            continue;
+        }
+        if(*string < '0' || *string > '9') {
+            return -1;
+        }
+        *number = *number * 10 + (*string - '0');
+        digits++;
+        if(*number > RANGE_MAX) {
+            return -1; // Early exit for out-of-range, before it can overflow
+        }
+    }
+    if(number != &length || length < 1 || offset > RANGE_MAX - length) {
+        return -1;
+    }
+    range_offset = offset;
+    range_length = length;
+    return 1;
+}
+
 /**
  * @brief Returns the length of the given string.
  *
@@ -0,0 +1,124 @@
+#include "const.h"
+#include "sequitur.h"
+#include "expand.h"
+#include "entropy.h"
+#include "utf8.h"
+#include "debug.h"
+
+/*
+ * Contexts.
+ *
+ * A context holds the symbol pool, rules, digram table and rule map that are
+ * used while compressing or decompressing a single block.  The main thread uses a
+ * default context, whose tables are allocated before main() is entered; threads
+ * that work on blocks of their own create additional contexts with seq_ctx_new().
+ * In either case, the slabs of the symbol pool are allocated as they are needed.
+ */
+
+static SEQ_CTX default_ctx = {
+    .next_nonterminal = FIRST_NONTERMINAL
+};
+
+__thread SEQ_CTX *current_ctx = &default_ctx;
+
+/**
+ * Allocate the tables of a context, which must all be NULL.
+ *
+ * @return  0 on success, -1 if the storage could not be allocated (in which case
+ * some of the tables may have been allocated).
+ */
+static int seq_ctx_alloc(SEQ_CTX *ctx) {
+    // calloc() of blocks this large maps fresh zero pages, so storage that is never
+    // touched by a particular use of the context costs nothing.
+    ctx->digrams = calloc(MAX_DIGRAMS, sizeof(DIGRAM_ENTRY));
+    ctx->digram_dirty = calloc(MAX_DIGRAMS, sizeof(int));
+    ctx->rule_index = calloc(SYMBOL_VALUE_MAX, sizeof(SYMBOL *));
+    ctx->rule_dirty = calloc(RULE_DIRTY_MAX, sizeof(int));
+    ctx->links = calloc(SYMBOL_VALUE_MAX, sizeof(RULE_LINKS));
+    ctx->values = malloc(UTF8_DECODE_BATCH * sizeof(int));
+    if(!ctx->digrams || !ctx->digram_dirty || !ctx->rule_index || !ctx->rule_dirty ||
+       !ctx->links || !ctx->values) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Allocate the tables of the default context.  This runs before main(), so that
+ * the default context is ready for any code that runs on the main thread; without
+ * its tables, nothing can be compressed or decompressed, so failure is fatal.
+ */
+__attribute__((constructor))
+static void seq_ctx_default_init(void) {
+    if(seq_ctx_alloc(&default_ctx)) {
+        abort();
+    }
+}
+
+/**
+ * Create a new context, with storage of the same sizes as the default context.
+ * The new context is in the same state as the default one at program start;
+ * in particular, its digram table and rule map are clear.
+ *
+ * @return  The new context, or NULL if the storage could not be allocated.
+ */
+SEQ_CTX *seq_ctx_new(void) {
+    SEQ_CTX *ctx = calloc(1, sizeof(SEQ_CTX));
+    if(ctx == NULL) {
+        return NULL;
+    }
+    ctx->next_nonterminal = FIRST_NONTERMINAL;
+    if(seq_ctx_alloc(ctx)) {
+        seq_ctx_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * Free a context created by seq_ctx_new(), together with all of its storage.
+ * The context must not be current in any thread.
+ */
+void seq_ctx_free(SEQ_CTX *ctx) {
+    if(ctx == NULL || ctx == &default_ctx) {
+        return;
+    }
+    for(int i = 0; i < ctx->nslabs; i++) {
+        free(*(ctx->slabs + i));
+    }
+    free(ctx->slabs);
+    free(ctx->digrams);
+    free(ctx->digram_dirty);
+    free(ctx->rule_index);
+    free(ctx->rule_dirty);
+    free(ctx->links);
+    expand_cache_free(ctx->expansion);
+    entropy_coder_free(ctx->coder);
+    free(ctx->checks);
+    free(ctx->values);
+    free(ctx);
+}
+
+/**
+ * Make sure that an array has room for at least n elements of the given size,
+ * doubling its capacity (from 64 elements, for an empty one) until it does.
+ * This is how the growable storage kept by a context, such as the expansion
+ * cache and the entropy coder, is enlarged.
+ *
+ * @return 0 on success, -1 if the array could not be enlarged (it is then as it was).
+ */
+int seq_reserve(void **array, size_t *cap, size_t n, size_t size) {
+    if(n <= *cap)
+        return 0;
+    size_t c = *cap ? *cap : 64;
+    while(c < n)
+        c *= 2;
+    void *p = realloc(*array, c * size);
+    if(p == NULL) {
+        debug("Could not grow storage to %lu entries", c);
+        return -1;
+    }
+    *array = p;
+    *cap = c;
+    return 0;
+}
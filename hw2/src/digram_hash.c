@@ -7,19 +7,110 @@
  * Maps pairs of symbol values to first symbol of digram.
  * Uses open addressing with linear probing.
  * See, e.g. https://en.wikipedia.org/wiki/Open_addressing
+ *
+ * Every entry holds the packed values of its digram (see DIGRAM_KEY), so probes
+ * compare keys in the table itself; a stored symbol is only dereferenced once
+ * its key has matched, to confirm that the entry is still current.
+ *
+ * Matching on keys rather than on the symbols' current values means that a stale
+ * entry (see isDigramMatchValues()) is never found under the values its symbol has
+ * come to head, only removed once its own key is probed.  Grammars built this way
+ * can differ from those of the original table, which matched every entry it passed
+ * on its symbols' values; both decompress to the same data.
  */
 
+#define DIGRAM_MASK (MAX_DIGRAMS - 1)
+
 // Function prototypes
 int isDigramMatchValues(SYMBOL *digram, int v1, int v2);
 
-
+/*
+ * The context keeps a list of the indices of the digram_table slots that have gone
+ * from unused to used since the table was last cleared, so that resetting the table
+ * only has to touch the slots listed there, instead of all MAX_DIGRAMS.  Because
+ * deletion can return a slot to the unused state, a slot may be listed more than
+ * once; if the list fills up, the next reset falls back to clearing the whole table.
+ */
 
 /**
  * Clear the digram hash table.
+ *
+ * Only the slots that have been filled by digram_put() since the last call are
+ * cleared, so the cost is proportional to the number of digrams inserted in
+ * the current block rather than to the size of the table.
  */
 void init_digram_hash(void) {
-    memset(digram_table, 0, sizeof(SYMBOL *) * MAX_DIGRAMS);
+    SEQ_CTX *ctx = current_ctx;
+    if(ctx->digram_dirty_overflow) {
+        memset(ctx->digrams, 0, sizeof(DIGRAM_ENTRY) * MAX_DIGRAMS);
+    }
+    else {
+        for(int i = 0; i < ctx->digram_dirty_count; i++) {
+            DIGRAM_ENTRY *e = ctx->digrams + *(ctx->digram_dirty + i);
+            e->key = 0;
+            e->digram = NULL;
+        }
+    }
+    ctx->digram_dirty_count = 0;
+    ctx->digram_dirty_overflow = 0;
+    ctx->digram_live = 0;
+    ctx->digram_tombstones = 0;
+}
+
+/**
+ * Store a digram in a slot of the table, recording the slot for the next reset
+ * if it was previously unused.
+ */
+static inline void digram_store(int index, uint64_t key, SYMBOL *digram) {
+    SEQ_CTX *ctx = current_ctx;
+    DIGRAM_ENTRY *e = ctx->digrams + index;
+    if(e->digram == NULL) {
+        if(ctx->digram_dirty_count < MAX_DIGRAMS)
+            *(ctx->digram_dirty + ctx->digram_dirty_count++) = index;
+        else
+            ctx->digram_dirty_overflow = 1;
+    }
+    else if(e->digram == TOMBSTONE) {
+        ctx->digram_tombstones--;
+    }
+    ctx->digram_live++;
+    e->key = key;
+    e->digram = digram;
+}
 
+/**
+ * Remove the entry in a slot of the table.  If the following slot is unused, then
+ * no probe sequence runs through this slot, so it is marked unused rather than
+ * left as a tombstone, and so is any run of tombstones that immediately precedes it.
+ */
+static inline void digram_remove(int index) {
+    SEQ_CTX *ctx = current_ctx;
+    DIGRAM_ENTRY *e = digram_table + index;
+    e->key = 0;
+    ctx->digram_live--;
+    if((digram_table + ((index + 1) & DIGRAM_MASK))->digram != NULL) {
+        e->digram = TOMBSTONE;
+        ctx->digram_tombstones++;
+        return;
+    }
+    e->digram = NULL;
+    for(int i = (index - 1) & DIGRAM_MASK; i != index; i = (i - 1) & DIGRAM_MASK) {
+        e = digram_table + i;
+        if(e->digram != TOMBSTONE)
+            break;
+        e->digram = NULL;
+        ctx->digram_tombstones--;
+    }
+}
+
+/**
+ * Record a call that examined n slots of the table in the statistics.
+ */
+static inline void digram_count(int n) {
+    DIGRAM_STATS *st = &current_ctx->digram_stats;
+    st->probes += n;
+    if((unsigned long)n > st->max_probes)
+        st->max_probes = n;
 }
 
 /**
@@ -31,44 +122,38 @@ void init_digram_hash(void) {
  * symbol values) in the hash table, if there is one, otherwise NULL.
  */
 SYMBOL *digram_get(int v1, int v2) {
+    uint64_t key = DIGRAM_KEY(v1, v2);
     int index = DIGRAM_HASH(v1, v2);
-    SYMBOL *sym = NULL;
-
-    // Loop part 1
-    for(int i = index; i < MAX_DIGRAMS; i++) {
-        sym = *(digram_table + i);
-        if(sym == NULL) {
-            return NULL;
-        }
-        else if(sym == TOMBSTONE) {
-            continue;
-        }
-        if(isDigramMatchValues(sym, v1, v2)) {
-            return sym;
+    current_ctx->digram_stats.lookups++;
+
+    for(int n = 0; n < MAX_DIGRAMS; n++) {
+        int i = (index + n) & DIGRAM_MASK;
+        DIGRAM_ENTRY *e = digram_table + i;
+        if(e->key == key) {
+            if(isDigramMatchValues(e->digram, v1, v2)) {
+                digram_count(n + 1);
+                return e->digram;
+            }
+            digram_remove(i);
         }
-    }
-
-    // Loop part 2
-    for(int i = 0; i < index; i++) {
-        sym = *(digram_table + i);
-        if(sym == NULL) {
+        else if(e->digram == NULL) {
+            digram_count(n + 1);
             return NULL;
         }
-        else if(sym == TOMBSTONE) {
-            continue;
-        }
-
-        if(isDigramMatchValues(sym, v1, v2)) {
-            return sym;
-        }
     }
-
+    digram_count(MAX_DIGRAMS);
     return NULL;
 }
 
 /**
- * Deterimes if the digram symbol values match the given values
- * Helper function for digram_get
+ * Determines if the digram symbol values match the given values.
+ * Helper function for digram_get and digram_put
+ *
+ * The key stored with an entry can go stale: when a triple such as "aaa" loses
+ * a symbol, join_symbols() puts the surviving digram back into the table just
+ * before relinking its first symbol, so the symbol can end up followed by
+ * something else.  This check is only made once the keys have matched, so the
+ * probe itself still never leaves the table.
  *
  * @param SYMBOL *digram This digram to check the values of and see if it is similar to v1 and v2
  * @param int v1 The first symbol's value
@@ -76,8 +161,37 @@ SYMBOL *digram_get(int v1, int v2) {
  * @return 0 if nothing found, 1 if found match
  */
 int isDigramMatchValues(SYMBOL *digram, int v1, int v2) {
-    return (digram->value == v1) && (digram->next->value == v2);
+#ifdef DEBUG
+    if(digram->value == SYMBOL_POISON) {
+        fprintf(stderr, "Digram table refers to recycled symbol <%lu>!\n", SYMBOL_INDEX(digram));
+        abort();
+    }
+#endif
+    return (digram->value == v1) && digram->next && (digram->next->value == v2);
+}
 
+/**
+ * Delete the entry with a given key that refers to a given symbol, if there is one.
+ */
+static int digram_delete_key(uint64_t key, SYMBOL *digram) {
+    int index = digram_hash_key(key);
+    current_ctx->digram_stats.deletes++;
+
+    for(int n = 0; n < MAX_DIGRAMS; n++) {
+        int i = (index + n) & DIGRAM_MASK;
+        DIGRAM_ENTRY *e = digram_table + i;
+        if(e->key == key && e->digram == digram) {
+            digram_remove(i);
+            digram_count(n + 1);
+            return 0;
+        }
+        if(e->digram == NULL) {
+            digram_count(n + 1);
+            return -1;
+        }
+    }
+    digram_count(MAX_DIGRAMS);
+    return -1;
 }
 
 /**
@@ -90,7 +204,8 @@ int isDigramMatchValues(SYMBOL *digram, int v1, int v2) {
  * Note that deletion in an open-addressed hash table requires that a
  * special "tombstone" value be left as a replacement for the value being
  * deleted.  Tombstones are treated as vacant for the purposes of insertion,
- * but as filled for the purpose of lookups.
+ * but as filled for the purpose of lookups.  Tombstones that end up at the
+ * tail of a probe run are cleaned up immediately (see digram_remove()).
  *
  * Note also that this function will only delete the specific digram that is
  * passed as the argument, not some other matching digram that happens
@@ -104,80 +219,30 @@ int digram_delete(SYMBOL *digram) {
     if (!digram || !digram->next) {
         return -1;
     }
-    
-    SYMBOL *disym1 = NULL;
-    SYMBOL *disym2 = NULL;
-    SYMBOL *sym1 = digram;
-    SYMBOL *sym2 = (*digram).next;
-    int sym1val = (*sym1).value;
-    int sym2val = (*sym2).value;
-    int index = DIGRAM_HASH(sym1val, sym2val);
-
-    // Input debug
-    // debug("digram_delete: digramValue: %d, digramValue2: %d", sym1val, sym2val);
-
-    // TODO: Need to test for null within the loops
-
-    // Loop part 1
-    for(int i = index; i < MAX_DIGRAMS; i++) {
-
-        // debug("index: %d", i);
-
-        disym1 = *(digram_table + i);
-        if(disym1 == NULL) {
-            return -1;
-        }
-        else if(disym1 == TOMBSTONE) {
-            continue;
-        }
-
-        // debug("disym1 is not null or tombstone");
-
-        disym2 = (*disym1).next;
-        if(disym2 == NULL) {
-            return -1;
-        }
-
-        // debug("disym2 is not null");
-
-        if((disym1 == sym1) && (disym2 == sym2)) {
-            *(digram_table + i) = TOMBSTONE;
-            return 0;
-        }
-    }
-
-    // Loop part 2
-    for(int i = 0; i < index; i++) {
-        // debug("index: %d", i);
-
-        disym1 = *(digram_table + i);
-        if(disym1 == NULL) {
-            return -1;
-        }
-        else if(disym1 == TOMBSTONE) {
-            continue;
-        }
-
-        // debug("disym1 is not null or tombstone");
-
-        disym2 = (*disym1).next;
-        if(disym2 == NULL) {
-            return -1;
-        }
-
-        // debug("disym2 is not null");
+    return digram_delete_key(DIGRAM_KEY(digram->value, digram->next->value), digram);
+}
 
-        if((disym1 == sym1) && (disym2 == sym2)) {
-            *(digram_table + i) = TOMBSTONE;
-            return 0;
-        }
+/**
+ * Delete any entry that still refers to a symbol that is about to be recycled.
+ *
+ * The caller will already have deleted the digram that the symbol currently heads,
+ * but the entry left behind when a triple loses a symbol (see isDigramMatchValues())
+ * has the key of the triple's digram "vv", which the symbol may no longer head.
+ * Once the symbol has been handed out again, that entry would refer to a symbol
+ * somewhere else entirely, so it has to go now.  join_symbols() marks the symbols
+ * that may have such an entry by a nonzero reference count, so that the table need
+ * not be searched for the others.
+ *
+ * @param digram  The symbol that is about to be recycled.
+ * @return 0 if an entry was found and deleted, -1 otherwise.
+ */
+int digram_forget(SYMBOL *digram) {
+    if(IS_RULE_HEAD(digram) || digram->refcnt == 0) {
+        return -1;
     }
-
-    return -1;
+    return digram_delete_key(DIGRAM_KEY(digram->value, digram->value), digram);
 }
 
-
-
 /**
  * Attempt to insert a digram into the hash table.
  *
@@ -189,57 +254,118 @@ int digram_delete(SYMBOL *digram) {
  */
 int digram_put(SYMBOL *digram) {
     if (digram == NULL || digram->next == NULL) {
-        return -1;  
+        return -1;
     }
-    SYMBOL *disym1 = NULL;
-    SYMBOL *disym2 = NULL;
-
-    SYMBOL *sym1 = digram;
-    SYMBOL *sym2 = (*digram).next;
- 
-    // debug("digram_put symbol is well formed");
-
-    int sym1val = (*sym1).value;
-    int sym2val = (*sym2).value;
-    int index = DIGRAM_HASH(sym1val, sym2val);
 
-    // debug("sym1val: %d, sym2val: %d, index: %d", sym1val, sym2val, index);
-
-
-    // Loop part 1
-    for(int i = index; i < MAX_DIGRAMS; i++) {
-        disym1 = *(digram_table + i);
+    uint64_t key = DIGRAM_KEY(digram->value, digram->next->value);
+    int index = DIGRAM_HASH(digram->value, digram->next->value);
+    int vacant = -1;  // First tombstone seen, reused if the digram is not present.
+    current_ctx->digram_stats.inserts++;
+    if(current_ctx->digram_tombstones > DIGRAM_REHASH_TOMBSTONES) {
+        digram_rehash();
+    }
 
-        if((disym1 == NULL) || (disym1 == TOMBSTONE)) {
+    for(int n = 0; n < MAX_DIGRAMS; n++) {
+        int i = (index + n) & DIGRAM_MASK;
+        DIGRAM_ENTRY *e = digram_table + i;
+        if(e->key == key) {
+            if(isDigramMatchValues(e->digram, digram->value, digram->next->value)) {
+                // Same digram values, already exist
+                digram_count(n + 1);
+                return 1;
+            }
+            // Stale entry: reclaim the slot and keep looking.
+            digram_remove(i);
+        }
+        if(e->digram == NULL) {
             // Did not exist, successful insert into digram
-            *(digram_table + i) = digram;
+            digram_store(vacant >= 0 ? vacant : i, key, digram);
+            digram_count(n + 1);
             return 0;
         }
-
-        disym2 = (*disym1).next;
-        if(((*disym1).value == sym1val) && ((*disym2).value == sym2val)) {
-            // Same digram values, already exist
-            return 1;
+        if(e->digram == TOMBSTONE && vacant < 0) {
+            vacant = i;
         }
-
     }
 
-    // Loop part 2
-    for(int i = 0; i < index; i++) {
-        disym1 = *(digram_table + i);
+    digram_count(MAX_DIGRAMS);
+    if(vacant >= 0) {
+        digram_store(vacant, key, digram);
+        return 0;
+    }
+    return -1;
+}
 
-        if((disym1 == NULL) || (disym1 == TOMBSTONE)) {
-            // Did not exist, successful insert into digram
-            *(digram_table + i) = digram;
-            return 0;
+/**
+ * Rebuild the digram hash table in place, without its tombstones.
+ *
+ * The slots are visited once, in order, starting just after an unused slot (so that
+ * no probe run straddles the starting point); each tombstone is cleared, and each
+ * entry is moved to the first unused slot of the probe sequence from its home slot.
+ * That slot is never past the one the entry came from, and entries with the same
+ * key stay in the same order, so lookups give the same results as before.
+ */
+void digram_rehash(void) {
+    SEQ_CTX *ctx = current_ctx;
+    int start = -1;
+    for(int i = 0; i < MAX_DIGRAMS && start < 0; i++) {
+        if((digram_table + i)->digram == NULL)
+            start = i;
+    }
+    for(int i = 0; i < MAX_DIGRAMS && start < 0; i++) {
+        if((digram_table + i)->digram == TOMBSTONE) {
+            (digram_table + i)->digram = NULL;
+            start = i;
         }
-
-        disym2 = (*disym1).next;
-        if(((*disym1).value == sym1val) && ((*disym2).value == sym2val)) {
-            // Same digram values, already exist
-            return 1;
+    }
+    if(start < 0)
+        return;
+
+    int live = 0;
+    for(int n = 1; n < MAX_DIGRAMS; n++) {
+        int i = (start + n) & DIGRAM_MASK;
+        DIGRAM_ENTRY *e = digram_table + i;
+        if(e->digram == TOMBSTONE) {
+            e->digram = NULL;
+            continue;
         }
+        if(e->digram == NULL)
+            continue;
+        DIGRAM_ENTRY moved = *e;
+        e->key = 0;
+        e->digram = NULL;
+        int j = digram_hash_key(moved.key);
+        while((digram_table + j)->digram != NULL)
+            j = (j + 1) & DIGRAM_MASK;
+        *(digram_table + j) = moved;
+        if(j != i) {
+            if(ctx->digram_dirty_count < MAX_DIGRAMS)
+                *(ctx->digram_dirty + ctx->digram_dirty_count++) = j;
+            else
+                ctx->digram_dirty_overflow = 1;
+        }
+        live++;
     }
+    ctx->digram_live = live;
+    ctx->digram_tombstones = 0;
+    ctx->digram_stats.rehashes++;
+}
 
-    return -1;
+/**
+ * Print the statistics gathered on the digram table since they were last reset,
+ * together with its current occupancy, on one line, and reset them.
+ *
+ * @param f  The stream on which the statistics are to be printed.
+ * @param len  The number of bytes in the block that was last compressed.
+ */
+void digram_report(FILE *f, size_t len) {
+    SEQ_CTX *ctx = current_ctx;
+    DIGRAM_STATS *st = &ctx->digram_stats;
+    unsigned long ops = st->lookups + st->inserts + st->deletes;
+    fprintf(f, "block of %lu bytes: %lu lookups, %lu inserts, %lu deletes, "
+            "%.2f probes/op (max %lu), %d live, %d tombstones, %lu rehashes\n",
+            len, st->lookups, st->inserts, st->deletes,
+            ops ? (double)st->probes / ops : 0.0, st->max_probes,
+            ctx->digram_live, ctx->digram_tombstones, st->rehashes);
+    *st = (DIGRAM_STATS){ 0 };
 }
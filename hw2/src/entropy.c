@@ -0,0 +1,426 @@
+#include <string.h>
+
+#include "const.h"
+#include "sequitur.h"
+#include "debug.h"
+#include "entropy.h"
+
+/*
+ * Entropy coding of the rules of a block.
+ * See entropy.h for an overview and the format.
+ *
+ * rANS codes symbols last in, first out, so the encoder works through the block
+ * backwards, from the end of the last rule to the header, and writes the coded
+ * bytes from the end of a buffer towards its start; the decoder then reads them,
+ * and the block, forwards.
+ */
+
+void add_body(SYMBOL *bodysym, SYMBOL *rule);
+
+/*
+ * The coder of the current context, which is created when it is first needed.
+ *
+ * @return  The coder, or NULL if it could not be allocated.
+ */
+static ENTROPY_CODER *entropy_coder(void) {
+    SEQ_CTX *ctx = current_ctx;
+    if(ctx->coder != NULL)
+        return ctx->coder;
+    ENTROPY_CODER *c = calloc(1, sizeof(ENTROPY_CODER));
+    if(c == NULL)
+        return NULL;
+    c->count = malloc(ENTROPY_ALPHABET * sizeof(uint32_t));
+    c->freq = malloc(ENTROPY_ALPHABET * sizeof(uint32_t));
+    c->start = malloc(ENTROPY_ALPHABET * sizeof(uint32_t));
+    c->slots = malloc(ENTROPY_SCALE * sizeof(ENTROPY_SLOT));
+    if(!c->count || !c->freq || !c->start || !c->slots) {
+        entropy_coder_free(c);
+        return NULL;
+    }
+    ctx->coder = c;
+    return c;
+}
+
+/**
+ * Scale the counts of the symbols so that they add up to a power of two, giving
+ * every symbol that occurs at least 1, and fill in the start of each range.
+ * Both the encoder and the decoder use this, so it must be deterministic.
+ *
+ * @return The number of bits of the scale: ENTROPY_SCALE_BITS, or fewer for a
+ * block so small that a smaller table loses nothing.
+ */
+static int entropy_normalize(ENTROPY_CODER *c, uint64_t total) {
+    int bits = ENTROPY_SCALE_BITS_MIN;
+    while(bits < ENTROPY_SCALE_BITS && ((uint64_t)1 << (bits - 1)) < total)
+        bits++;
+    const uint32_t scale = 1U << bits;
+    uint32_t sum = 0;
+    int top = -1;
+    for(int s = 0; s < ENTROPY_ALPHABET; s++) {
+        uint32_t n = *(c->count + s);
+        uint32_t f = n ? (uint32_t)((uint64_t)n * scale / total) : 0;
+        if(n && f == 0)
+            f = 1;
+        *(c->freq + s) = f;
+        sum += f;
+        if(n && (top < 0 || n > *(c->count + top)))
+            top = s;
+    }
+    if(sum < scale)
+        *(c->freq + top) += scale - sum;
+    // Symbols raised to 1 can take the total over; take the excess from the largest.
+    while(sum > scale) {
+        int big = 0;
+        for(int s = 1; s < ENTROPY_ALPHABET; s++) {
+            if(*(c->freq + s) > *(c->freq + big))
+                big = s;
+        }
+        uint32_t take = *(c->freq + big) - 1;
+        if(take > sum - scale)
+            take = sum - scale;
+        *(c->freq + big) -= take;
+        sum -= take;
+    }
+    uint32_t start = 0;
+    for(int s = 0; s < ENTROPY_ALPHABET; s++) {
+        *(c->start + s) = start;
+        start += *(c->freq + s);
+    }
+    return bits;
+}
+
+/* The class of a rule number (at least 1): the position of its highest set bit. */
+static inline int entropy_class(uint32_t j) {
+    return 31 - __builtin_clz(j);
+}
+
+/*
+ * Encoder.
+ */
+
+typedef struct entropy_encoder {
+    uint32_t x;                // Coder state.
+    int bits;                  // Number of bits of the scale.
+    unsigned char *p;          // Start of the bytes written so far.
+} ENTROPY_ENCODER;
+
+/* Code a symbol with the given range of slots. */
+static inline void entropy_put(ENTROPY_ENCODER *e, uint32_t start, uint32_t freq) {
+    uint32_t x = e->x;
+    uint32_t max = ((ENTROPY_STATE_LOW >> e->bits) << 8) * freq;
+    while(x >= max) {
+        *--e->p = x & 0xff;
+        x >>= 8;
+    }
+    e->x = ((x / freq) << e->bits) + (x % freq) + start;
+}
+
+/* Code an n-bit value (n <= 16) as if all such values were equally likely. */
+static inline void entropy_put_bits16(ENTROPY_ENCODER *e, uint32_t v, int n) {
+    uint32_t x = e->x;
+    uint32_t max = (ENTROPY_STATE_LOW >> n) << 8;
+    while(x >= max) {
+        *--e->p = x & 0xff;
+        x >>= 8;
+    }
+    e->x = (x << n) | v;
+}
+
+/* Code an n-bit value (n <= 32); entropy_get_bits() reads the high part first. */
+static void entropy_put_bits(ENTROPY_ENCODER *e, uint32_t v, int n) {
+    if(n > 16) {
+        entropy_put_bits16(e, v & 0xffff, 16);
+        v >>= 16;
+        n -= 16;
+    }
+    if(n > 0)
+        entropy_put_bits16(e, v, n);
+}
+
+/* Code a number (at least 1) as an Elias gamma code. */
+static void entropy_put_gamma(ENTROPY_ENCODER *e, uint32_t v) {
+    int n = entropy_class(v);
+    entropy_put_bits(e, v - (1U << n), n);
+    entropy_put_bits16(e, 1, 1);
+    for(int i = 0; i < n; i++)
+        entropy_put_bits16(e, 0, 1);
+}
+
+/* Code a symbol of a rule body, with the number of each rule given by "number". */
+static inline void entropy_put_symbol(ENTROPY_ENCODER *e, ENTROPY_CODER *c, SYMBOL *s) {
+    uint32_t sym = s->value;
+    if(sym >= FIRST_NONTERMINAL) {
+        uint32_t j = *(c->number + sym - FIRST_NONTERMINAL);
+        int b = entropy_class(j);
+        entropy_put_bits(e, j - (1U << b), b);
+        sym = ENTROPY_RULE + b;
+    }
+    entropy_put(e, *(c->start + sym), *(c->freq + sym));
+}
+
+/* Order in which the rules other than the main rule are coded. */
+static int entropy_compare_rules(const void *a, const void *b) {
+    SYMBOL *r1 = *(SYMBOL **)a;
+    SYMBOL *r2 = *(SYMBOL **)b;
+    if(r1->refcnt != r2->refcnt)
+        return r1->refcnt > r2->refcnt ? -1 : 1;
+    return r1->value < r2->value ? -1 : r1->value > r2->value;
+}
+
+/**
+ * Write the grammar built for a block, entropy coded, to the output buffer.
+ * The SOB mark has already been written, and the caller writes the EOB mark.
+ *
+ * @param head  The main rule of the block.
+ * @param out  The buffer to which the coded rules are to be written.
+ * @return 0 on success, EOF if storage could not be allocated, the block is too
+ * large to be coded, or the output could not be written.
+ */
+int entropy_write_block(SYMBOL *head, SEQ_WRITER *out) {
+    ENTROPY_CODER *c = entropy_coder();
+    if(c == NULL)
+        return EOF;
+
+    // Number the rules, and count the symbols.
+    size_t nrules = 0;
+    SYMBOL *rule = head;
+    do {
+        if(seq_reserve((void **)&c->rules, &c->rules_cap, nrules + 1, sizeof(SYMBOL *)))
+            return EOF;
+        *(c->rules + nrules++) = rule;
+        rule = NEXTR(rule);
+    } while(rule != head);
+    qsort(c->rules + 1, nrules - 1, sizeof(SYMBOL *), entropy_compare_rules);
+    if(seq_reserve((void **)&c->number, &c->number_cap,
+                   next_nonterminal_value - FIRST_NONTERMINAL, sizeof(int)))
+        return EOF;
+    for(size_t k = 0; k < nrules; k++)
+        *(c->number + (*(c->rules + k))->value - FIRST_NONTERMINAL) = k;
+
+    memset(c->count, 0, ENTROPY_ALPHABET * sizeof(uint32_t));
+    uint64_t total = nrules;
+    *(c->count + ENTROPY_END) = nrules;
+    for(size_t k = 0; k < nrules; k++) {
+        rule = *(c->rules + k);
+        for(SYMBOL *s = rule->next; s != rule; s = s->next) {
+            uint32_t v = s->value;
+            if(v >= FIRST_NONTERMINAL)
+                v = ENTROPY_RULE + entropy_class(*(c->number + v - FIRST_NONTERMINAL));
+            (*(c->count + v))++;
+            total++;
+        }
+    }
+    if(total > ENTROPY_MAX_SYMBOLS) {
+        debug("Block of %lu symbols is too large to be coded", total);
+        return EOF;
+    }
+    int bits = entropy_normalize(c, total);
+
+    // At most 32 bits for each symbol, and 70 for each entry in the header.
+    size_t bound = 4 * total + 9 * ENTROPY_ALPHABET + 64;
+    if(seq_reserve((void **)&c->buf, &c->buf_cap, bound, 1))
+        return EOF;
+    ENTROPY_ENCODER e = { .x = ENTROPY_STATE_LOW, .bits = bits, .p = c->buf + bound };
+
+    for(size_t k = nrules; k-- > 0; ) {
+        rule = *(c->rules + k);
+        entropy_put(&e, *(c->start + ENTROPY_END), *(c->freq + ENTROPY_END));
+        for(SYMBOL *s = rule->prev; s != rule; s = s->prev)
+            entropy_put_symbol(&e, c, s);
+    }
+
+    // The header: the number of rules and the counts of the symbols that occur,
+    // each after its distance from the one before.
+    int present = 0;
+    for(int s = ENTROPY_ALPHABET; s-- > 0; ) {
+        if(*(c->count + s) == 0)
+            continue;
+        int prev = s - 1;
+        while(prev >= 0 && *(c->count + prev) == 0)
+            prev--;
+        entropy_put_gamma(&e, *(c->count + s));
+        entropy_put_gamma(&e, s - prev);
+        present++;
+    }
+    entropy_put_gamma(&e, present);
+    entropy_put_gamma(&e, nrules);
+
+    for(int i = 0; i < 4; i++) {
+        *--e.p = e.x & 0xff;
+        e.x >>= 8;
+    }
+    return seq_write(out, e.p, c->buf + bound - e.p);
+}
+
+/*
+ * Decoder.
+ */
+
+typedef struct entropy_decoder {
+    uint32_t x;                // Coder state.
+    int bits;                  // Number of bits of the scale.
+    SEQ_READER *in;            // Source of the coded bytes.
+    int err;                   // Set if the input ran out.
+} ENTROPY_DECODER;
+
+/* Read bytes into the state until it is back in range. */
+static inline void entropy_renorm(ENTROPY_DECODER *d) {
+    while(d->x < ENTROPY_STATE_LOW) {
+        int byte = seq_getc(d->in);
+        if(byte == EOF) {
+            d->err = 1;
+            byte = 0;
+        }
+        d->x = (d->x << 8) | byte;
+    }
+}
+
+/* Decode a symbol, using the decoding table. */
+static inline int entropy_get(ENTROPY_DECODER *d, ENTROPY_SLOT *slots) {
+    uint32_t slot = d->x & ((1U << d->bits) - 1);
+    ENTROPY_SLOT *t = slots + slot;
+    d->x = t->freq * (d->x >> d->bits) + slot - t->start;
+    entropy_renorm(d);
+    return t->symbol;
+}
+
+/* Decode an n-bit value (n <= 16) coded by entropy_put_bits16(). */
+static inline uint32_t entropy_get_bits16(ENTROPY_DECODER *d, int n) {
+    uint32_t v = d->x & ((1U << n) - 1);
+    d->x >>= n;
+    entropy_renorm(d);
+    return v;
+}
+
+/* Decode an n-bit value (n <= 32) coded by entropy_put_bits(). */
+static uint32_t entropy_get_bits(ENTROPY_DECODER *d, int n) {
+    uint32_t v = 0;
+    if(n > 16) {
+        v = entropy_get_bits16(d, n - 16) << 16;
+        n = 16;
+    }
+    if(n > 0)
+        v |= entropy_get_bits16(d, n);
+    return v;
+}
+
+/* Decode an Elias gamma code, or return 0 if it is malformed. */
+static uint32_t entropy_get_gamma(ENTROPY_DECODER *d) {
+    int n = 0;
+    while(entropy_get_bits16(d, 1) == 0) {
+        if(++n > 31 || d->err)
+            return 0;
+    }
+    return (1U << n) | entropy_get_bits(d, n);
+}
+
+/**
+ * Read the header of a coded block and build the decoding table.
+ *
+ * @return The number of symbols in the block, or 0 if the header is malformed.
+ */
+static uint64_t entropy_read_header(ENTROPY_DECODER *d, ENTROPY_CODER *c, uint32_t *nrules) {
+    *nrules = entropy_get_gamma(d);
+    uint32_t present = entropy_get_gamma(d);
+    if(*nrules == 0 || present == 0 || present > ENTROPY_ALPHABET)
+        return 0;
+    memset(c->count, 0, ENTROPY_ALPHABET * sizeof(uint32_t));
+    uint64_t total = 0;
+    int s = -1;
+    for(uint32_t i = 0; i < present; i++) {
+        uint32_t gap = entropy_get_gamma(d);
+        uint32_t n = entropy_get_gamma(d);
+        if(gap == 0 || gap > (uint32_t)(ENTROPY_ALPHABET - 1 - s) || n == 0)
+            return 0;
+        s += gap;
+        *(c->count + s) = n;
+        total += n;
+    }
+    if(d->err || total > ENTROPY_MAX_SYMBOLS || *(c->count + ENTROPY_END) != *nrules)
+        return 0;
+
+    d->bits = entropy_normalize(c, total);
+    for(s = 0; s < ENTROPY_ALPHABET; s++) {
+        ENTROPY_SLOT slot = { s, *(c->freq + s), *(c->start + s) };
+        for(uint32_t i = 0; i < slot.freq; i++)
+            *(c->slots + slot.start + i) = slot;
+    }
+    return total;
+}
+
+/**
+ * Read the entropy coded rules of a block, whose SOB mark has already been consumed,
+ * into the current context, entering them in the rule map.  Whatever follows them
+ * in the block (the EOB mark, or the index) is left to be read by the caller.
+ *
+ * @return 0 on success, EOF if the rules are malformed or storage could not be
+ * allocated.
+ */
+int entropy_read_block(SEQ_READER *in) {
+    ENTROPY_CODER *c = entropy_coder();
+    ENTROPY_DECODER d = { .in = in };
+    uint32_t nrules;
+    if(c == NULL)
+        return EOF;
+
+    for(int i = 0; i < 4; i++) {
+        int byte = seq_getc(in);
+        if(byte == EOF)
+            return EOF;
+        d.x = (d.x << 8) | byte;
+    }
+    uint64_t total = entropy_read_header(&d, c, &nrules);
+    if(total == 0 || nrules > SYMBOL_VALUE_MAX - FIRST_NONTERMINAL) {
+        debug("Malformed header of a coded block");
+        return EOF;
+    }
+
+    ENTROPY_SLOT *slots = c->slots;
+    uint64_t left = total;
+    for(uint32_t k = 0; k < nrules; k++) {
+        SYMBOL *head = new_rule(FIRST_NONTERMINAL + k);
+        add_rule(head);
+        // Every rule has at least one symbol in its body.
+        while(1) {
+            if(left == 0)
+                return EOF;
+            left--;
+            int sym = entropy_get(&d, slots);
+            if(sym == ENTROPY_END)
+                break;
+            uint32_t value = sym;
+            if(sym >= ENTROPY_RULE) {
+                int b = sym - ENTROPY_RULE;
+                uint32_t j = (1U << b) | entropy_get_bits(&d, b);
+                if(j >= nrules)
+                    return EOF;
+                value = FIRST_NONTERMINAL + j;
+            }
+            add_body(new_symbol(value, NULL), head);
+        }
+        if(head->next == head)
+            return EOF;
+        map_rule(head);
+    }
+    if(left != 0 || d.err || d.x != ENTROPY_STATE_LOW) {
+        debug("Coded block does not end where its header says it does");
+        return EOF;
+    }
+    return 0;
+}
+
+/**
+ * Free an entropy coder, together with all of its storage.
+ */
+void entropy_coder_free(ENTROPY_CODER *coder) {
+    if(coder == NULL)
+        return;
+    free(coder->rules);
+    free(coder->number);
+    free(coder->buf);
+    free(coder->count);
+    free(coder->freq);
+    free(coder->start);
+    free(coder->slots);
+    free(coder);
+}
@@ -0,0 +1,290 @@
+#include <string.h>
+
+#include "const.h"
+#include "expand.h"
+#include "debug.h"
+
+/*
+ * Expansion of the rules of a block during decompression.
+ * See expand.h for an overview.
+ *
+ * While a block is being expanded, the "refcnt" field of the head of each rule that
+ * has been reached holds one more than the index of the rule's entry in the cache.
+ * The decompressor does not otherwise use reference counts, and the field is set back
+ * to zero once the block has been expanded.
+ */
+
+/* The rule that a nonterminal symbol refers to, or NULL if it is not defined. */
+static inline SYMBOL *expand_lookup(SYMBOL *s) {
+    if(s->value >= SYMBOL_VALUE_MAX)
+        return NULL;
+    return *(rule_map + s->value);
+}
+
+/* The cache entry for a rule, or NULL if the rule has not been reached yet. */
+static inline RULE_EXPANSION *expand_entry(EXPAND_CACHE *c, SYMBOL *rule) {
+    return rule->refcnt ? c->rules + rule->refcnt - 1 : NULL;
+}
+
+/**
+ * Create the entry for a rule that has just been reached, and push the rule
+ * on the stack so that its body will be walked.
+ *
+ * @return 0 on success, -1 if storage could not be allocated.
+ */
+static int expand_push(EXPAND_CACHE *c, SYMBOL *rule, size_t *top) {
+    if(seq_reserve((void **)&c->rules, &c->rules_cap, c->nrules + 1, sizeof(RULE_EXPANSION)) ||
+       seq_reserve((void **)&c->stack, &c->stack_cap, *top + 1, sizeof(EXPAND_FRAME)))
+        return -1;
+    RULE_EXPANSION *e = c->rules + c->nrules++;
+    e->rule = rule;
+    e->length = 0;
+    e->offset = EXPAND_UNCACHED;
+    e->done = 0;
+    rule->refcnt = c->nrules;
+    EXPAND_FRAME *f = c->stack + (*top)++;
+    f->rule = rule;
+    f->pos = rule->next;
+    return 0;
+}
+
+/**
+ * Record the length of the expansion of a rule, all of whose nonterminals have
+ * already been handled, and flatten the expansion into the arena if it is small
+ * enough and all of the rules it refers to have been flattened too.
+ *
+ * @return 0 on success, -1 if storage could not be allocated.
+ */
+static int expand_flatten(EXPAND_CACHE *c, SYMBOL *rule, int flatten) {
+    RULE_EXPANSION *e = expand_entry(c, rule);
+    uint64_t len = 0;
+    for(SYMBOL *s = rule->next; s != rule; s = s->next) {
+        uint64_t n = 1;
+        if(IS_NONTERMINAL(s)) {
+            RULE_EXPANSION *x = expand_entry(c, expand_lookup(s));
+            n = x->length;
+            if(x->offset == EXPAND_UNCACHED)
+                flatten = 0;
+        }
+        len = len + n < len ? UINT64_MAX : len + n;
+    }
+    e->length = len;
+    e->done = 1;
+    if(!flatten || len > EXPAND_RULE_MAX || c->arena_len + len > EXPAND_ARENA_MAX)
+        return 0;
+
+    if(seq_reserve((void **)&c->arena, &c->arena_cap, c->arena_len + len, 1))
+        return -1;
+    unsigned char *p = c->arena + c->arena_len;
+    for(SYMBOL *s = rule->next; s != rule; s = s->next) {
+        if(IS_TERMINAL(s)) {
+            *p++ = s->value;
+        }
+        else {
+            RULE_EXPANSION *x = expand_entry(c, expand_lookup(s));
+            memcpy(p, c->arena + x->offset, x->length);
+            p += x->length;
+        }
+    }
+    e->offset = c->arena_len;
+    c->arena_len += len;
+    return 0;
+}
+
+/**
+ * Walk the rules that can be reached from a given rule, depth first, and handle
+ * each one with expand_flatten() once all of the rules it refers to have been handled.
+ * The given rule itself is never flattened, as it is only written out once, and
+ * if "flatten" is zero, no rule is: only the lengths of their expansions are found.
+ *
+ * @return 0 on success, -1 if a reference to an undefined rule or a cycle of
+ * rules was found, or if storage could not be allocated.
+ */
+static int expand_prepare(EXPAND_CACHE *c, SYMBOL *root, int flatten) {
+    size_t top = 0;
+    if(expand_push(c, root, &top))
+        return -1;
+    while(top > 0) {
+        EXPAND_FRAME *f = c->stack + top - 1;
+        SYMBOL *s = f->pos;
+        if(s == f->rule) {
+            top--;
+            if(expand_flatten(c, f->rule, flatten && f->rule != root))
+                return -1;
+            continue;
+        }
+        f->pos = s->next;
+        if(IS_TERMINAL(s))
+            continue;
+        SYMBOL *rule = expand_lookup(s);
+        if(rule == NULL) {
+            debug("Reference to undefined rule %d", s->value);
+            return -1;
+        }
+        RULE_EXPANSION *e = expand_entry(c, rule);
+        if(e == NULL) {
+            if(expand_push(c, rule, &top))
+                return -1;
+        }
+        else if(!e->done) {
+            debug("Rule %d refers to itself", rule->value);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write out the expansion of a rule that has been walked by expand_prepare(),
+ * copying flattened expansions and walking the rules that have none.
+ *
+ * @return 0 on success, EOF on a write error.
+ */
+static int expand_write(EXPAND_CACHE *c, SYMBOL *root, SEQ_WRITER *out) {
+    // With no cycles, a rule can be on the stack at most once at a time.
+    if(seq_reserve((void **)&c->stack, &c->stack_cap, c->nrules, sizeof(EXPAND_FRAME)))
+        return EOF;
+    size_t top = 1;
+    c->stack->rule = root;
+    c->stack->pos = root->next;
+    while(top > 0) {
+        EXPAND_FRAME *f = c->stack + top - 1;
+        SYMBOL *s = f->pos;
+        if(s == f->rule) {
+            top--;
+            continue;
+        }
+        f->pos = s->next;
+        if(IS_TERMINAL(s)) {
+            if(seq_putc(out, s->value) == EOF)
+                return EOF;
+            continue;
+        }
+        RULE_EXPANSION *x = expand_entry(c, expand_lookup(s));
+        if(x->offset != EXPAND_UNCACHED) {
+            if(seq_write(out, c->arena + x->offset, x->length))
+                return EOF;
+        }
+        else {
+            f = c->stack + top++;
+            f->rule = x->rule;
+            f->pos = x->rule->next;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the part of the expansion of a rule walked by expand_prepare() that begins
+ * "skip" bytes in and is "len" bytes long.  Only the rules whose expansions overlap
+ * that part are descended into; the others are passed over using their lengths.
+ *
+ * @return 0 on success, EOF on a write error.
+ */
+static int expand_write_range(EXPAND_CACHE *c, SYMBOL *root, uint64_t skip, uint64_t len,
+                              SEQ_WRITER *out) {
+    if(seq_reserve((void **)&c->stack, &c->stack_cap, c->nrules, sizeof(EXPAND_FRAME)))
+        return EOF;
+    size_t top = 1;
+    c->stack->rule = root;
+    c->stack->pos = root->next;
+    while(top > 0 && len > 0) {
+        EXPAND_FRAME *f = c->stack + top - 1;
+        SYMBOL *s = f->pos;
+        if(s == f->rule) {
+            top--;
+            continue;
+        }
+        f->pos = s->next;
+        RULE_EXPANSION *x = IS_TERMINAL(s) ? NULL : expand_entry(c, expand_lookup(s));
+        uint64_t n = x ? x->length : 1;
+        if(skip >= n) {
+            skip -= n;
+            continue;
+        }
+        if(x == NULL) {
+            if(seq_putc(out, s->value) == EOF)
+                return EOF;
+            len--;
+            continue;
+        }
+        f = c->stack + top++;
+        f->rule = x->rule;
+        f->pos = x->rule->next;
+    }
+    return 0;
+}
+
+/**
+ * Write the expansion of a rule of the block in the current context, which has
+ * been read completely and whose rules have been entered in rule_map.
+ *
+ * @param rule  The rule to be expanded (normally the main rule of the block).
+ * @param out  The writer to which the expansion is to be written.
+ * @return 0 on success, -1 if the rules are malformed (a nonterminal that refers to
+ * an undefined rule, or a rule whose expansion would include itself), or if
+ * storage could not be allocated, and EOF on a write error.
+ */
+int expand_rule(SYMBOL *rule, SEQ_WRITER *out) {
+    SEQ_CTX *ctx = current_ctx;
+    if(ctx->expansion == NULL && (ctx->expansion = calloc(1, sizeof(EXPAND_CACHE))) == NULL)
+        return -1;
+    EXPAND_CACHE *c = ctx->expansion;
+    c->nrules = 0;
+    c->arena_len = 0;
+
+    int ret = expand_prepare(c, rule, 1);
+    if(ret == 0)
+        ret = expand_write(c, rule, out);
+    for(size_t i = 0; i < c->nrules; i++)
+        (c->rules + i)->rule->refcnt = 0;
+    return ret;
+}
+
+/**
+ * Write part of the expansion of a rule of the block in the current context, as
+ * expand_rule() does for all of it.  The part begins "*skip" bytes into the expansion
+ * and is at most "*len" bytes long.  On return, *skip and *len have been reduced by
+ * the number of bytes passed over and written, respectively, so that when a range
+ * spans several blocks they can be handed on to the next block as they are.
+ *
+ * @return 0 on success, -1 if the rules are malformed or storage could not be
+ * allocated, and EOF on a write error.
+ */
+int expand_rule_range(SYMBOL *rule, uint64_t *skip, uint64_t *len, SEQ_WRITER *out) {
+    SEQ_CTX *ctx = current_ctx;
+    if(ctx->expansion == NULL && (ctx->expansion = calloc(1, sizeof(EXPAND_CACHE))) == NULL)
+        return -1;
+    EXPAND_CACHE *c = ctx->expansion;
+    c->nrules = 0;
+    c->arena_len = 0;
+
+    int ret = expand_prepare(c, rule, 0);
+    if(ret == 0) {
+        uint64_t total = expand_entry(c, rule)->length;
+        if(*skip >= total) {
+            *skip -= total;
+        }
+        else {
+            uint64_t n = total - *skip < *len ? total - *skip : *len;
+            ret = expand_write_range(c, rule, *skip, n, out);
+            *skip = 0;
+            *len -= n;
+        }
+    }
+    for(size_t i = 0; i < c->nrules; i++)
+        (c->rules + i)->rule->refcnt = 0;
+    return ret;
+}
+
+/**
+ * Free an expansion cache, together with all of its storage.
+ */
+void expand_cache_free(EXPAND_CACHE *cache) {
+    if(cache == NULL)
+        return;
+    free(cache->rules);
+    free(cache->arena);
+    free(cache->stack);
+    free(cache);
+}
@@ -3,6 +3,7 @@
 
 #include "const.h"
 #include "debug.h"
+#include "entropy.h"
 
 int main(int argc, char **argv) {
     if(validargs(argc, argv)) {
@@ -14,13 +15,29 @@ int main(int argc, char **argv) {
 
     int flagC = 0x2;
     int flagD = 0x4;
+    int flagI = 0x8;
+    int flagS = 0x10;
+    int flagR = 0x40;
+    // The compression options are held by the context, for the code that compresses.
+    current_ctx->options = global_options & (VERBOSE_OPTION | ENTROPY_OPTION);
+    // The number of worker threads, if -j was given, is in bits 8-15.
+    int jobs = (global_options >> 8) & 0xff;
     debug("Options: 0x%x", global_options);
     if(global_options & 1) {
         USAGE(*argv, EXIT_SUCCESS);
     }
     else if(global_options & flagC) {
         int ret = 0;
-        ret = compress(stdin, stdout, (global_options>>16));
+        if(global_options & flagS) {
+            ret = compress_streaming(stdin, stdout, (global_options>>16), stream_interval);
+        }
+        else if((global_options>>16) == 0) { // -b auto
+            ret = compress_adaptive(stdin, stdout, global_options & flagI);
+        }
+        else {
+            ret = compress_parallel(stdin, stdout, (global_options>>16), jobs,
+                                    global_options & flagI);
+        }
 
         if(ret == EOF) {
             USAGE(*argv, EXIT_FAILURE);
@@ -30,7 +47,13 @@ int main(int argc, char **argv) {
 
     }
     else if(global_options & flagD) {
-        int ret = decompress(stdin, stdout);
+        int ret = 0;
+        if(global_options & flagR) {
+            ret = decompress_range(stdin, stdout, range_offset, range_length);
+        }
+        else {
+            ret = decompress_parallel(stdin, stdout, jobs);
+        }
         if(ret == EOF) {
             USAGE(*argv, EXIT_FAILURE);
             return EXIT_FAILURE;
@@ -0,0 +1,377 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "const.h"
+#include "sequitur.h"
+#include "debug.h"
+#include "bufio.h"
+#include "block_index.h"
+#include "entropy.h"
+
+/*
+ * Parallel compression.
+ *
+ * Blocks are independent of each other, so each one can be compressed in a
+ * context of its own.  The main thread reads the input into a ring of block
+ * "slots", a pool of worker threads compresses the slots into memory buffers,
+ * and the main thread writes the finished blocks out in input order.  The ring
+ * holds twice as many blocks as there are workers, so that reading and writing
+ * overlap with compression.
+ *
+ * Decompression works the other way around, but needs the block index (see
+ * block_index.h) to find the blocks and their places in the output, which it
+ * writes with pwrite().
+ */
+
+int compressBlock(unsigned char *block, size_t len, SEQ_WRITER *out);
+int compressStream(FILE *in, FILE *out, int bsize, BLOCK_INDEX *ix);
+int decompressBlock(SEQ_READER *in, SEQ_WRITER *out, int coded);
+extern int compressedbytes;
+extern int writeouts;
+
+/* States of a block slot. */
+#define SLOT_FREE 0      // Available to receive input.
+#define SLOT_READY 1     // Holds input waiting to be compressed.
+#define SLOT_DONE 2      // Holds a compressed block waiting to be written out.
+
+typedef struct block_slot {
+    unsigned char *data;       // Uncompressed data for the block.
+    size_t len;                // Number of bytes in data.
+    SEQ_WRITER out;            // Memory writer that receives the compressed block.
+    int err;                   // Nonzero if compressing the block failed.
+    int state;                 // SLOT_FREE, SLOT_READY or SLOT_DONE.
+} BLOCK_SLOT;
+
+typedef struct block_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;      // Signalled when a slot becomes ready, or on shutdown.
+    pthread_cond_t done;       // Signalled when a slot has been compressed.
+    BLOCK_SLOT *slots;
+    int nslots;
+    long next_read;            // Sequence number of the next block to be read.
+    long next_take;            // Sequence number of the next block to be compressed.
+    int quit;                  // Set to make the workers exit.
+} BLOCK_POOL;
+
+typedef struct block_worker {
+    pthread_t thread;
+    BLOCK_POOL *pool;
+    SEQ_CTX *ctx;
+} BLOCK_WORKER;
+
+/**
+ * Body of a worker thread: compresses blocks, in order of arrival, until told to quit.
+ */
+static void *compress_worker(void *arg) {
+    BLOCK_WORKER *worker = arg;
+    BLOCK_POOL *pool = worker->pool;
+    current_ctx = worker->ctx;
+
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        while(!pool->quit && pool->next_take == pool->next_read)
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        if(pool->quit)
+            break;
+        BLOCK_SLOT *slot = pool->slots + pool->next_take++ % pool->nslots;
+        pthread_mutex_unlock(&pool->lock);
+
+        slot->out.len = slot->out.total = 0;
+        slot->err = compressBlock(slot->data, slot->len, &slot->out);
+
+        pthread_mutex_lock(&pool->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Compression function that uses several threads.
+ * Produces exactly the same transmission as compress(), but compresses up to
+ * "jobs" blocks at a time, each on its own worker thread.
+ *
+ * @param in  The stream from which input is to be read.
+ * @param out  The stream to which the compressed data is to be written.
+ * @param bsize  The maximum number of bytes read per block.
+ * @param jobs  The number of worker threads to use.
+ * @param index  Nonzero if a block index is to be written at the end of the
+ * transmission (see block_index.h).
+ * @return  The number of bytes written, in case of success, otherwise EOF.
+ */
+int compress_parallel(FILE *in, FILE *out, int bsize, int jobs, int index) {
+    BLOCK_INDEX ix = { 0 };
+    int ret;
+    if(jobs <= 1) {
+        ret = compressStream(in, out, bsize, index ? &ix : NULL);
+        block_index_free(&ix);
+        return ret;
+    }
+    if(bsize <= 0) {
+        return EOF;
+    }
+
+    BLOCK_POOL pool = { .nslots = 2 * jobs };
+    BLOCK_WORKER *workers = calloc(jobs, sizeof(BLOCK_WORKER));
+    pool.slots = calloc(pool.nslots, sizeof(BLOCK_SLOT));
+    if(workers == NULL || pool.slots == NULL) {
+        free(workers);
+        free(pool.slots);
+        return EOF;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    SEQ_WRITER w;
+    int failed = seq_writer_open(&w, out, SEQ_IOBUF_SIZE);
+    for(int i = 0; !failed && i < pool.nslots; i++) {
+        BLOCK_SLOT *slot = pool.slots + i;
+        slot->data = malloc(bsize);
+        if(slot->data == NULL || seq_writer_open(&slot->out, NULL, 4 * (size_t)bsize + 16))
+            failed = 1;
+    }
+    int started = 0;
+    for(; !failed && started < jobs; started++) {
+        BLOCK_WORKER *worker = workers + started;
+        worker->pool = &pool;
+        worker->ctx = seq_ctx_new();
+        if(worker->ctx != NULL)
+            worker->ctx->options = current_ctx->options;
+        if(worker->ctx == NULL ||
+           pthread_create(&worker->thread, NULL, compress_worker, worker)) {
+            seq_ctx_free(worker->ctx);
+            failed = 1;
+            break;
+        }
+    }
+    debug("Compressing with %d worker threads", started);
+
+    long next_write = 0;
+    int eof = 0;
+    if(!failed)
+        seq_putc(&w, SOT_MARK); // SOT
+    while(!failed) {
+        pthread_mutex_lock(&pool.lock);
+        // Fill every free slot with the next block of input.
+        while(!eof && pool.next_read - next_write < pool.nslots) {
+            BLOCK_SLOT *slot = pool.slots + pool.next_read % pool.nslots;
+            pthread_mutex_unlock(&pool.lock);
+            slot->len = fread(slot->data, 1, bsize, in);
+            pthread_mutex_lock(&pool.lock);
+            if(slot->len == 0) {
+                eof = 1;
+                break;
+            }
+            slot->state = SLOT_READY;
+            pool.next_read++;
+            pthread_cond_signal(&pool.ready);
+        }
+        if(next_write == pool.next_read) {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        // Write out the oldest block once it is done.
+        BLOCK_SLOT *slot = pool.slots + next_write % pool.nslots;
+        while(slot->state != SLOT_DONE)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        // The last block is known once the input has run out; it carries the index.
+        int last = eof && next_write == pool.next_read - 1;
+        size_t offset = w.total;
+        if(slot->err || seq_write(&w, slot->out.buf, slot->out.len) ||
+           (index && block_index_add(&ix, offset, slot->len)) ||
+           (index && last && block_index_write(&ix, &w)) ||
+           seq_putc(&w, 0x84) == EOF || seq_writer_flush(&w)) { // EOB
+            failed = 1;
+            break;
+        }
+        slot->state = SLOT_FREE;
+        next_write++;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    for(int i = 0; i < started; i++) {
+        pthread_join((workers + i)->thread, NULL);
+        seq_ctx_free((workers + i)->ctx);
+    }
+    for(int i = 0; i < pool.nslots; i++) {
+        free((pool.slots + i)->data);
+        seq_writer_close(&(pool.slots + i)->out);
+    }
+    free(pool.slots);
+    free(workers);
+    block_index_free(&ix);
+    pthread_cond_destroy(&pool.ready);
+    pthread_cond_destroy(&pool.done);
+    pthread_mutex_destroy(&pool.lock);
+
+    if(!failed)
+        seq_putc(&w, 0x82); // EOT
+    if(seq_writer_close(&w) || failed || fflush(out) == EOF) {
+        return EOF;
+    }
+    compressedbytes = w.total;
+    return compressedbytes;
+}
+
+typedef struct expand_pool {
+    pthread_mutex_t lock;
+    BLOCK_INDEX *ix;
+    int in_fd;                 // Descriptor from which the transmission is read.
+    off_t in_end;              // Offset of the EOT mark of the transmission.
+    int out_fd;                // Descriptor to which the data is written.
+    int coded;                 // Nonzero if the blocks are entropy coded.
+    uint64_t *out_offset;      // Offset in the output of the data of each block.
+    size_t next_block;         // Index of the next block to be expanded.
+    int failed;                // Set when a block could not be expanded or written.
+} EXPAND_POOL;
+
+typedef struct expand_worker {
+    pthread_t thread;
+    EXPAND_POOL *pool;
+    SEQ_CTX *ctx;
+} EXPAND_WORKER;
+
+/**
+ * Expand one block of a transmission and write its data into place in the output.
+ *
+ * @return 0 on success, -1 if the block is malformed or its data could not be written.
+ */
+static int expand_block(EXPAND_POOL *pool, size_t i) {
+    BLOCK_INDEX *ix = pool->ix;
+    off_t start = *(ix->offset + i);
+    off_t end = i + 1 < ix->count ? (off_t)*(ix->offset + i + 1) : pool->in_end;
+    size_t len = end - start;
+    unsigned char *data = malloc(len);
+    SEQ_READER r;
+    SEQ_WRITER w;
+    int ret = -1;
+
+    if(data == NULL || seq_writer_open(&w, NULL, *(ix->length + i) + 1)) {
+        free(data);
+        return -1;
+    }
+    if(pread(pool->in_fd, data, len, start) == (ssize_t)len) {
+        seq_reader_open_buffer(&r, data, len);
+        // The block must take up exactly the space between its index entries
+        // and expand to exactly the length recorded for it.
+        if(seq_getc(&r) == 0x83 && !decompressBlock(&r, &w, pool->coded) && seq_getc(&r) == EOF &&
+           w.len == *(ix->length + i) &&
+           pwrite(pool->out_fd, w.buf, w.len, *(pool->out_offset + i)) == (ssize_t)w.len) {
+            ret = 0;
+        }
+    }
+    free(data);
+    seq_writer_close(&w);
+    return ret;
+}
+
+/**
+ * Body of a decompression worker thread: expands blocks until there are none left.
+ */
+static void *expand_worker(void *arg) {
+    EXPAND_WORKER *worker = arg;
+    EXPAND_POOL *pool = worker->pool;
+    current_ctx = worker->ctx;
+
+    while(1) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next_block++;
+        int stop = pool->failed || i >= pool->ix->count;
+        pthread_mutex_unlock(&pool->lock);
+        if(stop)
+            break;
+        if(expand_block(pool, i)) {
+            debug("Block %lu could not be expanded", i);
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Decompression function that uses several threads.
+ * If the input is a regular file holding a transmission with a block index, and
+ * the output is a regular file not opened for appending, up to "jobs" blocks are
+ * expanded at a time, each on its own worker thread, and written straight to their
+ * places in the output.  Otherwise this is the same as decompress(): pwrite() on a
+ * descriptor with O_APPEND set ignores its offset and would write the blocks in
+ * the order they happen to finish.
+ *
+ * @param in  The stream from which the transmission is to be read.
+ * @param out  The stream to which the uncompressed data is to be written.
+ * @param jobs  The number of worker threads to use.
+ * @return  The number of bytes written, in case of success, otherwise EOF.
+ */
+int decompress_parallel(FILE *in, FILE *out, int jobs) {
+    BLOCK_INDEX ix = { 0 };
+    struct stat st;
+    off_t in_pos, out_pos;
+    int flags;
+
+    if(jobs <= 1 || fstat(fileno(out), &st) || !S_ISREG(st.st_mode) ||
+       (flags = fcntl(fileno(out), F_GETFL)) == -1 || (flags & O_APPEND) ||
+       (in_pos = ftello(in)) != 0 || fflush(out) == EOF || (out_pos = ftello(out)) < 0 ||
+       block_index_read(&ix, fileno(in))) {
+        return decompress(in, out);
+    }
+    debug("Expanding %lu indexed blocks with %d worker threads", ix.count, jobs);
+
+    EXPAND_POOL pool = { .ix = &ix, .in_fd = fileno(in), .out_fd = fileno(out) };
+    EXPAND_WORKER *workers = calloc(jobs, sizeof(EXPAND_WORKER));
+    pool.out_offset = malloc(ix.count * sizeof(uint64_t));
+    unsigned char sot = 0;
+    if(workers == NULL || pool.out_offset == NULL || fstat(pool.in_fd, &st) ||
+       pread(pool.in_fd, &sot, 1, 0) != 1 || (sot != 0x81 && sot != ENTROPY_SOT)) {
+        free(workers);
+        free(pool.out_offset);
+        block_index_free(&ix);
+        return EOF;
+    }
+    pool.in_end = st.st_size - 1;
+    pool.coded = sot == ENTROPY_SOT;
+    uint64_t total = 0;
+    for(size_t i = 0; i < ix.count; i++) {
+        *(pool.out_offset + i) = out_pos + total;
+        total += *(ix.length + i);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+
+    int started = 0;
+    for(; started < jobs; started++) {
+        EXPAND_WORKER *worker = workers + started;
+        worker->pool = &pool;
+        worker->ctx = seq_ctx_new();
+        if(worker->ctx == NULL ||
+           pthread_create(&worker->thread, NULL, expand_worker, worker)) {
+            seq_ctx_free(worker->ctx);
+            pool.failed = started == 0;
+            break;
+        }
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join((workers + i)->thread, NULL);
+        seq_ctx_free((workers + i)->ctx);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(pool.out_offset);
+    block_index_free(&ix);
+
+    // Leave both streams positioned as decompress() would have.
+    if(pool.failed || fseeko(in, 0, SEEK_END) || fseeko(out, out_pos + total, SEEK_SET)) {
+        return EOF;
+    }
+    writeouts = total;
+    return writeouts;
+}
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "const.h"
+#include "sequitur.h"
+#include "debug.h"
+#include "bufio.h"
+#include "block_index.h"
+#include "entropy.h"
+
+/*
+ * Random access.
+ *
+ * decompress_range() writes just the bytes [offset, offset + len) of the data that a
+ * transmission represents.  If the transmission is in a regular file with a block
+ * index (see block_index.h), the blocks that lie entirely outside the range are not
+ * even read.  Otherwise the transmission is read from its start, but the blocks
+ * before the range are only parsed, not expanded, and reading stops as soon as the
+ * range is complete.  Within a block, only the rules whose expansions overlap the
+ * range are expanded (see expand.h).
+ */
+
+int decompressBlockRange(SEQ_READER *in, SEQ_WRITER *out, uint64_t *skip, uint64_t *len,
+                         int coded);
+extern int writeouts;
+
+/**
+ * Write a range of the data of a transmission that has a block index, reading only
+ * the blocks that overlap it.
+ *
+ * @param coded  Nonzero if the blocks are entropy coded (see entropy.h).
+ * @return 0 on success, -1 if a block is malformed or does not agree with the
+ * index, or could not be read, and EOF on a write error.
+ */
+static int range_indexed(BLOCK_INDEX *ix, int fd, off_t in_end, SEQ_WRITER *w,
+                         uint64_t offset, uint64_t len, int coded) {
+    unsigned char *data = NULL;
+    size_t cap = 0;
+    uint64_t start = 0;  // Offset in the data of the current block.
+    int ret = 0;
+
+    for(size_t i = 0; i < ix->count && len > 0 && ret == 0; start += *(ix->length + i++)) {
+        uint64_t blen = *(ix->length + i);
+        if(offset >= start + blen)
+            continue;
+        off_t from = *(ix->offset + i);
+        off_t to = i + 1 < ix->count ? (off_t)*(ix->offset + i + 1) : in_end;
+        size_t n = to - from;
+        if(n > cap) {
+            unsigned char *p = realloc(data, n);
+            if(p == NULL) {
+                ret = -1;
+                break;
+            }
+            data = p;
+            cap = n;
+        }
+        if(pread(fd, data, n, from) != (ssize_t)n) {
+            ret = -1;
+            break;
+        }
+        SEQ_READER r;
+        seq_reader_open_buffer(&r, data, n);
+        uint64_t skip = offset > start ? offset - start : 0;
+        uint64_t want = blen - skip < len ? blen - skip : len;
+        uint64_t left = len;
+        // The block must expand to at least the length recorded for it.
+        if(seq_getc(&r) != 0x83 || decompressBlockRange(&r, w, &skip, &left, coded) ||
+           skip != 0 || len - left != want) {
+            debug("Block %lu does not agree with the index", i);
+            ret = w->err ? EOF : -1;
+        }
+        len = left;
+    }
+    free(data);
+    return ret;
+}
+
+/**
+ * Write a range of the data of a transmission, reading it from the start and
+ * stopping as soon as the range is complete.
+ *
+ * @return 0 on success, EOF on a malformed transmission or write error.
+ */
+static int range_sequential(SEQ_READER *in, SEQ_WRITER *out, uint64_t offset, uint64_t len) {
+    int byte = seq_getc(in);
+    if(byte != 0x81 && byte != ENTROPY_SOT) { // SOT
+        return EOF;
+    }
+    int coded = byte == ENTROPY_SOT;
+    byte = seq_getc(in);
+    while(byte == 0x83) { // SOB
+        if(decompressBlockRange(in, out, &offset, &len, coded)) {
+            return EOF;
+        }
+        if(len == 0) {
+            return 0;
+        }
+        byte = seq_getc(in);
+    }
+    // The range runs past the end of the data: the rest of the transmission
+    // must be well-formed, as for decompress().
+    if(byte != 0x82 || seq_getc(in) != EOF) { // EOT
+        return EOF;
+    }
+    return 0;
+}
+
+/**
+ * Decompression function that writes only a range of the data.
+ * If the range runs past the end of the data, only the part of it that lies within
+ * the data is written.
+ *
+ * @param in  The stream from which the transmission is to be read.  If it is a
+ * regular file, nothing must have been read from it yet.
+ * @param out  The stream to which the data in the range is to be written.
+ * @param offset  The offset in the data of the first byte to be written.
+ * @param len  The largest number of bytes to be written.
+ * @return  The number of bytes written, in case of success, otherwise EOF.
+ */
+int decompress_range(FILE *in, FILE *out, uint64_t offset, uint64_t len) {
+    BLOCK_INDEX ix = { 0 };
+    SEQ_READER r;
+    SEQ_WRITER w;
+    struct stat st;
+    int ret;
+
+    if(seq_writer_open(&w, out, SEQ_IOBUF_SIZE)) {
+        return EOF;
+    }
+    if(ftello(in) == 0 && block_index_read(&ix, fileno(in)) == 0 &&
+       fstat(fileno(in), &st) == 0) {
+        debug("Using the index of %lu blocks", ix.count);
+        unsigned char sot = 0;
+        ret = pread(fileno(in), &sot, 1, 0) == 1 && (sot == 0x81 || sot == ENTROPY_SOT) ?
+              range_indexed(&ix, fileno(in), st.st_size - 1, &w, offset, len,
+                            sot == ENTROPY_SOT) : EOF;
+        block_index_free(&ix);
+        // Leave the input positioned as if it had all been read.
+        if(fseeko(in, 0, SEEK_END)) {
+            ret = EOF;
+        }
+    }
+    else {
+        if(seq_reader_open(&r, in, SEQ_IOBUF_SIZE)) {
+            seq_writer_close(&w);
+            return EOF;
+        }
+        ret = range_sequential(&r, &w, offset, len);
+        seq_reader_close(&r);
+    }
+
+    if(seq_writer_close(&w) || ret || fflush(out) == EOF) {
+        return EOF;
+    }
+    writeouts = w.total;
+    return writeouts;
+}
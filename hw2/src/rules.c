@@ -36,8 +36,8 @@
  * themselves.
  *
  * Rules are also maintained in a list of all rules, which is also a circular,
- * doubly linked list, but it uses the "nextr" and "prevr" fields in the SYMBOL
- * structure rather than the "next" and "prev" fields that are used within a rule.
+ * doubly linked list, but it uses the "nextr" and "prevr" links of the rule heads
+ * (see NEXTR and PREVR) rather than the "next" and "prev" fields that are used within a rule.
  * The list is accessed via the "main_rule" variable, which points to the
  * head of a rule.  The heads of other rules in the list are accessed by following
  * the nextr and prevr pointers starting from the head of the main rule.
@@ -49,14 +49,45 @@
 
 /**
  * Initializes the rules by setting main_rule to NULL and clearing the rule_map.
+ *
+ * Only the entries that have been set by map_rule() since the last call are
+ * cleared, so the cost is proportional to the number of rules defined in the
+ * current block rather than to the size of the rule_map.
  */
 void init_rules(void) {
+    SEQ_CTX *ctx = current_ctx;
+
     // Set main_rule to null
     main_rule = NULL;
 
-    //changed the loop to memset
-    memset(rule_map, 0, sizeof(SYMBOL *) * SYMBOL_VALUE_MAX);
+    if(ctx->rule_dirty_overflow) {
+        memset(rule_map, 0, sizeof(SYMBOL *) * SYMBOL_VALUE_MAX);
+    }
+    else {
+        for(int i = 0; i < ctx->rule_dirty_count; i++) {
+            *(rule_map + *(ctx->rule_dirty + i)) = NULL;
+        }
+    }
+    ctx->rule_dirty_count = 0;
+    ctx->rule_dirty_overflow = 0;
+}
 
+/**
+ * Enter a rule in the rule_map, under the value of its head, recording the entry
+ * for the next call to init_rules() if it was previously unused.
+ *
+ * @param rule  The head of the rule.  Its value must be less than SYMBOL_VALUE_MAX.
+ */
+void map_rule(SYMBOL *rule) {
+    SEQ_CTX *ctx = current_ctx;
+    SYMBOL **entry = rule_map + rule->value;
+    if(*entry == NULL) {
+        if(ctx->rule_dirty_count < RULE_DIRTY_MAX)
+            *(ctx->rule_dirty + ctx->rule_dirty_count++) = rule->value;
+        else
+            ctx->rule_dirty_overflow = 1;
+    }
+    *entry = rule;
 }
 
 /**
@@ -79,6 +110,8 @@ SYMBOL *new_rule(int v) {
     (*rule).rule = rule;
     (*rule).next = rule;
     (*rule).prev = rule;
+    NEXTR(rule) = NULL;
+    PREVR(rule) = NULL;
 
     return rule;
 }
@@ -92,21 +125,21 @@ SYMBOL *new_rule(int v) {
  * In this case, its "nextr" and "prevr" fields are initialized to point
  * back to the rule itself, thereby creating an empty, doubly linked circular
  * list. If main_rule is not-NULL, then the rule is inserted at the end of
- * the list; i.e. between main_rule->prevr and main_rule.
+ * the list; i.e. between PREVR(main_rule) and main_rule.
  */
 void add_rule(SYMBOL *rule) {
     debug("running add_rule");
     if(main_rule == NULL) {
         main_rule = rule;
-        main_rule->prevr = rule;
-        main_rule->nextr = rule;
+        PREVR(main_rule) = rule;
+        NEXTR(main_rule) = rule;
     }
     else {
-        SYMBOL *last_rule = main_rule->prevr;
-        rule->nextr = main_rule; // Rule's nextr points to main_rule
-        rule->prevr = last_rule;// Rule's prevr points to last rule
-        last_rule->nextr = rule;// Main_rule's prevr points to rule
-        main_rule->prevr = rule;// Last rule's nextr points to rule
+        SYMBOL *last_rule = PREVR(main_rule);
+        NEXTR(rule) = main_rule; // Rule's nextr points to main_rule
+        PREVR(rule) = last_rule;// Rule's prevr points to last rule
+        NEXTR(last_rule) = rule;// Main_rule's prevr points to rule
+        PREVR(main_rule) = rule;// Last rule's nextr points to rule
     }
 }
 
@@ -123,10 +156,10 @@ void add_rule(SYMBOL *rule) {
  */
 void delete_rule(SYMBOL *rule) {
     // Remove from doubly linked list
-    (*((*rule).prevr)).nextr = (*rule).nextr;
-    (*((*rule).nextr)).prevr = (*rule).prevr;
-    (*rule).nextr = NULL;
-    (*rule).prevr = NULL;
+    NEXTR(PREVR(rule)) = NEXTR(rule);
+    PREVR(NEXTR(rule)) = PREVR(rule);
+    NEXTR(rule) = NULL;
+    PREVR(rule) = NULL;
 
     // If refcnt is zero, recycle it. But why? What happens to the ones not recycled?
     if((*rule).refcnt == 0) {
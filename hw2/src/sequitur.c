@@ -64,8 +64,12 @@ static void join_symbols(SYMBOL *this, SYMBOL *next) {
 	   next->value == next->prev->value && next->value == next->next->value)
 	    digram_put(next);
 	if(this->prev && this->next &&
-	   this->value == this->prev->value && this->value == this->next->value)
+	   this->value == this->prev->value && this->value == this->next->value) {
 	    digram_put(this);
+	    // The entry just made is left behind by the relinking below, so it has
+	    // to be deleted before this symbol can be recycled (see digram_forget()).
+	    this->refcnt = 1;
+	}
     }
     this->next = next;
     next->prev = this;
@@ -181,14 +185,74 @@ static void expand_instance(SYMBOL *this) {
     delete_rule(rule);
 }
 
+/*
+ * Restoring the "no repeated digrams" and "rule utility" constraints after a digram
+ * has been created is naturally recursive: checking a digram may process a match,
+ * which replaces digrams by nonterminals, which creates new digrams that have to be
+ * checked in turn.  On long runs and nested repeats, that recursion gets deep, so
+ * instead of having check_digram(), process_match() and replace_digram() call one
+ * another, check_digram() keeps an explicit stack of the matches and replacements
+ * that are in progress, and runs each of them a step at a time.  A step that would
+ * recursively check a digram does the check itself, and only if that finds a match
+ * does it push a frame to process the match, and return to the driver loop, which
+ * resumes it at its next step once the processing is complete.  The steps are done
+ * in exactly the order in which the recursive calls would have done them, so the
+ * grammar that results is the same.
+ */
+
+/* The work a frame on the stack of check_digram() is doing. */
+typedef enum {
+    PROCESS_MATCH,     // Handling the match "other" of the digram headed by "this".
+    REPLACE_DIGRAM     // Replacing the digram headed by "this" by the rule "other".
+} CHECK_OP;
+
+typedef struct check_frame {
+    CHECK_OP op;
+    int step;          // Where the work is to be resumed.
+    SYMBOL *this;
+    SYMBOL *other;     // The match for PROCESS_MATCH, the rule for REPLACE_DIGRAM.
+    SYMBOL *saved;     // The rule for PROCESS_MATCH, "prev" for REPLACE_DIGRAM.
+} CHECK_FRAME;
+
+/**
+ * Push a frame on the stack of check_digram(), enlarging the stack if it is full.
+ * If storage for the stack cannot be allocated, then a message is printed to stderr
+ * and abort() is called.
+ *
+ * @param depth  The number of frames on the stack.
+ * @return  The new number of frames on the stack.
+ */
+static int push_check(int depth, CHECK_OP op, SYMBOL *this, SYMBOL *other) {
+    SEQ_CTX *ctx = current_ctx;
+    if(__builtin_expect(depth == ctx->checks_cap, 0)) {
+	int cap = ctx->checks_cap ? 2 * ctx->checks_cap : 256;
+	CHECK_FRAME *checks = realloc(ctx->checks, cap * sizeof(CHECK_FRAME));
+	if(checks == NULL) {
+	    fprintf(stderr, "Could not allocate storage for checking digrams!\n");
+	    abort();
+	}
+	ctx->checks = checks;
+	ctx->checks_cap = cap;
+    }
+    CHECK_FRAME *f = ctx->checks + depth;
+    f->op = op;
+    f->step = 0;
+    f->this = this;
+    f->other = other;
+    return depth + 1;
+}
+
 /**
  * Replace a digram by a nonterminal.
+ * This is the first step of replacing a digram; the digrams that the replacement
+ * creates are then checked by check_digram() (see below).
  *
  * @param this  The first symbol of the digram to be replaced.
  * @param rule  The rule whose body matches the digram to be replaced and whose
  * head should replace the existing digram.
+ * @return  The symbol before the nonterminal that has replaced the digram.
  */
-static void replace_digram(SYMBOL *this, SYMBOL *rule) {
+static SYMBOL *replace_digram(SYMBOL *this, SYMBOL *rule) {
     debug("Replace digram <%lu> using rule [%lu] for %d",
 	  SYMBOL_INDEX(this), SYMBOL_INDEX(rule), rule->value);
     SYMBOL *prev = this->prev;
@@ -202,75 +266,66 @@ static void replace_digram(SYMBOL *this, SYMBOL *rule) {
     // and insert it in place of the original digram.
     SYMBOL *new = new_symbol(rule->value, rule);
     insert_after(prev, new);
-
-    // It might be the case that the insertion has created a second instance
-    // of an already existing digram, so we have to check for that and take
-    // appropriate action to restore the "no repeated digrams" constraint.
-    // There are two digrams that might need to be checked, in general.
-    // We first check and handle the digram that starts to the left, at "prev".
-    // If in the process of handling that digram, it happens to get replaced,
-    // then the replacement will have deleted the nonterminal that we just inserted
-    // (and recursively handled any other digrams that might have gotten created),
-    // so there is no need to do anything else at this point.
-    // On the other hand, if that digram did not happen to get replaced, then we also
-    // have to check the digram starting at prev->next, which is still headed by the
-    // nonterminal we just inserted.
-    if(!check_digram(prev)) {
-	check_digram(prev->next);
-    }
+    return prev;
 }
 
 /**
- * This is the core function of the algorithm: handle the case in which a just-created
+ * This is the core of the algorithm: handle the case in which a just-created
  * digram matches a previously existing one.
+ * This function finds or creates the rule whose head is to replace the digrams,
+ * and pushes a frame that does the rest of the work (see check_digram()).
  *
+ * @param depth  The number of frames on the stack of check_digram().
  * @param this  The just-created digram.
  * @param match  The previously existing matching digram.
+ * @return  The new number of frames on the stack.
  */
-static void process_match(SYMBOL *this, SYMBOL *match) {
+static int process_match(int depth, SYMBOL *this, SYMBOL *match) {
     debug("Process matching digrams <%lu> and <%lu>",
 	  SYMBOL_INDEX(this), SYMBOL_INDEX(match));
-    SYMBOL *rule = NULL; 
+    depth = push_check(depth, PROCESS_MATCH, this, match);
+    CHECK_FRAME *f = current_ctx->checks + depth - 1;
 
     if(IS_RULE_HEAD(match->prev) && IS_RULE_HEAD(match->next->next)) {
 	// If the digram headed by match constitutes the entire right-hand side
 	// of a rule, then we don't create any new rule.  Instead we use the
 	// existing rule to replace_digram for the newly inserted digram.
-	rule = match->prev->rule;
-	replace_digram(this, match->prev->rule);
-    } else {
-	// Otherwise, we create a new rule.
-	// Note that only one digram is created by this rule, and the insert_after
-	// calls will only delete digrams from the hash table, but do not insert any.
-	// In fact, no digrams will be deleted during the construction of
-	// the new rule because the calls are being made in such a way that we are
-	// never overwriting any pointers that were previously non-NULL.
-	rule = new_rule(next_nonterminal_value++);
-	add_rule(rule);
-	insert_after(rule->prev, new_symbol(this->value, this->rule));
-	insert_after(rule->prev, new_symbol(this->next->value, this->next->rule));
-
-	// Now, replace the two existing instances of the right-hand side of the
-	// rule by nonterminals that refer to the rule.
-	// Note that these will potentially cause the destruction of digrams,
-	// leading to their deletion from the hash table.
-	// They will potentially also cause the creation of digrams, due to the
-	// insertion of the nonterminal symbol.
-	// However, since the nonterminal symbol is a freshly created one that
-	// did not exist before, these replacements cannot result in the creation
-	// of digrams that duplicate already existing ones.
-	replace_digram(match, rule);
-	replace_digram(this, rule);
-
-	// Insert the right-hand side of the new rule into the digram table.
-	// Note that no other rules that might have been created as a result of the
-	// two substitutions above could have the same right-hand side as the rule
-	// we are about to insert here, because, the right-hand sides of any of these
-	// other rules must contain the new nonterminal that is at the head of the
-	// current rule but not in the body of the current rule.
-	digram_put(rule->next);
+	f->saved = match->prev->rule;
+	f->step = 3;
+	return push_check(depth, REPLACE_DIGRAM, this, f->saved);
     }
+    // Otherwise, we create a new rule.
+    // Note that only one digram is created by this rule, and the insert_after
+    // calls will only delete digrams from the hash table, but do not insert any.
+    // In fact, no digrams will be deleted during the construction of
+    // the new rule because the calls are being made in such a way that we are
+    // never overwriting any pointers that were previously non-NULL.
+    SYMBOL *rule = new_rule(next_nonterminal_value++);
+    add_rule(rule);
+    insert_after(rule->prev, new_symbol(this->value, this->rule));
+    insert_after(rule->prev, new_symbol(this->next->value, this->next->rule));
+
+    // Now, replace the two existing instances of the right-hand side of the
+    // rule by nonterminals that refer to the rule.
+    // Note that these will potentially cause the destruction of digrams,
+    // leading to their deletion from the hash table.
+    // They will potentially also cause the creation of digrams, due to the
+    // insertion of the nonterminal symbol.
+    // However, since the nonterminal symbol is a freshly created one that
+    // did not exist before, these replacements cannot result in the creation
+    // of digrams that duplicate already existing ones.
+    // The instance at "match" is replaced first, then the one at "this".
+    f->saved = rule;
+    f->step = 1;
+    return push_check(depth, REPLACE_DIGRAM, match, rule);
+}
 
+/**
+ * The last step of processing a match: restore the "rule utility" constraint.
+ *
+ * @param rule  The rule whose head has replaced the matching digrams.
+ */
+static void check_rule_utility(SYMBOL *rule) {
     // We have now restored the "no repeated digram" property, but it might be that
     // deletions that occurred during the above substitutions have left us with a rule
     // that is used only once, which would violate the "rule utility" constraint.
@@ -304,25 +359,19 @@ static void process_match(SYMBOL *this, SYMBOL *match) {
 }
 
 /**
- * Function to check for whether a just-created digram already exists somewhere.
- * If it does, then we have to restore the "no repeated digrams" condition
- * by replacing these digrams by a nonterminal.  If the pre-existing digram is
- * already the entire body of an existing rule, then there is no need to create
- * a new rule.  In that case, we just replace the just-created digram by a
- * nonterminal that refers to that existing rule.  Otherwise, we create a new
- * rule, with a new nonterminal at its head, and we use that new nonterminal
- * to replace the two existing instances of the digram.
+ * Look for a match of a just-created digram, inserting the digram into the
+ * digram table if it has none.
  *
  * @param this  The first symbol of the digram to be checked.
- * @return  0 if no replacement was performed, nonzero otherwise.
+ * @return  The matching digram, if the match has to be processed, otherwise NULL.
  */
-int check_digram(SYMBOL *this) {
+static inline SYMBOL *find_match(SYMBOL *this) {
     debug("Check digram <%lu> for a match", SYMBOL_INDEX(this));
 
     // If the "digram" is actually a single symbol at the beginning or
     // end of a rule, then there is no need to do anything.
     if(IS_RULE_HEAD(this) || IS_RULE_HEAD(this->next))
-	return 0;
+	return NULL;
 
     // Otherwise, look up the digram in the digram table, to see if there is
     // a matching instance.
@@ -330,16 +379,90 @@ int check_digram(SYMBOL *this) {
     if(match == NULL) {
         // The digram did not previously exist -- insert it now.
 	digram_put(this);
-	return 0;
+	return NULL;
     }
 
     // If the existing digram overlaps the one we are checking, then what we have
     // is a triple, like aaa.  In this case, we do not replace it because the resulting
     // rule would only be used once.
-    if(match->next == this) {
+    if(match->next == this)
+	return NULL;
+    return match;
+}
+
+/**
+ * Function to check for whether a just-created digram already exists somewhere.
+ * If it does, then we have to restore the "no repeated digrams" condition
+ * by replacing these digrams by a nonterminal.  If the pre-existing digram is
+ * already the entire body of an existing rule, then there is no need to create
+ * a new rule.  In that case, we just replace the just-created digram by a
+ * nonterminal that refers to that existing rule.  Otherwise, we create a new
+ * rule, with a new nonterminal at its head, and we use that new nonterminal
+ * to replace the two existing instances of the digram.
+ *
+ * @param this  The first symbol of the digram to be checked.
+ * @return  0 if no replacement was performed, nonzero otherwise.
+ */
+int check_digram(SYMBOL *this) {
+    SYMBOL *match = find_match(this);
+    if(match == NULL)
 	return 0;
-    } else {
-	process_match(this, match);
-	return 1;
+
+    int depth = process_match(0, this, match);
+    while(depth > 0) {
+	// Pushing a frame may move the stack, so f is only used until then.
+	CHECK_FRAME *f = current_ctx->checks + depth - 1;
+
+	if(f->op == REPLACE_DIGRAM) {
+	    if(f->step == 0) {
+		f->saved = replace_digram(f->this, f->other);
+
+		// It might be the case that the insertion has created a second instance
+		// of an already existing digram, so we have to check for that and take
+		// appropriate action to restore the "no repeated digrams" constraint.
+		// There are two digrams that might need to be checked, in general.
+		// We first check and handle the digram that starts to the left, at "prev".
+		// If in the process of handling that digram, it happens to get replaced,
+		// then the replacement will have deleted the nonterminal that we just inserted
+		// (and recursively handled any other digrams that might have gotten created),
+		// so there is no need to do anything else at this point.
+		// On the other hand, if that digram did not happen to get replaced, then we also
+		// have to check the digram starting at prev->next, which is still headed by the
+		// nonterminal we just inserted.
+		SYMBOL *prev = f->saved;
+		if((match = find_match(prev)) != NULL) {
+		    f->step = 1;
+		    depth = process_match(depth, prev, match);
+		    continue;
+		}
+		if((match = find_match(prev->next)) != NULL) {
+		    f->step = 1;
+		    depth = process_match(depth, prev->next, match);
+		    continue;
+		}
+	    }
+	    depth--;
+	    continue;
+	}
+
+	// PROCESS_MATCH
+	if(f->step == 1) {
+	    // The instance at "match" has been replaced; now replace "this".
+	    f->step = 2;
+	    depth = push_check(depth, REPLACE_DIGRAM, f->this, f->saved);
+	    continue;
+	}
+	if(f->step == 2) {
+	    // Insert the right-hand side of the new rule into the digram table.
+	    // Note that no other rules that might have been created as a result of the
+	    // two substitutions above could have the same right-hand side as the rule
+	    // we are about to insert here, because, the right-hand sides of any of these
+	    // other rules must contain the new nonterminal that is at the head of the
+	    // current rule but not in the body of the current rule.
+	    digram_put(f->saved->next);
+	}
+	check_rule_utility(f->saved);
+	depth--;
     }
+    return 1;
 }
@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "const.h"
+#include "sequitur.h"
+#include "debug.h"
+#include "bufio.h"
+#include "entropy.h"
+
+/*
+ * Streaming compression.
+ *
+ * compress() only ends a block once it has read a full block of input or reached
+ * the end of it, so when the input is a pipe from a slow producer (a log, say),
+ * nothing may come out for a long time.  In streaming mode, a block is also ended
+ * once a given interval has passed since its first byte arrived, even if it is not
+ * full.  The input is read with read() straight from its file descriptor, waiting
+ * with poll() no longer than until the current block is due, and every block is
+ * flushed to the output as soon as it is complete, so that a consumer can expand
+ * each one as it arrives.  The transmission has the usual framing throughout.
+ */
+
+int compressBlock(unsigned char *block, size_t len, SEQ_WRITER *out);
+extern int compressedbytes;
+
+/* The current time, in milliseconds, on a clock that is not affected by clock changes. */
+static long long stream_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Compress one block and deliver it, complete with its EOB mark, to the output.
+ *
+ * @return 0 on success, EOF on a write error.
+ */
+static int stream_block(unsigned char *block, size_t len, SEQ_WRITER *w, FILE *out) {
+    if(compressBlock(block, len, w) || seq_putc(w, 0x84) == EOF || // EOB
+       seq_writer_flush(w) || fflush(out) == EOF) {
+        return EOF;
+    }
+    return 0;
+}
+
+/**
+ * Streaming version of compress().
+ * The input is split into blocks of at most "bsize" bytes, as by compress(), except
+ * that a block is also ended once "interval" milliseconds have passed since its first
+ * byte was read.  Each block is written and flushed as soon as it has been compressed.
+ *
+ * @param in  The stream from which input is to be read.  Nothing must have been read
+ * from it through stdio, as it is read directly from its file descriptor.
+ * @param out  The stream to which the transmission is to be written.
+ * @param bsize  The maximum number of bytes in a block.
+ * @param interval  The longest time, in milliseconds, that input is held back.
+ * @return  The number of bytes written, in case of success, otherwise EOF.
+ */
+int compress_streaming(FILE *in, FILE *out, int bsize, int interval) {
+    SEQ_WRITER w;
+    unsigned char *block;
+    size_t len = 0;
+    long long due = 0;
+    int failed = 0;
+    int fd = fileno(in);
+
+    if(bsize <= 0 || interval <= 0 || fd < 0) {
+        return EOF;
+    }
+    if(seq_writer_open(&w, out, 4 * (size_t)bsize + SEQ_IOBUF_SIZE)) {
+        return EOF;
+    }
+    block = malloc(bsize);
+    if(block == NULL) {
+        seq_writer_close(&w);
+        return EOF;
+    }
+
+    // Let the consumer see the start of the transmission right away.
+    if(seq_putc(&w, SOT_MARK) == EOF || seq_writer_flush(&w) || fflush(out) == EOF) { // SOT
+        failed = 1;
+    }
+    while(!failed) {
+        if(len > 0) {
+            // Wait for more input only until the pending block is due.
+            long long wait = due - stream_now();
+            struct pollfd p = { .fd = fd, .events = POLLIN };
+            int ready = wait > 0 ? poll(&p, 1, (int)wait) : 0;
+            if(ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if(ready < 0) {
+                debug("poll() failed: %d", errno);
+                failed = 1;
+                break;
+            }
+            if(ready == 0) {
+                debug("Ending a block of %lu bytes on timeout", len);
+                failed = stream_block(block, len, &w, out) != 0;
+                len = 0;
+                continue;
+            }
+        }
+        ssize_t n = read(fd, block + len, bsize - len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            debug("read() failed: %d", errno);
+            failed = 1;
+            break;
+        }
+        if(n == 0) {
+            break;
+        }
+        if(len == 0) {
+            due = stream_now() + interval;
+        }
+        len += n;
+        if(len == (size_t)bsize) {
+            failed = stream_block(block, len, &w, out) != 0;
+            len = 0;
+        }
+    }
+    if(!failed && len > 0) {
+        failed = stream_block(block, len, &w, out) != 0;
+    }
+    free(block);
+    seq_putc(&w, 0x82); // EOT
+
+    if(seq_writer_close(&w) || failed || fflush(out) == EOF) {
+        return EOF;
+    }
+    compressedbytes = w.total;
+    return compressedbytes;
+}
@@ -1,21 +1,23 @@
 #include "const.h"
 #include "sequitur.h"
+#include "debug.h"
 
 /*
  * Symbol management.
  *
- * The functions here manage a statically allocated array of SYMBOL structures,
- * together with a stack of "recycled" symbols.
+ * The functions here manage the pool of SYMBOL structures held by the current
+ * context, which is made up of slabs that are allocated as they are needed,
+ * together with a free list of "recycled" symbols.
+ *
+ * In a debugging build, a recycled symbol is filled with SYMBOL_POISON until it
+ * is handed out again, so that a symbol that is still in use after it has been
+ * recycled is caught: following its links faults, and any store into it is
+ * detected when it is taken off the free list.
  */
 
-/*
- * Initialization of this global variable that could not be performed in the header file.
- */
-int next_nonterminal_value = FIRST_NONTERMINAL;
 static inline SYMBOL *get_recycled_symbol();
 static inline void set_new_symbol_values(SYMBOL *sym, SYMBOL *rule, int value);
-SYMBOL *recycled_stack[MAX_SYMBOLS];
-int recycled_stack_top = -1;
+static SYMBOL *grow_symbol_slabs(void);
 /**
  * Initialize the symbols module.
  * Frees all symbols, setting num_symbols to 0, and resets next_nonterminal_value
@@ -24,8 +26,11 @@ int recycled_stack_top = -1;
 void init_symbols(void) {
     // TODO - Free all symbols
     // Setting the pointer back to zero will in a way free all symbols
+    // The slabs themselves are kept for the next block.
     num_symbols = 0;
     next_nonterminal_value = FIRST_NONTERMINAL;
+    current_ctx->free_symbols = NULL;
+    current_ctx->nfree = 0;
 }
 
 /**
@@ -48,10 +53,6 @@ void init_symbols(void) {
 SYMBOL *new_symbol(int value, SYMBOL *rule) {
     // TODO: Maybe also do something with next_nonterminal_value
 
-   if (__builtin_expect(num_symbols >= MAX_SYMBOLS, 0)) {
-        debug("Aborting because symbol storage is full\n");
-        abort();
-    }
     if (__builtin_expect(value < FIRST_NONTERMINAL && rule != NULL, 0)) {
         debug("Terminal symbol cannot have a rule\n");
         abort();
@@ -74,8 +75,20 @@ SYMBOL *new_symbol(int value, SYMBOL *rule) {
             return sym;
     }
 
-    // Get the space from symbol_storage
-    sym = &symbol_storage[num_symbols];
+    // Get the space from the slabs, adding one if they are all in use
+    if (__builtin_expect(num_symbols >= MAX_SYMBOLS, 0)) {
+        debug("Aborting because symbol storage is full\n");
+        abort();
+    }
+    SEQ_CTX *ctx = current_ctx;
+    if(__builtin_expect(num_symbols < ctx->nslabs << SYMBOL_SLAB_SHIFT, 1)) {
+        sym = *(ctx->slabs + (num_symbols >> SYMBOL_SLAB_SHIFT)) +
+              (num_symbols & (SYMBOL_SLAB_SIZE - 1));
+    }
+    else if((sym = grow_symbol_slabs()) == NULL) {
+        debug("Aborting because symbol storage could not be allocated\n");
+        abort();
+    }
     set_new_symbol_values(sym, rule, value);
     if(rule != NULL) {
         ref_rule(rule);
@@ -92,8 +105,62 @@ SYMBOL *new_symbol(int value, SYMBOL *rule) {
  * @return A recycled symbol
  */
 static inline SYMBOL *get_recycled_symbol() {
-    return recycled_stack_top >= 0 ? recycled_stack[recycled_stack_top--] : NULL;
+    SEQ_CTX *ctx = current_ctx;
+    SYMBOL *sym = ctx->free_symbols;
+    if(sym != NULL) {
+        ctx->free_symbols = sym->next;
+        ctx->nfree--;
+#ifdef DEBUG
+        if(sym->value != SYMBOL_POISON || sym->refcnt != SYMBOL_POISON ||
+           sym->rule != SYMBOL_POISON_PTR || sym->prev != SYMBOL_POISON_PTR) {
+            fprintf(stderr, "Recycled symbol <%lu> was modified!\n", SYMBOL_INDEX(sym));
+            abort();
+        }
+#endif
+    }
+    return sym;
+}
 
+/**
+ * @brief Add a slab to the pool of the current context.
+ *
+ * @return The first symbol of the new slab, or NULL if it could not be allocated.
+ */
+static SYMBOL *grow_symbol_slabs(void) {
+    SEQ_CTX *ctx = current_ctx;
+    if(ctx->nslabs == ctx->slabs_cap) {
+        int cap = ctx->slabs_cap ? 2 * ctx->slabs_cap : 16;
+        SYMBOL **slabs = realloc(ctx->slabs, cap * sizeof(SYMBOL *));
+        if(slabs == NULL) {
+            return NULL;
+        }
+        ctx->slabs = slabs;
+        ctx->slabs_cap = cap;
+    }
+    // Aligned so that no symbol straddles two cache lines.
+    SYMBOL *slab = aligned_alloc(64, SYMBOL_SLAB_SIZE * sizeof(SYMBOL));
+    if(slab == NULL) {
+        return NULL;
+    }
+    *(ctx->slabs + ctx->nslabs++) = slab;
+    return slab;
+}
+
+/**
+ * Find the index of a symbol in the pool of the current context.
+ * Intended for debugging output only, as every slab may have to be searched.
+ *
+ * @return  The index, or (unsigned long)-1 if the symbol is not in the pool.
+ */
+unsigned long symbol_index(SYMBOL *s) {
+    SEQ_CTX *ctx = current_ctx;
+    for(int i = 0; i < ctx->nslabs; i++) {
+        SYMBOL *slab = *(ctx->slabs + i);
+        if(s >= slab && s < slab + SYMBOL_SLAB_SIZE) {
+            return ((unsigned long)i << SYMBOL_SLAB_SHIFT) + (s - slab);
+        }
+    }
+    return (unsigned long)-1;
 }
 
 /**
@@ -107,15 +174,30 @@ static inline void set_new_symbol_values(SYMBOL *sym, SYMBOL *rule, int value) {
 
     // Zero other fields.
     (*sym).refcnt = 0;
-    sym->next = sym->prev = sym->nextr = sym->prevr = NULL;
+    sym->next = sym->prev = NULL;
 }
 
 /**
- * Recycle a symbol that is no longer being used.
+ * Recycle a symbol that is no longer being used, by pushing it on the free list,
+ * from which new_symbol() will hand it out again.
  *
  * @param s  The symbol to be recycled.  The caller must not use this symbol any more
- * once it has been recycled.
+ * once it has been recycled, and must already have deleted any digram it heads.
  */
 void recycle_symbol(SYMBOL *s) {
-    (*s).refcnt = -1;
+    SEQ_CTX *ctx = current_ctx;
+#ifdef DEBUG
+    if(s->value == SYMBOL_POISON) {
+        fprintf(stderr, "Symbol <%lu> recycled twice!\n", SYMBOL_INDEX(s));
+        abort();
+    }
+#endif
+    digram_forget(s);
+#ifdef DEBUG
+    s->value = s->refcnt = SYMBOL_POISON;
+    s->rule = s->prev = SYMBOL_POISON_PTR;
+#endif
+    s->next = ctx->free_symbols;
+    ctx->free_symbols = s;
+    ctx->nfree++;
 }
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "const.h"
+#include "utf8.h"
+#include "debug.h"
+
+/*
+ * Batch UTF-8 encoding and decoding of symbol values.
+ * See utf8.h for an overview.
+ */
+
+/* Largest symbol value that the encoder accepts. */
+#define UTF8_VALUE_MAX 0x10ffff
+
+/*
+ * Length of the sequence begun by a lead byte; 0 for continuation bytes (markers)
+ * and for bytes that cannot begin a sequence.
+ */
+static inline int utf8_length(unsigned char b) {
+    return b < 0x80 ? 1 :  // 0xxxxxxx
+           b < 0xc0 ? 0 :  // 10xxxxxx
+           b < 0xe0 ? 2 :  // 110xxxxx
+           b < 0xf0 ? 3 :  // 1110xxxx
+           b < 0xf8 ? 4 :  // 11110xxx
+           0;              // 11111xxx
+}
+
+/* Nonzero if a byte is a continuation byte (10xxxxxx). */
+static inline int utf8_cont(unsigned char b) {
+    return (b & 0xc0) == 0x80;
+}
+
+/**
+ * Write the UTF-8 sequences of the values of a rule's head and body symbols to a
+ * writer, reserving space for many of them at a time.
+ *
+ * @param rule  The head of the rule.
+ * @param out  The writer to which the rule is to be written.
+ * @return 0 on success, EOF on a write error or if a value is too large to encode.
+ */
+int utf8_encode_rule(SYMBOL *rule, SEQ_WRITER *out) {
+    // seq_writer_reserve() can only provide as much as the writer's capacity.
+    size_t chunk = out->cap < UTF8_ENCODE_CHUNK ? out->cap : UTF8_ENCODE_CHUNK;
+    SYMBOL *s = rule;
+    do {
+        unsigned char *p = seq_writer_reserve(out, chunk);
+        if(p == NULL)
+            return EOF;
+        unsigned char *start = p;
+        unsigned char *last = p + chunk - 4;  // Room is left for one more 4-byte sequence.
+        do {
+            unsigned int v = s->value;
+            if(v < 0x80) {
+                *p++ = v;
+            }
+            else if(v < 0x800) {
+                *p++ = 0xc0 | v >> 6;
+                *p++ = 0x80 | (v & 0x3f);
+            }
+            else if(v < 0x10000) {
+                *p++ = 0xe0 | v >> 12;
+                *p++ = 0x80 | ((v >> 6) & 0x3f);
+                *p++ = 0x80 | (v & 0x3f);
+            }
+            else if(v <= UTF8_VALUE_MAX) {
+                *p++ = 0xf0 | v >> 18;
+                *p++ = 0x80 | ((v >> 12) & 0x3f);
+                *p++ = 0x80 | ((v >> 6) & 0x3f);
+                *p++ = 0x80 | (v & 0x3f);
+            }
+            else {
+                debug("Symbol value %u is too large to encode", v);
+                return EOF;
+            }
+            s = s->next;
+        } while(s != rule && p <= last);
+        seq_writer_commit(out, p - start);
+    } while(s != rule);
+    return 0;
+}
+
+/**
+ * Find the number of single-byte sequences at the start of a run of bytes,
+ * examining several bytes at a time.  At most "len" bytes are examined, and a
+ * multiple of the width of the classification is returned unless a byte of
+ * another kind is found.
+ */
+static inline size_t utf8_ascii_prefix(const unsigned char *p, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= len; i += 16) {
+        // The top bit of each byte is set for every byte but a single-byte sequence.
+        int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+        if(high)
+            return i + __builtin_ctz(high);
+    }
+#else
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        w &= 0x8080808080808080ULL;
+        if(w) {
+            size_t k = 0;
+            while(!(*(p + i + k) & 0x80))
+                k++;
+            return i + k;
+        }
+    }
+#endif
+    return i;
+}
+
+/**
+ * Decode a run of UTF-8 sequences into symbol values.
+ *
+ * @param p  The bytes to be decoded.
+ * @param len  The number of bytes at p.
+ * @param values  The array in which the values are to be stored.
+ * @param max  The largest number of values to be decoded.
+ * @param used  Set to the number of bytes consumed.
+ * @return  The number of values stored.  Decoding stops after "max" values, or
+ * before the first byte that does not begin a complete, well-formed sequence.
+ */
+size_t utf8_decode_run(const unsigned char *p, size_t len, int *values, size_t max,
+                       size_t *used) {
+    size_t i = 0, n = 0;
+    while(n < max && i < len) {
+        size_t room = max - n < len - i ? max - n : len - i;
+        size_t k = utf8_ascii_prefix(p + i, room);
+        for(size_t j = 0; j < k; j++)
+            *(values + n + j) = *(p + i + j);
+        i += k;
+        n += k;
+        if(n == max || i == len)
+            break;
+
+        unsigned char b = *(p + i);
+        int seqlen = utf8_length(b);
+        int v;
+        switch(seqlen) {
+        case 1:
+            *(values + n++) = b;
+            i++;
+            continue;
+        case 2:
+            if(i + 2 > len || !utf8_cont(*(p + i + 1)))
+                goto stop;
+            v = (b & 0x1f) << 6 | (*(p + i + 1) & 0x3f);
+            i += 2;
+            break;
+        case 3:
+            if(i + 3 > len || !utf8_cont(*(p + i + 1)) || !utf8_cont(*(p + i + 2)))
+                goto stop;
+            v = (b & 0x0f) << 12 | (*(p + i + 1) & 0x3f) << 6 | (*(p + i + 2) & 0x3f);
+            i += 3;
+            break;
+        case 4:
+            if(i + 4 > len || !utf8_cont(*(p + i + 1)) || !utf8_cont(*(p + i + 2)) ||
+               !utf8_cont(*(p + i + 3)))
+                goto stop;
+            v = (b & 0x07) << 18 | (*(p + i + 1) & 0x3f) << 12 |
+                (*(p + i + 2) & 0x3f) << 6 | (*(p + i + 3) & 0x3f);
+            i += 4;
+            break;
+        default:
+            goto stop;
+        }
+        if(v == 0) {
+            // Zero is only ever written as a single byte.
+            i -= seqlen;
+            goto stop;
+        }
+        *(values + n++) = v;
+    }
+stop:
+    *used = i;
+    return n;
+}
@@ -3,6 +3,9 @@
 #include "const.h"
 #include "sequitur.h"
 #include "debug.h"
+#include "codec.h"
+#include "entropy.h"
+#include <pthread.h>
 
 #define TEST_TIMEOUT 15
 
@@ -209,6 +212,142 @@ Test(compress_suite, compress_emoji_1024, .init=init_output, .timeout=TEST_TIMEO
          ret, exp_ret);
 }
 
+/**
+ * compress_parallel_txt_large
+ * @brief test compress_parallel on a large text file with blocksize=64 and 4 jobs;
+ * the output must be the same as that of compress
+ * in: TEST_INPUT/gettysburg.txt
+ * out: STUDENT_OUTPUT/gettysburg_parallel.txt.seq
+ */
+Test(compress_suite, compress_parallel_txt_large, .init=init_output, .timeout=TEST_TIMEOUT) {
+    int ret;
+    int exp_ret;
+    FILE *in = fopen(TEST_INPUT"/gettysburg.txt","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/gettysburg_parallel.txt.seq","w");
+    FILE *ref = fopen(STUDENT_OUTPUT"/gettysburg_serial.txt.seq","w");
+
+    exp_ret = compress(in, ref, 64);
+    rewind(in);
+    ret = compress_parallel(in, out, 64, 4, 0);
+    fclose(in);
+    fclose(out);
+    fclose(ref);
+    cr_assert_eq(ret, exp_ret, "Invalid return.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    run_with_system("cmp "STUDENT_OUTPUT"/gettysburg_parallel.txt.seq "
+                    STUDENT_OUTPUT"/gettysburg_serial.txt.seq", 0);
+}
+
+/**
+ * compress_streaming_txt_large
+ * @brief test compress_streaming on a large text file with blocksize=64; as the
+ * whole file is at hand, every block is full and the output must be the same as
+ * that of compress
+ * in: TEST_INPUT/gettysburg.txt
+ * out: STUDENT_OUTPUT/gettysburg_streaming.txt.seq
+ */
+Test(compress_suite, compress_streaming_txt_large, .init=init_output, .timeout=TEST_TIMEOUT) {
+    int ret;
+    int exp_ret;
+    FILE *in = fopen(TEST_INPUT"/gettysburg.txt","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/gettysburg_streaming.txt.seq","w");
+    FILE *ref = fopen(STUDENT_OUTPUT"/gettysburg_serial2.txt.seq","w");
+
+    exp_ret = compress(in, ref, 64);
+    fclose(in);
+    in = fopen(TEST_INPUT"/gettysburg.txt","r");
+    ret = compress_streaming(in, out, 64, 1000);
+    fclose(in);
+    fclose(out);
+    fclose(ref);
+    cr_assert_eq(ret, exp_ret, "Invalid return.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    run_with_system("cmp "STUDENT_OUTPUT"/gettysburg_streaming.txt.seq "
+                    STUDENT_OUTPUT"/gettysburg_serial2.txt.seq", 0);
+}
+
+/**
+ * decompress_parallel_indexed
+ * @brief compress a large text file with blocksize=64 and a block index, then
+ * decompress it with 4 jobs; the result must be the original file
+ * in: TEST_INPUT/gettysburg.txt
+ * out: STUDENT_OUTPUT/gettysburg_indexed.txt.seq, STUDENT_OUTPUT/gettysburg_indexed.txt
+ */
+Test(compress_suite, decompress_parallel_indexed, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/gettysburg.txt","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/gettysburg_indexed.txt.seq","w");
+
+    int cret = compress_parallel(in, out, 64, 1, 1);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(cret, EOF, "compress_parallel failed");
+
+    in = fopen(STUDENT_OUTPUT"/gettysburg_indexed.txt.seq","r");
+    out = fopen(STUDENT_OUTPUT"/gettysburg_indexed.txt","w");
+    int dret = decompress_parallel(in, out, 4);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(dret, EOF, "decompress_parallel failed");
+    run_with_system("cmp "STUDENT_OUTPUT"/gettysburg_indexed.txt "
+                    TEST_INPUT"/gettysburg.txt", 0);
+}
+
+/**
+ * decompress_parallel_append
+ * @brief compress a large text file with blocksize=1024 and a block index, then
+ * decompress it with 4 jobs onto the end of a file opened for appending; the
+ * blocks cannot be written into place there, so the data must come out in order
+ * after what the file already held
+ * in: TEST_INPUT/wiki_2mb.txt
+ * out: STUDENT_OUTPUT/wiki_append.txt.seq, STUDENT_OUTPUT/wiki_append.txt
+ */
+Test(compress_suite, decompress_parallel_append, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/wiki_2mb.txt","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/wiki_append.txt.seq","w");
+
+    int cret = compress_parallel(in, out, 1024, 4, 1);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(cret, EOF, "compress_parallel failed");
+
+    run_with_system("cp "TEST_INPUT"/gettysburg.txt "STUDENT_OUTPUT"/wiki_append.txt", 0);
+    in = fopen(STUDENT_OUTPUT"/wiki_append.txt.seq","r");
+    out = fopen(STUDENT_OUTPUT"/wiki_append.txt","a");
+    int dret = decompress_parallel(in, out, 4);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(dret, EOF, "decompress_parallel failed");
+    run_with_system("cat "TEST_INPUT"/gettysburg.txt "TEST_INPUT"/wiki_2mb.txt | "
+                    "cmp - "STUDENT_OUTPUT"/wiki_append.txt", 0);
+}
+
+/**
+ * compress_stale_digram
+ * @brief test compress on a block in which a triple loses a symbol, leaving a
+ * stale entry in the digram table; the grammar depends on how lookups treat that
+ * entry, so the output must be exactly the reference
+ * in: TEST_INPUT/stale_digram
+ * out: STUDENT_OUTPUT/stale_digram.seq, STUDENT_OUTPUT/stale_digram
+ */
+Test(compress_suite, compress_stale_digram, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/stale_digram","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/stale_digram.seq","w");
+
+    int ret = compress(in, out, 1024);
+    fclose(in);
+    fclose(out);
+    cr_assert_eq(ret, 85, "Invalid return.  Got: %d | Expected: %d", ret, 85);
+    COMPARE_OUTPUT("stale_digram.seq", "stale_digram.seq", 0);
+
+    in = fopen(STUDENT_OUTPUT"/stale_digram.seq","r");
+    out = fopen(STUDENT_OUTPUT"/stale_digram","w");
+    ret = decompress(in, out);
+    fclose(in);
+    fclose(out);
+    cr_assert_eq(ret, 64, "Invalid return.  Got: %d | Expected: %d", ret, 64);
+    COMPARE_OUTPUT("stale_digram", "stale_digram", 0);
+}
+
 /**
  * compress_txt_small_inverse
  * @brief Checks if student compress/decompress are inverses of each other
@@ -309,4 +448,442 @@ Test(compress_suite, compress_emoji_inverse, .init=init_output, .timeout=TEST_TI
     if (fclose(in) == EOF || fclose(out) == EOF || fclose(reversed) == EOF)
         cr_log_warn("%s: FAILED TO CLOSE FD", __func__);
     COMPARE_OUTPUT("emoji_inverse.in", "emoji.in", 0);
-}
\ No newline at end of file
+}
+
+/**
+ * compress_large_blocks_inverse
+ * @brief Checks compress/decompress inverses with blocks large enough for
+ * nonterminals written as 3-byte sequences
+ * in: TEST_INPUT/wiki_2mb.txt
+ * out: STUDENT_OUTPUT/wiki_large_blocks.txt.seq
+ */
+Test(compress_suite, compress_large_blocks_inverse, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/wiki_2mb.txt", "r");
+    FILE *reversed = fopen(STUDENT_OUTPUT"/wiki_large_blocks.txt", "w");
+    FILE *out = fopen(STUDENT_OUTPUT"/wiki_large_blocks.txt.seq", "w");
+
+    if (in == NULL || out == NULL || reversed == NULL) {
+        cr_log_error("%s: FAILED TO OPEN FILE", __func__);
+    }
+
+    int cret = compress(in, out, 1024 * 1024);
+
+    if (fclose(out) == EOF){
+      cr_log_warn("%s: FAILED TO CLOSE FD", __func__);
+    }
+
+    out = fopen(STUDENT_OUTPUT"/wiki_large_blocks.txt.seq", "r");
+
+    if (out == NULL) {
+        cr_log_error("%s: FAILED TO OPEN FILE", __func__);
+    }
+
+    int dret = decompress(out, reversed);
+
+    if (fclose(in) == EOF || fclose(out) == EOF || fclose(reversed) == EOF)
+        cr_log_warn("%s: FAILED TO CLOSE FD", __func__);
+    cr_assert_neq(cret, EOF, "compress failed");
+    cr_assert_neq(dret, EOF, "decompress failed");
+    COMPARE_OUTPUT("wiki_large_blocks.txt", "wiki_2mb.txt", 0);
+}
+
+/**
+ * compress_binary_tiny_blocks_inverse
+ * @brief Checks compress/decompress inverses with one byte per block, so that
+ * some main rules consist of a single 2-byte terminal
+ * in: TEST_INPUT/binary_input
+ * out: STUDENT_OUTPUT/binary_tiny_blocks.seq
+ */
+Test(compress_suite, compress_binary_tiny_blocks_inverse, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/binary_input", "r");
+    FILE *reversed = fopen(STUDENT_OUTPUT"/binary_tiny_blocks", "w");
+    FILE *out = fopen(STUDENT_OUTPUT"/binary_tiny_blocks.seq", "w");
+
+    if (in == NULL || out == NULL || reversed == NULL) {
+        cr_log_error("%s: FAILED TO OPEN FILE", __func__);
+    }
+
+    int cret = compress(in, out, 1);
+
+    if (fclose(out) == EOF){
+      cr_log_warn("%s: FAILED TO CLOSE FD", __func__);
+    }
+
+    out = fopen(STUDENT_OUTPUT"/binary_tiny_blocks.seq", "r");
+
+    if (out == NULL) {
+        cr_log_error("%s: FAILED TO OPEN FILE", __func__);
+    }
+
+    int dret = decompress(out, reversed);
+
+    if (fclose(in) == EOF || fclose(out) == EOF || fclose(reversed) == EOF)
+        cr_log_warn("%s: FAILED TO CLOSE FD", __func__);
+    cr_assert_neq(cret, EOF, "compress failed");
+    cr_assert_neq(dret, EOF, "decompress failed");
+    COMPARE_OUTPUT("binary_tiny_blocks", "binary_input", 0);
+}
+
+/**
+ * decompress_range_indexed
+ * @brief compress a text file with blocksize=64 and a block index, then extract a
+ * range spanning several blocks, which must match the same bytes of the original
+ * in: TEST_INPUT/gettysburg.txt
+ * out: STUDENT_OUTPUT/gettysburg_range.txt.seq, STUDENT_OUTPUT/gettysburg_range.txt
+ */
+Test(compress_suite, decompress_range_indexed, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/gettysburg.txt","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/gettysburg_range.txt.seq","w");
+
+    int cret = compress_parallel(in, out, 64, 1, 1);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(cret, EOF, "compress_parallel failed");
+
+    in = fopen(STUDENT_OUTPUT"/gettysburg_range.txt.seq","r");
+    out = fopen(STUDENT_OUTPUT"/gettysburg_range.txt","w");
+    int dret = decompress_range(in, out, 1000, 300);
+    fclose(in);
+    fclose(out);
+    cr_assert_eq(dret, 300, "decompress_range returned %d instead of 300", dret);
+    run_with_system("tail -c +1001 "TEST_INPUT"/gettysburg.txt | head -c 300 | "
+                    "cmp - "STUDENT_OUTPUT"/gettysburg_range.txt", 0);
+}
+
+/**
+ * decompress_range_sequential
+ * @brief compress a text file without a block index, then extract a range that
+ * runs past the end of the data, which must match the rest of the original
+ * in: TEST_INPUT/gettysburg.txt
+ * out: STUDENT_OUTPUT/gettysburg_tail.txt.seq, STUDENT_OUTPUT/gettysburg_tail.txt
+ */
+Test(compress_suite, decompress_range_sequential, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/gettysburg.txt","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/gettysburg_tail.txt.seq","w");
+
+    int cret = compress(in, out, 100);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(cret, EOF, "compress failed");
+
+    in = fopen(STUDENT_OUTPUT"/gettysburg_tail.txt.seq","r");
+    out = fopen(STUDENT_OUTPUT"/gettysburg_tail.txt","w");
+    int dret = decompress_range(in, out, 1234, 100000);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(dret, EOF, "decompress_range failed");
+    run_with_system("tail -c +1235 "TEST_INPUT"/gettysburg.txt | "
+                    "cmp - "STUDENT_OUTPUT"/gettysburg_tail.txt", 0);
+}
+
+/**
+ * compress_entropy_inverse
+ * @brief with -e, compress a text file with a block index into a transmission smaller
+ * than the plain one, which must decompress to the original, both in whole and by range
+ * in: TEST_INPUT/wiki_2mb.txt
+ * out: STUDENT_OUTPUT/wiki_entropy.txt.seq, STUDENT_OUTPUT/wiki_entropy.txt,
+ * STUDENT_OUTPUT/wiki_entropy_range.txt
+ */
+Test(compress_suite, compress_entropy_inverse, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/wiki_2mb.txt", "r");
+    FILE *plain = fopen("/dev/null", "w");
+    int pret = compress(in, plain, 1024);
+    fclose(plain);
+    rewind(in);
+    FILE *out = fopen(STUDENT_OUTPUT"/wiki_entropy.txt.seq", "w");
+    current_ctx->options |= ENTROPY_OPTION; // -e
+    int eret = compress_parallel(in, out, 1024, 2, 1);
+    current_ctx->options &= ~ENTROPY_OPTION;
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(eret, EOF, "compress_parallel failed");
+    cr_assert_lt(eret, pret, "-e took %d bytes, without it %d", eret, pret);
+
+    in = fopen(STUDENT_OUTPUT"/wiki_entropy.txt.seq", "r");
+    out = fopen(STUDENT_OUTPUT"/wiki_entropy.txt", "w");
+    int dret = decompress(in, out);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(dret, EOF, "decompress failed");
+    COMPARE_OUTPUT("wiki_entropy.txt", "wiki_2mb.txt", 0);
+
+    in = fopen(STUDENT_OUTPUT"/wiki_entropy.txt.seq", "r");
+    out = fopen(STUDENT_OUTPUT"/wiki_entropy_range.txt", "w");
+    int rret = decompress_range(in, out, 100000, 5000);
+    fclose(in);
+    fclose(out);
+    cr_assert_eq(rret, 5000, "decompress_range returned %d instead of 5000", rret);
+    run_with_system("tail -c +100001 "TEST_INPUT"/wiki_2mb.txt | head -c 5000 | "
+                    "cmp - "STUDENT_OUTPUT"/wiki_entropy_range.txt", 0);
+}
+
+/**
+ * decompress_entropy_truncated
+ * @brief a coded block that has lost its last byte must be rejected
+ * in: TEST_INPUT/gettysburg.txt
+ */
+Test(compress_suite, decompress_entropy_truncated, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/gettysburg.txt", "r");
+    char *buf;
+    size_t len;
+    FILE *out = open_memstream(&buf, &len);
+    current_ctx->options |= ENTROPY_OPTION; // -e
+    int cret = compress(in, out, 1024);
+    current_ctx->options &= ~ENTROPY_OPTION;
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(cret, EOF, "compress failed");
+    // Drop the byte before the final EOB and EOT.
+    memmove(buf + len - 3, buf + len - 2, 2);
+    in = fmemopen(buf, len - 1, "r");
+    out = fopen("/dev/null", "w");
+    int dret = decompress(in, out);
+    fclose(in);
+    fclose(out);
+    free(buf);
+    cr_assert_eq(dret, EOF, "decompress accepted a truncated coded block");
+}
+
+/* Read a whole file into a newly allocated buffer. */
+static unsigned char *read_input(char *path, size_t *len) {
+    FILE *f = fopen(path, "r");
+    cr_assert_not_null(f, "could not open %s", path);
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    rewind(f);
+    unsigned char *buf = malloc(*len + 1);
+    cr_assert_eq(fread(buf, 1, *len, f), *len, "could not read %s", path);
+    fclose(f);
+    return buf;
+}
+
+/**
+ * codec_buf_matches_stream
+ * @brief seq_compress_buf() must produce the same transmission as compress(), and
+ * seq_decompress_buf() must give back the original data
+ * in: TEST_INPUT/emoji.in
+ * out: STUDENT_OUTPUT/emoji_codec.in.seq
+ */
+Test(compress_suite, codec_buf_matches_stream, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/emoji.in", "r");
+    FILE *out = fopen(STUDENT_OUTPUT"/emoji_codec.in.seq", "w");
+    int cret = compress(in, out, 100);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(cret, EOF, "compress failed");
+
+    size_t n, seqlen, clen, dlen;
+    unsigned char *data = read_input(TEST_INPUT"/emoji.in", &n);
+    unsigned char *seq = read_input(STUDENT_OUTPUT"/emoji_codec.in.seq", &seqlen);
+    unsigned char *comp, *decomp;
+    SEQ_CTX *ctx = seq_ctx_new();
+    cr_assert_not_null(ctx, "seq_ctx_new failed");
+    cr_assert_eq(seq_compress_buf(ctx, data, n, 100, &comp, &clen), 0, "seq_compress_buf failed");
+    cr_assert_eq(clen, seqlen, "transmission has %lu bytes instead of %lu", clen, seqlen);
+    cr_assert_eq(memcmp(comp, seq, clen), 0, "transmission differs from that of compress()");
+    cr_assert_eq(seq_decompress_buf(ctx, comp, clen, &decomp, &dlen), 0, "seq_decompress_buf failed");
+    cr_assert_eq(dlen, n, "data has %lu bytes instead of %lu", dlen, n);
+    cr_assert_eq(memcmp(decomp, data, n), 0, "data differs from the original");
+    cr_assert_neq(seq_decompress_buf(ctx, comp, clen - 1, &decomp, &dlen), 0,
+                  "truncated transmission was accepted");
+    seq_ctx_free(ctx);
+    free(data);
+    free(seq);
+    free(comp);
+    free(decomp);
+}
+
+/**
+ * codec_buf_options
+ * @brief seq_compress_buf() takes its options from the context it is given, not
+ * from the calling thread's current context, and does not report with -v
+ * in: TEST_INPUT/gettysburg.txt
+ * out: STUDENT_OUTPUT/codec_options.err
+ */
+Test(compress_suite, codec_buf_options, .init=init_output, .timeout=TEST_TIMEOUT) {
+    size_t n, clen, dlen;
+    unsigned char *data = read_input(TEST_INPUT"/gettysburg.txt", &n);
+    unsigned char *comp, *decomp;
+    SEQ_CTX *ctx = seq_ctx_new();
+    cr_assert_not_null(ctx, "seq_ctx_new failed");
+    ctx->options = ENTROPY_OPTION | VERBOSE_OPTION;
+    cr_assert_not_null(freopen(STUDENT_OUTPUT"/codec_options.err", "w", stderr), "freopen failed");
+    cr_assert_eq(seq_compress_buf(ctx, data, n, 1024, &comp, &clen), 0, "seq_compress_buf failed");
+    cr_assert_eq(ftell(stderr), 0, "seq_compress_buf wrote to stderr");
+    cr_assert_eq(*comp, ENTROPY_SOT, "transmission starts with 0x%x", *comp);
+    cr_assert_eq(ctx->options, ENTROPY_OPTION | VERBOSE_OPTION, "options were not restored");
+    cr_assert_eq(seq_decompress_buf(ctx, comp, clen, &decomp, &dlen), 0, "seq_decompress_buf failed");
+    cr_assert_eq(dlen, n, "data has %lu bytes instead of %lu", dlen, n);
+    cr_assert_eq(memcmp(decomp, data, n), 0, "data differs from the original");
+    seq_ctx_free(ctx);
+    free(data);
+    free(comp);
+    free(decomp);
+}
+
+typedef struct codec_job {
+    unsigned char *data;
+    size_t len;
+    int ok;
+} CODEC_JOB;
+
+static void *codec_thread(void *arg) {
+    CODEC_JOB *job = arg;
+    SEQ_CTX *ctx = seq_ctx_new();
+    unsigned char *comp = NULL, *decomp = NULL;
+    size_t clen, dlen;
+    job->ok = ctx != NULL;
+    for(int i = 0; i < 3 && job->ok; i++) {
+        job->ok = seq_compress_buf(ctx, job->data, job->len, 256, &comp, &clen) == 0 &&
+                  seq_decompress_buf(ctx, comp, clen, &decomp, &dlen) == 0 &&
+                  dlen == job->len && memcmp(decomp, job->data, dlen) == 0;
+        free(comp);
+        free(decomp);
+        comp = decomp = NULL;
+    }
+    seq_ctx_free(ctx);
+    return NULL;
+}
+
+/**
+ * codec_buf_threads
+ * @brief several threads, each with its own context, compress and decompress
+ * different data at the same time
+ */
+Test(compress_suite, codec_buf_threads, .timeout=TEST_TIMEOUT) {
+    char *inputs[] = { TEST_INPUT"/gettysburg.txt", TEST_INPUT"/emoji.in",
+                       TEST_INPUT"/binary_input", TEST_INPUT"/sheet.txt" };
+    CODEC_JOB jobs[4];
+    pthread_t threads[4];
+    for(int i = 0; i < 4; i++) {
+        jobs[i].data = read_input(inputs[i], &jobs[i].len);
+        cr_assert_eq(pthread_create(&threads[i], NULL, codec_thread, &jobs[i]), 0,
+                     "could not create thread");
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        cr_assert(jobs[i].ok, "round trip of %s failed", inputs[i]);
+        free(jobs[i].data);
+    }
+}
+
+/**
+ * codec_recycled_symbols
+ * @brief compressing a single 2MB block reuses the symbols that the algorithm frees,
+ * so the pool never needs as many symbols as there are bytes of data
+ * in: TEST_INPUT/wiki_2mb.txt
+ */
+Test(compress_suite, codec_recycled_symbols, .timeout=TEST_TIMEOUT) {
+    size_t n, clen, dlen;
+    unsigned char *data = read_input(TEST_INPUT"/wiki_2mb.txt", &n);
+    unsigned char *comp, *decomp;
+    SEQ_CTX *ctx = seq_ctx_new();
+    cr_assert_not_null(ctx, "seq_ctx_new failed");
+    cr_assert_eq(seq_compress_buf(ctx, data, n, n, &comp, &clen), 0, "seq_compress_buf failed");
+    cr_assert_lt((size_t)ctx->nsymbols, n, "%d symbols were taken from the slabs for %lu bytes",
+                 ctx->nsymbols, n);
+    cr_assert_eq(seq_decompress_buf(ctx, comp, clen, &decomp, &dlen), 0, "seq_decompress_buf failed");
+    cr_assert_eq(dlen, n, "data has %lu bytes instead of %lu", dlen, n);
+    cr_assert_eq(memcmp(decomp, data, n), 0, "data differs from the original");
+    seq_ctx_free(ctx);
+    free(data);
+    free(comp);
+    free(decomp);
+}
+
+/**
+ * codec_nested_repeats
+ * @brief round trip of a 1MB block of a Fibonacci word, whose grammar nests rules
+ * many levels deep, so that digram checks set off long cascades of replacements
+ */
+Test(compress_suite, codec_nested_repeats, .timeout=TEST_TIMEOUT) {
+    size_t n = 1 << 20, clen, dlen;
+    unsigned char *data = malloc(n);
+    unsigned char *comp, *decomp;
+    cr_assert_not_null(data, "malloc failed");
+    // The Fibonacci word: f(k) = f(k-1) f(k-2), so f(k-1) is a prefix of f(k)
+    // and the word can be extended in place.
+    size_t len = 2, prev = 1;
+    *data = 'a';
+    *(data + 1) = 'b';
+    while(len < n) {
+        size_t add = prev < n - len ? prev : n - len;
+        memcpy(data + len, data, add);
+        prev = len;
+        len += add;
+    }
+    SEQ_CTX *ctx = seq_ctx_new();
+    cr_assert_not_null(ctx, "seq_ctx_new failed");
+    cr_assert_eq(seq_compress_buf(ctx, data, n, n, &comp, &clen), 0, "seq_compress_buf failed");
+    cr_assert_eq(seq_decompress_buf(ctx, comp, clen, &decomp, &dlen), 0, "seq_decompress_buf failed");
+    cr_assert_eq(dlen, n, "data has %lu bytes instead of %lu", dlen, n);
+    cr_assert_eq(memcmp(decomp, data, n), 0, "data differs from the original");
+    seq_ctx_free(ctx);
+    free(data);
+    free(comp);
+    free(decomp);
+}
+
+/**
+ * compress_adaptive_inverse
+ * @brief "-b auto" must give a transmission that decompresses to the original, and
+ * that is smaller than the one with the default blocksize
+ * in: TEST_INPUT/wiki_2mb.txt
+ * out: STUDENT_OUTPUT/wiki_auto.txt.seq, STUDENT_OUTPUT/wiki_auto.txt
+ */
+Test(compress_suite, compress_adaptive_inverse, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(TEST_INPUT"/wiki_2mb.txt", "r");
+    FILE *out = fopen(STUDENT_OUTPUT"/wiki_auto.txt.seq", "w");
+    int aret = compress_adaptive(in, out, 1);
+    rewind(in);
+    FILE *fixed = fopen("/dev/null", "w");
+    int fret = compress(in, fixed, 1024);
+    fclose(in);
+    fclose(out);
+    fclose(fixed);
+    cr_assert_neq(aret, EOF, "compress_adaptive failed");
+    cr_assert_lt(aret, fret, "-b auto took %d bytes, the default blocksize %d", aret, fret);
+
+    in = fopen(STUDENT_OUTPUT"/wiki_auto.txt.seq", "r");
+    out = fopen(STUDENT_OUTPUT"/wiki_auto.txt", "w");
+    int dret = decompress(in, out);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(dret, EOF, "decompress failed");
+    COMPARE_OUTPUT("wiki_auto.txt", "wiki_2mb.txt", 0);
+}
+
+/**
+ * compress_adaptive_random
+ * @brief on data that does not compress, "-b auto" must be no worse than the
+ * default blocksize, and must still give back the original
+ * out: STUDENT_OUTPUT/random.bin, STUDENT_OUTPUT/random_auto.bin.seq,
+ * STUDENT_OUTPUT/random_auto.bin
+ */
+Test(compress_suite, compress_adaptive_random, .init=init_output, .timeout=TEST_TIMEOUT) {
+    FILE *in = fopen(STUDENT_OUTPUT"/random.bin", "w+");
+    unsigned int seed = 1;
+    for(int i = 0; i < 300000; i++) {
+        seed = seed * 1103515245 + 12345;
+        fputc(seed >> 16, in);
+    }
+    rewind(in);
+    FILE *out = fopen(STUDENT_OUTPUT"/random_auto.bin.seq", "w");
+    int aret = compress_adaptive(in, out, 0);
+    rewind(in);
+    FILE *fixed = fopen("/dev/null", "w");
+    int fret = compress(in, fixed, 1024);
+    fclose(in);
+    fclose(out);
+    fclose(fixed);
+    cr_assert_neq(aret, EOF, "compress_adaptive failed");
+    cr_assert_leq(aret, fret, "-b auto took %d bytes, the default blocksize %d", aret, fret);
+
+    in = fopen(STUDENT_OUTPUT"/random_auto.bin.seq", "r");
+    out = fopen(STUDENT_OUTPUT"/random_auto.bin", "w");
+    int dret = decompress(in, out);
+    fclose(in);
+    fclose(out);
+    cr_assert_neq(dret, EOF, "decompress failed");
+    run_with_system("cmp "STUDENT_OUTPUT"/random.bin "STUDENT_OUTPUT"/random_auto.bin", 0);
+}
@@ -246,4 +246,88 @@ Test(decompress_suite, decompress_txt_emoji, .init=init_output, .timeout=TEST_TI
     exp_ret = 1745;
     cr_assert_eq(ret, exp_ret, "Invalid return.  Got: %x | Expected: %x",
          ret, exp_ret);
-}
\ No newline at end of file
+}
+/**
+ * decompress_cyclic_rules
+ * @brief test decompress on a block whose two rules refer to each other,
+ * which must be rejected rather than expanded forever
+ * in: TEST_INPUT/cyclic_rules.seq
+ * out: /dev/null
+ */
+Test(decompress_suite, decompress_cyclic_rules, .init=init_output, .timeout=TEST_TIMEOUT) {
+    int ret;
+    int exp_ret;
+    FILE *in = fopen(TEST_INPUT"/cyclic_rules.seq","r");
+    FILE *out = fopen("/dev/null","w");
+
+    ret = decompress(in, out);
+    exp_ret = EOF;
+    cr_assert_eq(ret, exp_ret, "Invalid return.  Got: %x | Expected: %x",
+         ret, exp_ret);
+}
+
+/**
+ * decompress_pushed_back
+ * @brief test decompress on a stream whose first byte has been read through stdio
+ * and pushed back, which must still be seen
+ * in: TEST_INPUT/gettysburg.txt.seq
+ * out: STUDENT_OUTPUT/gettysburg_pushed_back.txt
+ */
+Test(decompress_suite, decompress_pushed_back, .init=init_output, .timeout=TEST_TIMEOUT) {
+    int ret;
+    int exp_ret;
+    FILE *in = fopen(TEST_INPUT"/gettysburg.txt.seq","r");
+    FILE *out = fopen(STUDENT_OUTPUT"/gettysburg_pushed_back.txt","w");
+
+    ungetc(fgetc(in), in);
+    ret = decompress(in, out);
+    exp_ret = 1473;
+    cr_assert_eq(ret, exp_ret, "Invalid return.  Got: %x | Expected: %x",
+         ret, exp_ret);
+}
+
+/**
+ * decompress_pushed_back_pipe
+ * @brief test decompress on a pipe whose first byte has been read through stdio
+ * and pushed back; stdio has then buffered input from the pipe, which must be seen
+ * along with the pushed-back byte
+ * in: TEST_INPUT/gettysburg.txt.seq
+ * out: STUDENT_OUTPUT/gettysburg_pushed_back_pipe.txt
+ */
+Test(decompress_suite, decompress_pushed_back_pipe, .init=init_output, .timeout=TEST_TIMEOUT) {
+    int ret;
+    int exp_ret;
+    FILE *in = popen("cat "TEST_INPUT"/gettysburg.txt.seq", "r");
+    FILE *out = fopen(STUDENT_OUTPUT"/gettysburg_pushed_back_pipe.txt","w");
+
+    ungetc(fgetc(in), in);
+    ret = decompress(in, out);
+    pclose(in);
+    fclose(out);
+    exp_ret = 1473;
+    cr_assert_eq(ret, exp_ret, "Invalid return.  Got: %x | Expected: %x",
+         ret, exp_ret);
+    COMPARE_OUTPUT("gettysburg_pushed_back_pipe.txt", "gettysburg.txt", 0);
+}
+
+/**
+ * decompress_short_rules
+ * @brief the main rule of a block may have a single symbol in its body, as for a
+ * block of one byte, but no other rule may
+ */
+Test(decompress_suite, decompress_short_rules, .init=init_output, .timeout=TEST_TIMEOUT) {
+    char one_symbol[] = "\x81\x83\xc4\x80" "a\x84\x82";
+    char other_rule[] = "\x81\x83\xc4\x80" "ab\x85\xc4\x81" "c\x84\x82";
+    FILE *out = fopen("/dev/null", "w");
+
+    FILE *in = fmemopen(one_symbol, sizeof(one_symbol) - 1, "r");
+    int ret = decompress(in, out);
+    fclose(in);
+    cr_assert_eq(ret, 1, "Invalid return.  Got: %x | Expected: %x", ret, 1);
+
+    in = fmemopen(other_rule, sizeof(other_rule) - 1, "r");
+    ret = decompress(in, out);
+    fclose(in);
+    fclose(out);
+    cr_assert_eq(ret, EOF, "Invalid return.  Got: %x | Expected: %x", ret, EOF);
+}
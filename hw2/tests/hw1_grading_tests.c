@@ -26,8 +26,6 @@
     cr_assert_eq(ret_symbol->refcnt, exp_symbol.refcnt, "returned symbol has incorrect refcnt field! Got: %d | Exp: %d", ret_symbol->refcnt, exp_symbol.refcnt); \
     cr_assert_eq(ret_symbol->next, exp_symbol.next, "returned symbol has incorrect next field! Got: %p | Exp: %p", ret_symbol->next, exp_symbol.next); \
     cr_assert_eq(ret_symbol->prev, exp_symbol.prev, "returned symbol has incorrect prev field! Got: %p | Exp: %p", ret_symbol->prev, exp_symbol.prev); \
-    cr_assert_eq(ret_symbol->nextr, exp_symbol.nextr, "returned symbol has incorrect nextr field! Got: %p | Exp: %p", ret_symbol->nextr, exp_symbol.nextr); \
-    cr_assert_eq(ret_symbol->prevr, exp_symbol.prevr, "returned symbol has incorrect prevr field! Got: %p | Exp: %p", ret_symbol->prevr, exp_symbol.prev); \
 } while(0)
 
 
@@ -310,17 +308,24 @@ Test(symbols_suite, init_symbols, .timeout=TEST_TIMEOUT) {
 /**
  * init_rules
  * @brief checks if init_rules properly nulls out the main_rule and resets rule_map
+ * (the entries of rule_map are set with map_rule, which tracks them for init_rules)
  */
 Test(rules_suite, init_rules, .timeout=TEST_TIMEOUT) {
     SYMBOL temp = {0};
+    SYMBOL heads[64] = {{0}};
     main_rule = &temp;
-    memset(rule_map, 'A', MAX_SYMBOLS * sizeof(SYMBOL *));
+    int i;
+    for(i = 0; i < 64; i++) {
+        heads[i].value = FIRST_NONTERMINAL + 31 * i;
+        map_rule(&heads[i]);
+    }
+    heads[0].value = SYMBOL_VALUE_MAX - 1;
+    map_rule(&heads[0]);
 
     init_rules();
 
     cr_assert_null(main_rule, "main_rule was not set to NULL!");
-    int i;
-    for(i = 0; i < MAX_SYMBOLS; i++) {
+    for(i = 0; i < SYMBOL_VALUE_MAX; i++) {
         cr_assert_null(rule_map[i], "rule_map at index %d not NULL!", i);
     }
 }
@@ -332,13 +337,13 @@ Test(rules_suite, init_rules, .timeout=TEST_TIMEOUT) {
 Test(symbols_suite, new_symbol_1, .timeout=TEST_TIMEOUT) {
     int exp_val = 10;
     int exp_numsymb = num_symbols + 1;
-    SYMBOL *exp_addr = &symbol_storage[num_symbols];
+    unsigned long exp_index = num_symbols;
 
     SYMBOL *ret_symbol = new_symbol(exp_val, NULL);
     SYMBOL exp_symbol = {0};
     exp_symbol.value = exp_val;
 
-    cr_assert_eq(ret_symbol, exp_addr, "returned symbol was not properly assigned in symbol storage!");
+    cr_assert_eq(SYMBOL_INDEX(ret_symbol), exp_index, "returned symbol was not properly assigned in symbol storage!");
     cr_assert_eq(num_symbols, exp_numsymb, "num_symbols was not incremented!");
     ASSERT_SYMBOL_STRUCT;
 }
@@ -350,14 +355,14 @@ Test(symbols_suite, new_symbol_1, .timeout=TEST_TIMEOUT) {
 Test(symbols_suite, new_symbol_2, .timeout=TEST_TIMEOUT) {
     int exp_val = 320;
     int exp_numsymb = num_symbols + 1;
-    SYMBOL *exp_addr = &symbol_storage[num_symbols];
+    unsigned long exp_index = num_symbols;
 
     SYMBOL exp_symbol = {0};
     exp_symbol.value = exp_val;
     exp_symbol.rule = &exp_symbol;
     SYMBOL *ret_symbol = new_symbol(exp_val, &exp_symbol);
 
-    cr_assert_eq(ret_symbol, exp_addr, "returned symbol was not properly assigned in symbol storage!");
+    cr_assert_eq(SYMBOL_INDEX(ret_symbol), exp_index, "returned symbol was not properly assigned in symbol storage!");
     cr_assert_eq(num_symbols, exp_numsymb, "num_symbols was not incremented!");
     cr_assert_eq(exp_symbol.refcnt, 1, "rule passed did not have refcnt incremented!");
     exp_symbol.refcnt = 0;
@@ -411,8 +416,8 @@ Test(rules_suite, add_rule_1, .timeout=TEST_TIMEOUT) {
     add_rule(&temp_rule);
 
     cr_assert_eq(&temp_rule, main_rule, "originally NULL main_rule didn't change to added rule");
-    cr_assert_eq(&temp_rule, main_rule->prevr, "new main rule's 'prevr' field doesn't point back to itself!");
-    cr_assert_eq(&temp_rule, main_rule->nextr, "new main rule's 'nextr' field doesn't point back to itself!");
+    cr_assert_eq(&temp_rule, PREVR(main_rule), "new main rule's 'prevr' field doesn't point back to itself!");
+    cr_assert_eq(&temp_rule, NEXTR(main_rule), "new main rule's 'nextr' field doesn't point back to itself!");
 }
 
 /**
@@ -420,9 +425,19 @@ Test(rules_suite, add_rule_1, .timeout=TEST_TIMEOUT) {
  * @brief check to see if the digram_table was initialized to NULL
  */
 Test(digram_suite, init_digram_hash_1, .timeout=TEST_TIMEOUT) {
-    /* Fill the table with something that isn't NULL*/
-    for(int i = 0; i < MAX_DIGRAMS; i++){
-        digram_table[i] = TOMBSTONE;
+    /*
+     * Fill part of the table with something that isn't NULL.  The reset only clears
+     * slots filled through digram_put, so go through it; deleting every third digram
+     * leaves TOMBSTONEs behind as well.
+     */
+    static SYMBOL syms[2000];
+    for(int i = 0; i < 1000; i++){
+        syms[2*i].value = i;
+        syms[2*i+1].value = i + 1;
+        syms[2*i].next = &syms[2*i+1];
+        digram_put(&syms[2*i]);
+        if(i % 3 == 0)
+            digram_delete(&syms[2*i]);
     }
 
     /* The table should be initialized to NULL after running this */
@@ -430,7 +445,8 @@ Test(digram_suite, init_digram_hash_1, .timeout=TEST_TIMEOUT) {
 
     /* Verify that that's the case */
     for(int i = 0; i < MAX_DIGRAMS; i++){
-        cr_assert_null(digram_table[i], "the digram table wasn't successfully initialized to NULL!");
+        cr_assert_null(digram_table[i].digram, "the digram table wasn't successfully initialized to NULL!");
+        cr_assert_eq(digram_table[i].key, 0, "the digram table key wasn't cleared!");
     }
 }
 
@@ -448,7 +464,8 @@ Test(digram_suite, digram_get_1, .timeout=TEST_TIMEOUT) {
     s1.next = &s2;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = &s1;
+    digram_table[digram_table_index].key = DIGRAM_KEY(v1, v2);
+    digram_table[digram_table_index].digram = &s1;
 
     SYMBOL *ret_symbol = digram_get(v1, v2);
     cr_assert_eq(&s1, ret_symbol, "failed to return existing digram from digram_table (no collision)");
@@ -469,8 +486,11 @@ Test(digram_suite, digram_get_2, .timeout=TEST_TIMEOUT) {
     s2.next = NULL;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = &s2; // Make sure the space in between isn't NULL
-    digram_table[digram_table_index+1] = &s1;
+    int next_index = (digram_table_index + 1) % MAX_DIGRAMS;
+    digram_table[digram_table_index].key = DIGRAM_KEY(v2, v1); // Make sure the space in between isn't NULL
+    digram_table[digram_table_index].digram = &s2;
+    digram_table[next_index].key = DIGRAM_KEY(v1, v2);
+    digram_table[next_index].digram = &s1;
 
     SYMBOL *ret_symbol = digram_get(v1, v2);
     cr_assert_eq(&s1, ret_symbol, "failed to return existing digram from digram_table (with collision)");
@@ -483,7 +503,8 @@ Test(digram_suite, digram_get_2, .timeout=TEST_TIMEOUT) {
 Test(digram_suite, digram_get_3, .timeout=TEST_TIMEOUT) {
     int v1 = 5, v2 = 6; // Arbitrary
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = NULL;
+    digram_table[digram_table_index].key = 0;
+    digram_table[digram_table_index].digram = NULL;
 
     SYMBOL *ret_symbol = digram_get(v1, v2);
     cr_assert_null(ret_symbol, "failed to return NULL for a nonexistent digram");
@@ -504,9 +525,11 @@ Test(digram_suite, digram_get_4, .timeout=TEST_TIMEOUT) {
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
     for (int i=0; i<MAX_DIGRAMS; i++) {
-        digram_table[i] = TOMBSTONE;  // Leave a trail of TOMBSTONEs that wraps around the digram_table
+        digram_table[i].key = 0;
+        digram_table[i].digram = TOMBSTONE;  // Leave a trail of TOMBSTONEs that wraps around the digram_table
     }
-    digram_table[0] = &s1;  // The digram to be looked up resides immediately on the other side
+    digram_table[0].key = DIGRAM_KEY(v1, v2);
+    digram_table[0].digram = &s1;  // The digram to be looked up resides immediately on the other side
 
     SYMBOL *ret_symbol = digram_get(v1, v2);
     cr_assert_eq(&s1, ret_symbol, "failed lookup on an existing digram (wrapping around the table with TOMBSTONEs)");
@@ -526,13 +549,17 @@ Test(digram_suite, digram_delete_1, .timeout=TEST_TIMEOUT) {
     s1.next = &s2;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = &s1;
+    int next_index = (digram_table_index + 1) % MAX_DIGRAMS;
+    digram_table[digram_table_index].key = DIGRAM_KEY(v1, v2);
+    digram_table[digram_table_index].digram = &s1;
+    digram_table[next_index].key = 0;
+    digram_table[next_index].digram = TOMBSTONE;  // Something still probes past this slot
 
     int retval = digram_delete(&s1);  // Attempt to delete s1
     // Since s1 exists in digram_table, we expect return value 0
     cr_assert_eq(0, retval, "expected return value 0 when deleting an existing digram");
     // Check that s1 was replaced with a TOMBSTONE
-    cr_assert_eq(TOMBSTONE, digram_table[digram_table_index], "expected deleted digram to be replaced with TOMBSTONE");
+    cr_assert_eq(TOMBSTONE, digram_table[digram_table_index].digram, "expected deleted digram to be replaced with TOMBSTONE");
 }
 
 /**
@@ -549,7 +576,8 @@ Test(digram_suite, digram_delete_2, .timeout=TEST_TIMEOUT) {
     s1.next = &s2;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = NULL;
+    digram_table[digram_table_index].key = 0;
+    digram_table[digram_table_index].digram = NULL;
 
     int retval = digram_delete(&s1);  // Attempt to delete s1
     // Since s1 doesn't exist in digram_table, we expect return value 0
@@ -577,12 +605,16 @@ Test(digram_suite, digram_delete_3, .timeout=TEST_TIMEOUT) {
     s3.next = &s4;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = &s1;  // Insert Digram 1
-    digram_table[digram_table_index+1] = &s3; // Insert Digram 2
+    int next_index = (digram_table_index + 1) % MAX_DIGRAMS;
+    digram_table[digram_table_index].key = DIGRAM_KEY(v1, v2);
+    digram_table[digram_table_index].digram = &s1;  // Insert Digram 1
+    digram_table[next_index].key = DIGRAM_KEY(v1, v2);
+    digram_table[next_index].digram = &s3; // Insert Digram 2
 
     int retval = digram_delete(&s3);  // Attempt to delete Digram 2. Hopefully, Digram 1 isn't affected and Digram 2 is deleted
-    cr_assert_eq(&s1, digram_table[digram_table_index], "attempting to delete a digram shouldn't affect other digrams with the same value");
-    cr_assert_eq(TOMBSTONE, digram_table[digram_table_index+1], "expected digram to be deleted and replaced by a TOMBSTONE");
+    cr_assert_eq(&s1, digram_table[digram_table_index].digram, "attempting to delete a digram shouldn't affect other digrams with the same value");
+    // Nothing follows Digram 2, so its slot is returned to the unused state rather than left as a TOMBSTONE
+    cr_assert_null(digram_table[next_index].digram, "expected digram at the end of a probe run to be deleted without a TOMBSTONE");
     cr_assert_eq(0, retval, "expected return value of 0 when attempting to delete an existing digram");
 }
 
@@ -600,11 +632,13 @@ Test(digram_suite, digram_put_1, .timeout=TEST_TIMEOUT) {
     s1.next = &s2;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = NULL;
+    digram_table[digram_table_index].key = 0;
+    digram_table[digram_table_index].digram = NULL;
 
     int retval = digram_put(&s1);  // Attempt to insert s1
     cr_assert_eq(0, retval, "expected return value of 0 when attempting to insert a new, unique digram");
-    cr_assert_eq(&s1, digram_table[digram_table_index], "new, unique digram wasn't inserted correctly into digram_table");
+    cr_assert_eq(&s1, digram_table[digram_table_index].digram, "new, unique digram wasn't inserted correctly into digram_table");
+    cr_assert_eq(DIGRAM_KEY(v1, v2), digram_table[digram_table_index].key, "new digram was inserted with the wrong key");
 }
 
 /**
@@ -629,11 +663,12 @@ Test(digram_suite, digram_put_2, .timeout=TEST_TIMEOUT) {
     s3.next = &s4;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = &s1;
+    digram_table[digram_table_index].key = DIGRAM_KEY(v1, v2);
+    digram_table[digram_table_index].digram = &s1;
 
     int retval = digram_put(&s3);  // Attempt to insert s2
     cr_assert_eq(1, retval, "expected return value of 1 when attempting to insert a non-unique digram");
-    cr_assert_eq(&s1, digram_table[digram_table_index], "digram table changed despite returning 1 after digram_put");
+    cr_assert_eq(&s1, digram_table[digram_table_index].digram, "digram table changed despite returning 1 after digram_put");
 }
 
 /**
@@ -667,11 +702,83 @@ Test(digram_suite, digram_put_4, .timeout=TEST_TIMEOUT) {
     s1.next = &s2;
 
     int digram_table_index = DIGRAM_HASH(v1, v2);
-    digram_table[digram_table_index] = TOMBSTONE;  // digram_put should replace this with &s1
+    digram_table[digram_table_index].key = 0;
+    digram_table[digram_table_index].digram = TOMBSTONE;  // digram_put should replace this with &s1
 
     int retval = digram_put(&s1);  // Attempt to insert s1
     cr_assert_eq(0, retval, "expected return value of 0 when attempting to insert a new, unique digram");
-    cr_assert_eq(&s1, digram_table[digram_table_index], "inserted digram didn't replace TOMBSTONE");
+    cr_assert_eq(&s1, digram_table[digram_table_index].digram, "inserted digram didn't replace TOMBSTONE");
+}
+
+/**
+ * digram_hash_1
+ * @brief check that reversed digrams and digrams with equal sums do not share a home slot
+ */
+Test(digram_suite, digram_hash_1, .timeout=TEST_TIMEOUT) {
+    cr_assert_neq(DIGRAM_HASH(5, 6), DIGRAM_HASH(6, 5), "reversed digrams hash to the same slot");
+    cr_assert_neq(DIGRAM_HASH(5, 6), DIGRAM_HASH(4, 7), "digrams with equal sums hash to the same slot");
+    cr_assert_neq(DIGRAM_KEY(0, 0), 0, "a valid digram key must be nonzero");
+}
+
+/**
+ * digram_delete_4
+ * @brief check that deleting the last entry of a probe run also cleans up the tombstones before it
+ */
+Test(digram_suite, digram_delete_4, .timeout=TEST_TIMEOUT) {
+    int v1 = 5, v2 = 6; // Arbitrary
+    SYMBOL s1 = {0}, s2 = {0};
+    s1.value = v1;
+    s2.value = v2;
+    s1.next = &s2;
+
+    int digram_table_index = DIGRAM_HASH(v1, v2);
+    int next_index = (digram_table_index + 1) % MAX_DIGRAMS;
+    int next_next_index = (digram_table_index + 2) % MAX_DIGRAMS;
+    digram_table[digram_table_index].key = 0;
+    digram_table[digram_table_index].digram = TOMBSTONE;
+    digram_table[next_index].key = DIGRAM_KEY(v1, v2);
+    digram_table[next_index].digram = &s1;
+    digram_table[next_next_index].key = 0;
+    digram_table[next_next_index].digram = NULL;
+
+    int retval = digram_delete(&s1);
+    cr_assert_eq(0, retval, "expected return value 0 when deleting an existing digram");
+    cr_assert_null(digram_table[next_index].digram, "deleted digram at the end of a probe run left a TOMBSTONE");
+    cr_assert_null(digram_table[digram_table_index].digram, "TOMBSTONE before the end of a probe run wasn't cleaned up");
+}
+
+/**
+ * digram_rehash_1
+ * @brief check that rebuilding the table clears its tombstones and keeps every digram reachable
+ */
+Test(digram_suite, digram_rehash_1, .timeout=TEST_TIMEOUT) {
+    /* Digrams (i, 7) for consecutive i mostly share probe runs, so deletions leave tombstones. */
+    static SYMBOL syms[4000];
+    for(int i = 0; i < 2000; i++){
+        syms[2*i].value = i;
+        syms[2*i+1].value = 7;
+        syms[2*i].next = &syms[2*i+1];
+        digram_put(&syms[2*i]);
+    }
+    for(int i = 0; i < 2000; i += 2)
+        digram_delete(&syms[2*i]);
+    int live = current_ctx->digram_live;
+
+    digram_rehash();
+
+    int found = 0;
+    for(int i = 0; i < MAX_DIGRAMS; i++){
+        cr_assert_neq(digram_table[i].digram, TOMBSTONE, "a TOMBSTONE was left after rehashing");
+        if(digram_table[i].digram != NULL)
+            found++;
+    }
+    cr_assert_eq(found, live, "rehashing changed the number of entries: %d instead of %d", found, live);
+    cr_assert_eq(current_ctx->digram_live, live, "wrong count of live entries after rehashing");
+    cr_assert_eq(current_ctx->digram_tombstones, 0, "tombstones still counted after rehashing");
+    for(int i = 0; i < 2000; i++){
+        SYMBOL *exp = i % 2 ? &syms[2*i] : NULL;
+        cr_assert_eq(digram_get(i, 7), exp, "digram (%d, 7) not found as expected after rehashing", i);
+    }
 }
 
 /**
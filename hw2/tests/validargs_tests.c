@@ -126,6 +126,197 @@ Test(validargs_suite, validargs_invalid_7, .timeout=TEST_TIMEOUT) {
     cr_assert_eq(opt & flag, flag, "Correct bit not set for. Got: %x", opt);
 }
 
+Test(validargs_suite, validargs_valid_jobs, .timeout=TEST_TIMEOUT) {
+    int argc = 6;
+    char *argv[] = {"bin/sequitur", "-c", "-j", "4", "-b", "2", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x00020402;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+}
+
+Test(validargs_suite, validargs_invalid_jobs_1, .timeout=TEST_TIMEOUT) {
+    int argc = 4;
+    char *argv[] = {"bin/sequitur", "-c", "-j", "0", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = -1;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+}
+
+Test(validargs_suite, validargs_invalid_jobs_2, .timeout=TEST_TIMEOUT) {
+    int argc = 6;
+    char *argv[] = {"bin/sequitur", "-c", "-j", "2", "-j", "2", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = -1;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+}
+
+Test(validargs_suite, validargs_invalid_jobs_3, .timeout=TEST_TIMEOUT) {
+    int argc = 4;
+    char *argv[] = {"bin/sequitur", "-d", "-b", "2", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = -1;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+}
+
+Test(validargs_suite, validargs_valid_decompress_jobs, .timeout=TEST_TIMEOUT) {
+    int argc = 4;
+    char *argv[] = {"bin/sequitur", "-d", "-j", "2", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options & 0xffff;
+    int flag = 0x0204;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+}
+
+Test(validargs_suite, validargs_valid_index, .timeout=TEST_TIMEOUT) {
+    int argc = 5;
+    char *argv[] = {"bin/sequitur", "-c", "-i", "-b", "2", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x0002000a;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+}
+
+Test(validargs_suite, validargs_invalid_index, .timeout=TEST_TIMEOUT) {
+    int argc = 3;
+    char *argv[] = {"bin/sequitur", "-d", "-i", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = -1;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+}
+
+Test(validargs_suite, validargs_valid_stream, .timeout=TEST_TIMEOUT) {
+    int argc = 6;
+    char *argv[] = {"bin/sequitur", "-c", "-s", "250", "-b", "2", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x00020012;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+    cr_assert_eq(stream_interval, 250, "Wrong interval. Got: %d", stream_interval);
+}
+
+Test(validargs_suite, validargs_invalid_stream, .timeout=TEST_TIMEOUT) {
+    int argc = 6;
+    char *argv[] = {"bin/sequitur", "-c", "-s", "250", "-j", "2", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = -1;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+}
+
+Test(validargs_suite, validargs_valid_verbose, .timeout=TEST_TIMEOUT) {
+    int argc = 5;
+    char *argv[] = {"bin/sequitur", "-c", "-v", "-b", "4", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x00040022;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+}
+
+Test(validargs_suite, validargs_invalid_verbose, .timeout=TEST_TIMEOUT) {
+    int argc = 3;
+    char *argv[] = {"bin/sequitur", "-d", "-v", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = -1;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+}
+
+Test(validargs_suite, validargs_invalid_verbose_jobs, .timeout=TEST_TIMEOUT) {
+    char *argv_j[] = {"bin/sequitur", "-c", "-v", "-j", "2", NULL};
+    cr_assert_eq(validargs(5, argv_j), -1, "-v was accepted with -j");
+    char *argv_1[] = {"bin/sequitur", "-c", "-j", "1", "-v", NULL};
+    cr_assert_eq(validargs(5, argv_1), -1, "-v was accepted with -j 1");
+}
+
+Test(validargs_suite, validargs_valid_auto, .timeout=TEST_TIMEOUT) {
+    int argc = 5;
+    char *argv[] = {"bin/sequitur", "-c", "-b", "auto", "-i", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x0000000a;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+}
+
+Test(validargs_suite, validargs_invalid_auto, .timeout=TEST_TIMEOUT) {
+    char *argv_j[] = {"bin/sequitur", "-c", "-b", "auto", "-j", "2", NULL};
+    cr_assert_eq(validargs(6, argv_j), -1, "-b auto was accepted with -j");
+    char *argv_s[] = {"bin/sequitur", "-c", "-s", "100", "-b", "auto", NULL};
+    cr_assert_eq(validargs(6, argv_s), -1, "-b auto was accepted with -s");
+    char *argv_b[] = {"bin/sequitur", "-c", "-b", "auto", "-b", "8", NULL};
+    cr_assert_eq(validargs(6, argv_b), -1, "-b was accepted twice");
+    char *argv_d[] = {"bin/sequitur", "-d", "-b", "auto", NULL};
+    cr_assert_eq(validargs(4, argv_d), -1, "-b auto was accepted with -d");
+}
+
+Test(validargs_suite, validargs_valid_entropy, .timeout=TEST_TIMEOUT) {
+    int argc = 3;
+    char *argv[] = {"bin/sequitur", "-c", "-e", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x04000082;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+}
+
+Test(validargs_suite, validargs_invalid_entropy, .timeout=TEST_TIMEOUT) {
+    char *argv_d[] = {"bin/sequitur", "-d", "-e", NULL};
+    cr_assert_eq(validargs(3, argv_d), -1, "-e was accepted with -d");
+    char *argv_e[] = {"bin/sequitur", "-c", "-e", "-e", NULL};
+    cr_assert_eq(validargs(4, argv_e), -1, "-e was accepted twice");
+}
+
+Test(validargs_suite, validargs_valid_range, .timeout=TEST_TIMEOUT) {
+    int argc = 4;
+    char *argv[] = {"bin/sequitur", "-d", "-r", "4096:100", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x00000044;
+    cr_assert_eq(ret, exp_ret, "Invalid return for valid args.  Got: %d | Expected: %d",
+         ret, exp_ret);
+    cr_assert_eq(opt, flag, "Correct bits not set. Got: %x", opt);
+    cr_assert_eq(range_offset, 4096, "Wrong offset. Got: %lu", range_offset);
+    cr_assert_eq(range_length, 100, "Wrong length. Got: %lu", range_length);
+}
+
+Test(validargs_suite, validargs_invalid_range, .timeout=TEST_TIMEOUT) {
+    char *ranges[] = {"10:0", "10", ":10", "10:", "1:2:3", "x:1", "99999999999999999999:1"};
+    for(int i = 0; i < 7; i++) {
+        char *argv[] = {"bin/sequitur", "-d", "-r", ranges[i], NULL};
+        int ret = validargs(4, argv);
+        cr_assert_eq(ret, -1, "Range %s was accepted", ranges[i]);
+    }
+    char *argv_c[] = {"bin/sequitur", "-c", "-r", "0:10", NULL};
+    cr_assert_eq(validargs(4, argv_c), -1, "-r was accepted with -c");
+    char *argv_j[] = {"bin/sequitur", "-d", "-r", "0:10", "-j", "2", NULL};
+    cr_assert_eq(validargs(6, argv_j), -1, "-r was accepted with -j");
+}
+
 // Test(validargs_suite, modifyGlobalOptions, .timeout=TEST_TIMEOUT) {
 //     // Include declaration
 //     int modifyGlobalOptions(int blocksize, char *flag);
@@ -405,4 +596,4 @@ Test(validargs_suite, validargs_invalid_7, .timeout=TEST_TIMEOUT) {
 //     ret = stringCompare(string1, string2);
 //     cr_assert_eq(ret, exp_ret, "Invalid return for stringCompare.  Got: %d | Expected: %d",
 //          ret, exp_ret);
-// }
\ No newline at end of file
+// }
@@ -1,3 +1,6 @@
+#ifndef HELPER_H
+#define HELPER_H
+
 #include "sfmm.h"
 
 /* Constants for the allocator */
@@ -15,15 +18,26 @@
 #define ALLOC_MASK            0xF
 #define REQUESTED_SIZE_SHIFT  32
 
-size_t max_payload = 0;
-size_t current_payload = 0;
-size_t  current_heap_size = 0;
+/* Largest request whose block size can be computed without overflow */
+#define MAX_REQUEST_SIZE      (SIZE_MAX - HEADER_SIZE - FOOTER_SIZE - ALIGN_SIZE)
+
+/* Blocks looked at in the free list for a size before settling on a larger list */
+#define FREE_LIST_SEARCH_MAX   8
+
+/* Per-thread caches (see sf_enable_threads) */
+#define THREAD_CACHE_MAX      16  /* blocks a thread may cache per size */
+#define THREAD_CACHE_BATCH     8  /* blocks moved to or from the heap at a time */
+
+/* Statistics, defined in sfmm.c */
+extern size_t max_payload;
+extern size_t current_payload;
+extern size_t current_heap_size;
+extern size_t total_requested_payload;
+extern size_t total_allocated_blocks_size;
 
 void initialize_heap();
 int get_free_list_index(size_t size) ;
 size_t calculate_block_size(size_t requested_size);
-size_t total_requested_payload = 0; 
-size_t total_allocated_blocks_size = 0;
 sf_block *search_free_lists(size_t size);
 sf_block *extend_heap(size_t size);
 sf_block *coalesce(sf_block *block);
@@ -37,4 +51,40 @@ sf_block *get_block_from_payload(void *bp);
 sf_footer *get_footer(sf_block *block);
 sf_block *get_next_block(sf_block *block);
 sf_block *get_prev_block(sf_block *block);
-size_t get_block_size(sf_block *block);
\ No newline at end of file
+size_t get_block_size(sf_block *block);
+
+/*
+ * Makes the allocator safe to call from several threads.  Must be called
+ * before any other thread uses the allocator.
+ * @return 0 on success, -1 if the per-thread caches could not be set up.
+ */
+int sf_enable_threads(void);
+
+/*
+ * Lets the heap grow by more than a request needs: by as many pages as it
+ * already has, but by no more than max_pages at a time.  0 (the default) grows
+ * it only by the pages the request needs.
+ */
+void sf_set_heap_growth(size_t max_pages);
+
+/*
+ * Allocates size bytes whose address is a multiple of align, a power of two.
+ * @return As sf_malloc, except that if align is not a power of two, NULL is
+ * returned and sf_errno is set to EINVAL.
+ */
+void *sf_memalign(size_t align, size_t size);
+
+/*
+ * Allocates zeroed memory for an array of n elements of size bytes each.
+ * @return As sf_malloc; if n * size overflows, NULL is returned and sf_errno is
+ * set to ENOMEM.
+ */
+void *sf_calloc(size_t n, size_t size);
+
+/*
+ * @return The number of bytes that may be used at ptr, which was returned by one
+ * of the allocation functions, or 0 if ptr is not an allocated payload.
+ */
+size_t sf_malloc_usable_size(void *ptr);
+
+#endif
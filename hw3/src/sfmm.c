@@ -5,14 +5,98 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include "debug.h"
 #include "sfmm.h"
 #include "helper.h"
 
 // Global statistics tracking
-// size_t current_payload = 0;
-// size_t max_payload = 0;
-// size_t current_heap_size = 0;
+size_t current_payload = 0;
+size_t max_payload = 0;
+size_t current_heap_size = 0;
+size_t total_requested_payload = 0;
+size_t total_allocated_blocks_size = 0;
+
+/*
+ * Thread safety.
+ * Once sf_enable_threads() has been called, the heap (free lists, quick lists,
+ * block headers of free blocks) is only touched with sf_heap_lock held, and the
+ * statistics are updated with atomic operations.  Each thread keeps its own cache
+ * of small blocks, sized like the quick lists, that it allocates from and frees to
+ * without taking the lock.  Blocks in a thread cache stay allocated, so they are
+ * never coalesced, but are marked IN_QUICK_LIST, so that freeing one again from
+ * any thread is caught.  That bit is the only one changed without the lock, and
+ * it is changed with an atomic operation, as are the headers of neighbours read
+ * while coalescing (another thread may be marking one).  An empty cache is
+ * refilled with THREAD_CACHE_BATCH blocks at once, and a full one gives
+ * THREAD_CACHE_BATCH blocks back to the free lists, so the lock is taken once per
+ * batch.  A thread's cache is given back when the thread exits.
+ */
+static bool sf_threads = false;
+static pthread_mutex_t sf_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sf_thread_cache_key;
+
+static __thread struct {
+    int length;
+    struct sf_block *first;
+} sf_thread_cache[NUM_QUICK_LISTS];
+static __thread bool sf_thread_cache_registered = false;
+
+//read a header that another thread may be marking or unmarking (see above)
+static inline sf_header load_header(sf_block *block) {
+    return __atomic_load_n(&block->header, __ATOMIC_RELAXED) ^ MAGIC;
+}
+
+static inline void lock_heap(void) {
+    if (sf_threads) {
+        pthread_mutex_lock(&sf_heap_lock);
+    }
+}
+
+static inline void unlock_heap(void) {
+    if (sf_threads) {
+        pthread_mutex_unlock(&sf_heap_lock);
+    }
+}
+
+static void raise_max_payload(size_t now) {
+    size_t max = __atomic_load_n(&max_payload, __ATOMIC_RELAXED);
+    while (now > max &&
+           !__atomic_compare_exchange_n(&max_payload, &max, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+//add to the current payload and raise the maximum along with it
+static void payload_add(size_t size) {
+    raise_max_payload(__atomic_add_fetch(&current_payload, size, __ATOMIC_RELAXED));
+}
+
+//replace part of the current payload, as for a block resized in place
+static void payload_replace(size_t old_size, size_t new_size) {
+    size_t now = __atomic_load_n(&current_payload, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&current_payload, &now, now - old_size + new_size,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    raise_max_payload(now - old_size + new_size);
+}
+
+//total_allocated_blocks_size follows every block that becomes allocated or free
+static inline void allocated_add(size_t size) {
+    __atomic_add_fetch(&total_allocated_blocks_size, size, __ATOMIC_RELAXED);
+}
+
+static inline void allocated_sub(size_t size) {
+    __atomic_sub_fetch(&total_allocated_blocks_size, size, __ATOMIC_RELAXED);
+}
+
+//subtract from the current payload, stopping at zero
+static void payload_sub(size_t size) {
+    size_t now = __atomic_load_n(&current_payload, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&current_payload, &now, now >= size ? now - size : 0,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
 static inline void store_requested_size(sf_block *block, size_t requested_size) {
     *(size_t *)block->body.payload = requested_size;
 }
@@ -76,7 +160,11 @@ void setup_epilogue(void) {
     *epilogue = 0x1 ^ MAGIC; //size 0, allocated
 }
 
+//bit i is set while free list i is not empty
+static unsigned int sf_free_list_map = 0;
+
 void initialize_free_list(){
+    sf_free_list_map = 0;
     for (int i = 0; i < NUM_FREE_LISTS; i++) {
         sf_free_list_heads[i].body.links.next = &sf_free_list_heads[i];
         sf_free_list_heads[i].body.links.prev = &sf_free_list_heads[i];
@@ -92,57 +180,100 @@ void initialize_heap() {
     setup_prologue();
     setup_initial_free_block();
     setup_epilogue();
-    current_heap_size = PAGE_SZ;
+    __atomic_store_n(&current_heap_size, PAGE_SZ, __ATOMIC_RELAXED);
 }
 
 int get_free_list_index(size_t size) {
-    if (size <= 32) return 0;
+    if (size <= MIN_BLOCK_SIZE) return 0;
     
-    size_t min_size = 32;
-    int index = 0;
+    //list i holds sizes in (M * 2^(i-1), M * 2^i]: i is the bit length of (size - 1) / M
+    size_t multiple = (size - 1) / MIN_BLOCK_SIZE;
+    int index = (int)(sizeof(unsigned long) * 8) - __builtin_clzl(multiple);
     
-    while (index < NUM_FREE_LISTS - 1) {
-        min_size *= 2;
-        index++;
-        
-        if (size <= min_size)
-            return index;
-    }
-    
-    return NUM_FREE_LISTS - 1;
+    return index < NUM_FREE_LISTS - 1 ? index : NUM_FREE_LISTS - 1;
 }
 
-sf_block *find_free_list_block(size_t size) {
-    int start_index = get_free_list_index(size);
-    //search each free list starting at the appropriate size class
-    for (int i = start_index; i < NUM_FREE_LISTS; i++) {
-        sf_block *current = sf_free_list_heads[i].body.links.next;
-        //search this free list for first fit
-        while (current != &sf_free_list_heads[i]) {
-            sf_header true_header = current->header ^ MAGIC;
-            size_t current_size = true_header & ~0xF; //mask out flags
-            if (current_size >= size) {
-                //remove from free list FIRST
-                remove_from_free_list(current);
-                
-                //split if possible - only if the remainder would be at least MIN_BLOCK_SIZE
-                if (current_size - size >= MIN_BLOCK_SIZE) {
-                    split_block(current, size);
-                }
-                
-                set_allocated(current);
-                return current;
+//look at the blocks of list index, starting at from, for the smallest one of at least
+//size bytes; stop at an exact fit, or after limit blocks unless limit is 0
+static sf_block *best_fit_in_list(int index, sf_block *from, size_t size, int limit, sf_block **stop) {
+    sf_block *head = &sf_free_list_heads[index];
+    sf_block *best = NULL;
+    size_t best_size = 0;
+    sf_block *current = from;
+    int looked = 0;
+
+    while (current != head && (limit == 0 || looked++ < limit)) {
+        size_t current_size = (current->header ^ MAGIC) & BLOCK_SIZE_MASK;
+        if (current_size >= size && (best == NULL || current_size < best_size)) {
+            best = current;
+            best_size = current_size;
+            if (current_size == size) {
+                break;
             }
-            current = current->body.links.next;
         }
+        current = current->body.links.next;
+    }
+    *stop = current;
+    return best;
+}
+
+//find a free block of at least size bytes and remove it from its free list
+static sf_block *take_free_block(size_t size) {
+    int index = get_free_list_index(size);
+    sf_block *block = NULL;
+    sf_block *rest = NULL;
+
+    //the list for the size itself may also hold smaller blocks: look at a few of them
+    if (sf_free_list_map & (1u << index)) {
+        block = best_fit_in_list(index, sf_free_list_heads[index].body.links.next,
+                                 size, FREE_LIST_SEARCH_MAX, &rest);
     }
-    return NULL;
+
+    //every block in a higher list is large enough: take the first in the lowest one
+    if (block == NULL) {
+        unsigned int higher = sf_free_list_map & ~((2u << index) - 1);
+        if (higher != 0) {
+            int i = __builtin_ctz(higher);
+            block = sf_free_list_heads[i].body.links.next;
+        }
+    }
+
+    //rather than grow the heap, look at the rest of the list
+    if (block == NULL && rest != NULL) {
+        block = best_fit_in_list(index, rest, size, 0, &rest);
+    }
+
+    if (block != NULL) {
+        remove_from_free_list(block);
+    }
+    return block;
+}
+
+sf_block *find_free_list_block(size_t size) {
+    sf_block *current = take_free_block(size);
+    if (current == NULL) {
+        return NULL;
+    }
+
+    size_t current_size = (current->header ^ MAGIC) & BLOCK_SIZE_MASK;
+    //split if possible - only if the remainder would be at least MIN_BLOCK_SIZE
+    if (current_size - size >= MIN_BLOCK_SIZE) {
+        split_block(current, size);
+    }
+
+    set_allocated(current);
+    allocated_add(get_block_size(current));
+    return current;
 }
 
 void add_to_free_list(sf_block *block) {
     sf_header true_header = block->header ^ MAGIC;
     size_t block_size = true_header & ~0xF;
     
+    if (true_header & THIS_BLOCK_ALLOCATED) {
+        allocated_sub(block_size);
+    }
+    
     block->header = (true_header & ~0x3) ^ MAGIC; //clear both bits
     
     sf_footer *footer = (sf_footer *)((char *)block + block_size - sizeof(sf_footer));
@@ -164,6 +295,7 @@ void insert_into_free_list(sf_block *block, int index) {
     
     sf_free_list_heads[index].body.links.next->body.links.prev = block;
     sf_free_list_heads[index].body.links.next = block;
+    sf_free_list_map |= 1u << index;
     
     sf_header true_header = block->header ^ MAGIC;
     block->header = (true_header & ~(THIS_BLOCK_ALLOCATED | IN_QUICK_LIST)) ^ MAGIC;
@@ -175,6 +307,11 @@ void insert_into_free_list(sf_block *block, int index) {
 void remove_from_free_list(sf_block *block) {
     block->body.links.prev->body.links.next = block->body.links.next;
     block->body.links.next->body.links.prev = block->body.links.prev;
+    
+    //the block was the only one in its list: both links are to the list head
+    if (block->body.links.prev == block->body.links.next) {
+        sf_free_list_map &= ~(1u << (block->body.links.prev - sf_free_list_heads));
+    }
 }
 
 void add_to_quick_list(sf_block *block, int qlist_index) {
@@ -238,11 +375,11 @@ sf_block *coalesce(sf_block *block) {
     size_t block_size = (block->header ^ sf_magic()) & BLOCK_SIZE_MASK;
     sf_block *next_block = get_next_block(block);
     sf_block *prev_block = get_prev_block(block);
-    size_t next_alloc = (next_block->header ^ sf_magic()) & THIS_BLOCK_ALLOCATED;
+    size_t next_alloc = load_header(next_block) & THIS_BLOCK_ALLOCATED;
     size_t prev_alloc = 1;  //default to allocated if at start of heap
     
     if (prev_block != NULL) {
-        prev_alloc = (prev_block->header ^ sf_magic()) & THIS_BLOCK_ALLOCATED;
+        prev_alloc = load_header(prev_block) & THIS_BLOCK_ALLOCATED;
     }
     
     //case 1: both previous and next blocks are allocated
@@ -305,51 +442,61 @@ sf_block *coalesce(sf_block *block) {
     return block;
 }
 
-sf_block *extend_heap(size_t size) {
-    void *new_page = sf_mem_grow();
-    if (new_page == NULL) {
-        sf_errno = ENOMEM;
-        return NULL;
-    }
+//pages beyond what a request needs that the heap may grow by at a time (0: none)
+static size_t sf_heap_growth_pages = 0;
 
-    sf_block *new_block = (sf_block *)((char *)new_page - 8);
-    size_t new_size = PAGE_SZ;
+void sf_set_heap_growth(size_t max_pages) {
+    sf_heap_growth_pages = max_pages;
+}
 
-    //if the block before the epilogue was free, coalesce
-    sf_block *prev_block = NULL;
-    sf_footer *prev_footer = (sf_footer *)((char *)new_page - 16);
-    sf_header prev_footer_val = *prev_footer ^ MAGIC;
+//grow the heap so that it ends with a free block of at least size bytes;
+//returns the free block at the end, or NULL if no page could be added
+sf_block *extend_heap(size_t size) {
+    if (sf_mem_start() == sf_mem_end()) {
+        return NULL;  //never initialized
+    }
+    char *old_end = sf_mem_end();
 
-    if (!(prev_footer_val & ALLOC_MASK)) {
-        //previous block is free, coalesce
-        size_t prev_size = prev_footer_val & ~0xF;
-        prev_block = (sf_block *)((char *)new_page - 8 - prev_size);
-        
-        //remove previous block from its free list
-        prev_block->body.links.prev->body.links.next = prev_block->body.links.next;
-        prev_block->body.links.next->body.links.prev = prev_block->body.links.prev;
-        
-        new_block = prev_block;
-        new_size += prev_size;
+    //a free block at the end of the heap already makes up part of the size
+    size_t have = 0;
+    sf_footer last_footer = *(sf_footer *)(old_end - 16) ^ MAGIC;
+    if (!(last_footer & THIS_BLOCK_ALLOCATED)) {
+        have = last_footer & BLOCK_SIZE_MASK;
     }
+    size_t need = size > have ? size - have : MIN_BLOCK_SIZE;
+    size_t pages = (need + PAGE_SZ - 1) / PAGE_SZ;
 
-    //set up new block header
-    new_block->header = new_size;
-    new_block->header ^= MAGIC;
+    //grow geometrically, up to sf_heap_growth_pages at a time
+    size_t heap_pages = current_heap_size / PAGE_SZ;
+    size_t extra = heap_pages < sf_heap_growth_pages ? heap_pages : sf_heap_growth_pages;
+    if (pages < extra) {
+        pages = extra;
+    }
 
-    //create new epilogue
-    sf_header *new_epilogue = (sf_header *)((char *)sf_mem_end() - 8);
-    *new_epilogue = ALLOC_MASK; //size 0, allocated
-    *new_epilogue ^= MAGIC;
+    size_t grown = 0;
+    while (grown < pages && sf_mem_grow() != NULL) {
+        grown++;
+    }
+    if (grown == 0) {
+        return NULL;
+    }
 
-    //set up footer for new block
+    //the new pages make one free block, starting at the old epilogue
+    sf_block *new_block = (sf_block *)(old_end - 8);
+    size_t new_size = grown * PAGE_SZ;
+    new_block->header = new_size ^ MAGIC;
     sf_footer *new_footer = (sf_footer *)((char *)new_block + new_size - 8);
     *new_footer = new_block->header;
 
-    //add new block to appropriate free list
-    int new_index = get_free_list_index(new_size);
-    insert_into_free_list(new_block, new_index);
-    return new_page;
+    sf_header *new_epilogue = (sf_header *)((char *)sf_mem_end() - 8);
+    *new_epilogue = 0x1 ^ MAGIC;
+    __atomic_add_fetch(&current_heap_size, new_size, __ATOMIC_RELAXED);
+
+    //coalesce with a free block before it, and insert once
+    new_block = coalesce(new_block);
+    int index = get_free_list_index(get_block_size(new_block));
+    insert_into_free_list(new_block, index);
+    return new_block;
 }
 
 void split_block(sf_block *block, size_t size) {
@@ -372,6 +519,11 @@ void split_block(sf_block *block, size_t size) {
     
     int index = get_free_list_index(remainder_size);
     insert_into_free_list(remainder, index);
+    
+    //the remainder of an allocated block is no longer allocated
+    if (alloc_bits & THIS_BLOCK_ALLOCATED) {
+        allocated_sub(remainder_size);
+    }
      
     //update original block header, preserve the flags and allocate the block
     block->header = (size | (alloc_bits & ~THIS_BLOCK_ALLOCATED) | THIS_BLOCK_ALLOCATED) ^ MAGIC;
@@ -380,26 +532,7 @@ void split_block(sf_block *block, size_t size) {
 }
 
 sf_block *search_free_lists(size_t size) {
-    int index = get_free_list_index(size);
-    
-    //search starting from the appropriate size class
-    for (int i = index; i < NUM_FREE_LISTS; i++) {
-        sf_block *block = sf_free_list_heads[i].body.links.next;
-        
-        //traverse the free list
-        while (block != &sf_free_list_heads[i]) {
-            size_t block_size = (block->header ^ sf_magic()) & BLOCK_SIZE_MASK;
-            
-            if (block_size >= size) {
-                //remove from free list
-                remove_from_free_list(block);
-                return block;
-            }
-            block = block->body.links.next;
-        }
-    }
-    
-    return NULL;  //no suitable block found
+    return take_free_block(size);
 }
 
 inline sf_block *get_block_from_payload(void *bp) {
@@ -421,7 +554,7 @@ int validate_pointer(void *bp) {
         return 0;
     }
     
-    size_t header = block->header ^ sf_magic();
+    size_t header = load_header(block);
     size_t block_size = header & BLOCK_SIZE_MASK;
     
     if (block_size < MIN_BLOCK_SIZE || block_size % ALIGN_SIZE != 0) {
@@ -433,63 +566,116 @@ int validate_pointer(void *bp) {
     }
     
     sf_footer *footer = get_footer(block);
-    if (*footer != block->header) {
+    if ((*footer ^ sf_magic()) != header) {
         return 0;
     }
     return 1; 
 }
 
-sf_block *coalesce_with_preceding(void *new_page) {
-    sf_footer *prev_footer = (sf_footer *)((char *)new_page - 16);
-    sf_header prev_footer_val = *prev_footer ^ MAGIC;
-    
-    if (!(prev_footer_val & 0x1)) {
-        size_t prev_size = prev_footer_val & ~0xF;
-        sf_block *prev_block = (sf_block *)((char *)new_page - 8 - prev_size);
-        
-        remove_from_free_list(prev_block);
-        
-        size_t new_size = prev_size + PAGE_SZ;
-        
-        prev_block->header = new_size;
-        prev_block->header ^= MAGIC;
-        
-        sf_footer *new_footer = (sf_footer *)((char *)prev_block + new_size - 8);
-        *new_footer = prev_block->header;
-        
-        int index = get_free_list_index(new_size);
-        insert_into_free_list(prev_block, index);
-        
-        return prev_block;
-    } else {
-        //sets up new block
-        sf_block *new_block = (sf_block *)((char *)new_page - 8);
-        size_t new_size = PAGE_SZ;
-        new_block->header = new_size;
-        new_block->header ^= MAGIC;
-        sf_footer *new_footer = (sf_footer *)((char *)new_block + new_size - 8);
-        *new_footer = new_block->header;
-        
-        int index = get_free_list_index(new_size);
-        insert_into_free_list(new_block, index);
-        
-        return new_block;
+//allocate a block of the given size from the heap; the heap lock must be held
+static sf_block *malloc_block(size_t block_size) {
+    if (sf_mem_start() == sf_mem_end()) {
+        initialize_free_list();
+        initialize_heap();
+    }
+
+    while (1) {
+        sf_block *block = find_quick_list_block(block_size);
+        if (block == NULL) {
+            block = find_free_list_block(block_size);
+        }
+        if (block != NULL) {
+            return block;
+        }
+        if (extend_heap(block_size) == NULL) {
+            return NULL;
+        }
+    }
+}
+
+//give the first count blocks of a thread cache list back to the free lists
+static void thread_cache_flush(int index, int count) {
+    lock_heap();
+    while (count-- > 0 && sf_thread_cache[index].first != NULL) {
+        sf_block *block = sf_thread_cache[index].first;
+        sf_thread_cache[index].first = block->body.links.next;
+        sf_thread_cache[index].length--;
+        __atomic_fetch_xor(&block->header, IN_QUICK_LIST, __ATOMIC_RELAXED);
+        add_to_free_list(block);
+    }
+    unlock_heap();
+}
+
+//called when a thread exits, with its cache
+static void thread_cache_release(void *cache) {
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        thread_cache_flush(i, THREAD_CACHE_MAX);
+    }
+}
+
+//mark a block and put it in the calling thread's cache; aborts if it was already
+//marked, which is a block freed twice, perhaps by two threads at once
+static void thread_cache_push(sf_block *block, int index) {
+    if (!sf_thread_cache_registered) {
+        //only so that thread_cache_release is called at exit
+        pthread_setspecific(sf_thread_cache_key, sf_thread_cache);
+        sf_thread_cache_registered = true;
+    }
+    sf_header old = __atomic_fetch_xor(&block->header, IN_QUICK_LIST, __ATOMIC_RELAXED);
+    if ((old ^ MAGIC) & IN_QUICK_LIST) {
+        abort();
     }
+    block->body.links.next = sf_thread_cache[index].first;
+    sf_thread_cache[index].first = block;
+    sf_thread_cache[index].length++;
 }
 
-void *expand_heap(void) {
-    void *new_page = sf_mem_grow();
-    if (new_page == NULL) {
+//take a block of the given size from the calling thread's cache, refilling it if empty
+static sf_block *thread_cache_get(size_t block_size) {
+    if (block_size > MIN_BLOCK_SIZE + (NUM_QUICK_LISTS - 1) * ALIGN_SIZE) {
         return NULL;
     }
-    
-    coalesce_with_preceding(new_page);
-    
-    sf_header *new_epilogue = (sf_header *)((char *)sf_mem_end() - 8);
-    *new_epilogue = 0x1 ^ MAGIC;
-    
-    current_heap_size += PAGE_SZ;
-    return new_page;
+    int index = (block_size - MIN_BLOCK_SIZE) / ALIGN_SIZE;
+
+    sf_block *block = sf_thread_cache[index].first;
+    if (block != NULL) {
+        sf_thread_cache[index].first = block->body.links.next;
+        sf_thread_cache[index].length--;
+        __atomic_fetch_xor(&block->header, IN_QUICK_LIST, __ATOMIC_RELAXED);
+        return block;
+    }
+
+    //refill: the block itself may grow the heap, the rest of the batch may not
+    lock_heap();
+    block = malloc_block(block_size);
+    for (int i = 1; block != NULL && i < THREAD_CACHE_BATCH; i++) {
+        sf_block *spare = find_quick_list_block(block_size);
+        if (spare == NULL) {
+            spare = find_free_list_block(block_size);
+        }
+        if (spare == NULL) {
+            break;
+        }
+        if (get_block_size(spare) != block_size) {
+            //too small a remainder to split off; not worth caching
+            add_to_free_list(spare);
+            break;
+        }
+        thread_cache_push(spare, index);
+    }
+    unlock_heap();
+    return block;
+}
+
+int sf_enable_threads(void) {
+    if (sf_threads) {
+        return 0;
+    }
+    if (pthread_key_create(&sf_thread_cache_key, thread_cache_release) != 0) {
+        return -1;
+    }
+    sf_threads = true;
+    return 0;
 }
 
 void *sf_malloc(size_t size) {
@@ -498,37 +684,29 @@ void *sf_malloc(size_t size) {
     if (size <= 0) {
         return NULL;
     }
+    if (size > MAX_REQUEST_SIZE) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
 
     size_t block_size = calculate_block_size(size);
-    
-    if (sf_mem_start() == sf_mem_end()) {
-        initialize_free_list();
-        initialize_heap();
+
+    sf_block *block = NULL;
+    if (sf_threads) {
+        block = thread_cache_get(block_size);
     }
-    
-    sf_block *block = find_quick_list_block(block_size);
-    if (block != NULL) {        
-        current_payload += size;
-        if (current_payload > max_payload) {
-            max_payload = current_payload;
-        }
-        return block->body.payload;
+    if (block == NULL) {
+        lock_heap();
+        block = malloc_block(block_size);
+        unlock_heap();
     }
-    
-    block = find_free_list_block(block_size);
-    if (block != NULL) {    
-        current_payload += size;
-        if (current_payload > max_payload) {
-            max_payload = current_payload;
-        }
-        return block->body.payload;
-    }
-    
-    if (expand_heap() == NULL) {
+    if (block == NULL) {
         sf_errno = ENOMEM;
         return NULL;
     }
-    return sf_malloc(size);
+
+    payload_add(size);
+    return block->body.payload;
 }
 
 size_t get_block_size(sf_block *block) {
@@ -558,7 +736,7 @@ void flush_quick_list(int qlist_index) {
 }
 
 bool validate_block(sf_block *block) {
-    sf_header true_header = block->header ^ MAGIC;
+    sf_header true_header = load_header(block);
     size_t block_size = true_header & ~0xf; 
     
     if (block_size < 32 || block_size % 16 != 0) {
@@ -612,15 +790,20 @@ void sf_free(void *bp) {
     // The payload size is block_size - header - footer = block_size - 16
     size_t payload_size = block_size - 16;
     
-    if (current_payload >= payload_size) {
-        current_payload -= payload_size;
-    } else {
-        current_payload = 0;  
-    }
+    payload_sub(payload_size);
     
     //for small blocks, try to add to quick list
     if (block_size <= 32 + (NUM_QUICK_LISTS - 1) * 16) {
         int qlist_index = (block_size - 32) / 16;
+
+        if (sf_threads) {
+            //the thread's own cache stands in for the quick list
+            if (sf_thread_cache[qlist_index].length >= THREAD_CACHE_MAX) {
+                thread_cache_flush(qlist_index, THREAD_CACHE_BATCH);
+            }
+            thread_cache_push(block, qlist_index);
+            return;
+        }
         
         //check if quick list is full
         if (sf_quick_lists[qlist_index].length >= QUICK_LIST_MAX) {
@@ -633,10 +816,30 @@ void sf_free(void *bp) {
         
     } else {
         //for larger blocks, add to free list with coalescing
+        lock_heap();
         add_to_free_list(block);
+        unlock_heap();
     }
 }
 
+//give the end of an allocated block beyond size bytes back to the free lists,
+//if it is large enough to be a block of its own; the heap lock must be held
+static void release_tail(sf_block *block, size_t size) {
+    size_t block_size = get_block_size(block);
+    if (block_size - size < MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    sf_block *tail = (sf_block *)((char *)block + size);
+    tail->header = ((block_size - size) | THIS_BLOCK_ALLOCATED) ^ MAGIC;
+    *get_footer(tail) = tail->header;
+    block->header = (size | THIS_BLOCK_ALLOCATED) ^ MAGIC;
+    *get_footer(block) = block->header;
+
+    //coalesces it with a free block after it
+    add_to_free_list(tail);
+}
+
 void *sf_realloc(void *pp, size_t rsize) {
     sf_set_magic(1231);
 
@@ -656,10 +859,44 @@ void *sf_realloc(void *pp, size_t rsize) {
     sf_block *block = get_block_from_payload(pp);
     size_t old_size = get_block_size(block);
     size_t old_payload_size = old_size - 16; // block size minus header and footer
+    if (rsize > MAX_REQUEST_SIZE) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
     size_t new_block_size = calculate_block_size(rsize);
     
-    //if new size is larger, allocate new block
+    lock_heap();
     if (new_block_size > old_size) {
+        sf_block *next_block = get_next_block(block);
+        sf_header next_header = load_header(next_block);
+        
+        //at the end of the heap (perhaps but for a free block), grow it to make
+        //the free block after this one large enough
+        bool at_end = (next_header & BLOCK_SIZE_MASK) == 0 ||
+                      (!(next_header & THIS_BLOCK_ALLOCATED) &&
+                       load_header(get_next_block(next_block)) == THIS_BLOCK_ALLOCATED);
+        if (at_end && old_size + (next_header & BLOCK_SIZE_MASK) < new_block_size &&
+            extend_heap(new_block_size - old_size) != NULL) {
+            next_header = next_block->header ^ MAGIC;
+        }
+        
+        //grow in place by taking in the free block after this one
+        size_t next_size = next_header & BLOCK_SIZE_MASK;
+        if (!(next_header & THIS_BLOCK_ALLOCATED) && old_size + next_size >= new_block_size) {
+            remove_from_free_list(next_block);
+            allocated_add(next_size);
+            block->header = (old_size + next_size) | THIS_BLOCK_ALLOCATED;
+            block->header ^= MAGIC;
+            *get_footer(block) = block->header;
+            release_tail(block, new_block_size);
+            unlock_heap();
+            
+            payload_replace(old_payload_size, rsize);
+            return pp;
+        }
+        unlock_heap();
+        
+        //otherwise, allocate new block
         void *new_pp = sf_malloc(rsize);
         if (new_pp == NULL) {
             return NULL;
@@ -673,53 +910,93 @@ void *sf_realloc(void *pp, size_t rsize) {
         return new_pp;
     }
     else {
-        // Update payload tracking for realloc
-        size_t old_tracked_payload = old_payload_size;
-        current_payload = current_payload - old_tracked_payload + rsize;
-        if (current_payload > max_payload) {
-            max_payload = current_payload;
-        }
+        //shrink in place, giving back the end if it makes a block
+        release_tail(block, new_block_size);
+        unlock_heap();
         
-        if (old_size - new_block_size >= MIN_BLOCK_SIZE) {
-            //check next block
-            sf_block *next_block = get_next_block(block);
-            sf_header next_header = next_block->header ^ MAGIC;
-            bool next_is_free = !(next_header & THIS_BLOCK_ALLOCATED);
-            
-            // Split the block
-            split_block(block, new_block_size);
-            
-            //if next block free, coalesce with new remainder
-            if (next_is_free) {
-                sf_block *remainder = get_next_block(block);
-                //remove both from free lists
-                remove_from_free_list(remainder);
-                remove_from_free_list(next_block);
-                
-                //combine them
-                size_t remainder_size = (remainder->header ^ MAGIC) & BLOCK_SIZE_MASK;
-                size_t next_size = next_header & BLOCK_SIZE_MASK;
-                size_t combined_size = remainder_size + next_size;
-                
-                //set new size for the combined block
-                remainder->header = combined_size | ((remainder->header ^ MAGIC) & PREV_BLOCK_ALLOCATED);
-                remainder->header ^= MAGIC;
-                sf_footer *new_footer = (sf_footer *)((char *)remainder + combined_size - FOOTER_SIZE);
-                *new_footer = remainder->header;
-                
-                int index = get_free_list_index(combined_size);
-                insert_into_free_list(remainder, index);
-            }
-        }  
+        // Update payload tracking for realloc
+        payload_replace(old_payload_size, rsize);
         return pp;
     }
 }
 
-double sf_fragmentation() {
-    if (sf_mem_start() == sf_mem_end()) {
-        return 0.0;
+void *sf_memalign(size_t align, size_t size) {
+    sf_set_magic(1231);
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+        sf_errno = EINVAL;
+        return NULL;
     }
-    
+    if (align <= ALIGN_SIZE) {
+        return sf_malloc(size);
+    }
+    if (size <= 0) {
+        return NULL;
+    }
+    if (size > MAX_REQUEST_SIZE - align - MIN_BLOCK_SIZE) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t block_size = calculate_block_size(size);
+
+    //room for the block, and for padding before it that is either nothing or a block
+    lock_heap();
+    sf_block *block = malloc_block(block_size + align + MIN_BLOCK_SIZE);
+    if (block == NULL) {
+        unlock_heap();
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    uintptr_t payload = (uintptr_t)block->body.payload;
+    uintptr_t aligned = (payload + align - 1) & ~(uintptr_t)(align - 1);
+    if (aligned != payload && aligned - payload < MIN_BLOCK_SIZE) {
+        aligned += align;
+    }
+
+    //split off the padding as a free block
+    if (aligned != payload) {
+        size_t lead = aligned - payload;
+        sf_block *rest = (sf_block *)((char *)block + lead);
+        rest->header = ((get_block_size(block) - lead) | THIS_BLOCK_ALLOCATED) ^ MAGIC;
+        *get_footer(rest) = rest->header;
+        block->header = (lead | THIS_BLOCK_ALLOCATED) ^ MAGIC;
+        *get_footer(block) = block->header;
+
+        add_to_free_list(block);
+        block = rest;
+    }
+    release_tail(block, block_size);
+    unlock_heap();
+
+    payload_add(size);
+    return block->body.payload;
+}
+
+void *sf_calloc(size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    //sf_mem_grow() makes no promise that new pages are zero, so always clear
+    void *pp = sf_malloc(n * size);
+    if (pp != NULL) {
+        memset(pp, 0, n * size);
+    }
+    return pp;
+}
+
+size_t sf_malloc_usable_size(void *pp) {
+    if (!validate_pointer(pp)) {
+        return 0;
+    }
+    return get_block_size(get_block_from_payload(pp)) - HEADER_SIZE - FOOTER_SIZE;
+}
+
+//sum of the sizes of the allocated blocks (including those in quick lists), by walking the heap
+static size_t walk_allocated_blocks_size(void) {
     size_t total_allocated_size = 0;
     
     char *current = (char *)sf_mem_start() + 8 + 32; //skip unused space and prologue
@@ -739,6 +1016,27 @@ double sf_fragmentation() {
         
         current += block_size;  //go to next block
     }
+    return total_allocated_size;
+}
+
+double sf_fragmentation() {
+    if (sf_mem_start() == sf_mem_end()) {
+        return 0.0;
+    }
+    
+#ifdef DEBUG
+    //check the running total against the heap
+    lock_heap();
+    size_t total_allocated_size = total_allocated_blocks_size;
+    size_t walked_size = walk_allocated_blocks_size();
+    unlock_heap();
+    if (total_allocated_size != walked_size) {
+        error("allocated blocks total %zu bytes, but the heap holds %zu", total_allocated_size, walked_size);
+        abort();
+    }
+#else
+    size_t total_allocated_size = __atomic_load_n(&total_allocated_blocks_size, __ATOMIC_RELAXED);
+#endif
     
     if (total_allocated_size == 0) {
         return 0.0;
@@ -747,7 +1045,7 @@ double sf_fragmentation() {
     // Fragmentation = current_payload / total_allocated_size
     // current_payload represents the sum of all requested sizes
     // total_allocated_size represents the sum of all allocated block sizes
-    return (double)current_payload / (double)total_allocated_size;
+    return (double)__atomic_load_n(&current_payload, __ATOMIC_RELAXED) / (double)total_allocated_size;
 }
 
 double sf_utilization() {
@@ -756,5 +1054,5 @@ double sf_utilization() {
     }
     size_t heap_size = (char *)sf_mem_end() - (char *)sf_mem_start();
     
-    return (double)max_payload / (double)heap_size;
+    return (double)__atomic_load_n(&max_payload, __ATOMIC_RELAXED) / (double)heap_size;
 }
\ No newline at end of file
@@ -62,14 +62,16 @@ Test(sf_memsuite_grading, realloc_larger, .timeout=TEST_TIMEOUT)
     _assert_nonnull_payload_pointer(x);
     _assert_block_info(x-8, 1, 224);
 
+    // The free block after x is large enough, so x grows in place.
     void * y = sf_realloc(x, nsz);
     _assert_nonnull_payload_pointer(y);
+    cr_assert(y == x, "The block was moved instead of grown in place");
     _assert_block_info(y-8, 1, 1040);
 
-    _assert_free_block_count(224, 1);
+    _assert_free_block_count(0, 1);
     _assert_quick_list_block_count(0, 0);
 
-    _assert_free_block_count(2784, 1);
+    _assert_free_block_count(3008, 1);
 
     _assert_errno_eq(0);
 }
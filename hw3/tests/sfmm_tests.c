@@ -3,6 +3,9 @@
 #include <signal.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "helper.h"
+#include <pthread.h>
+#include <sched.h>
 #define TEST_TIMEOUT 15
 
 /*
@@ -239,3 +242,213 @@ Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIME
 
 //Test(sfmm_student_suite, student_test_1, .timeout = TEST_TIMEOUT) {
 //}
+
+#define THREADS 4
+#define THREAD_ROUNDS 5000
+#define THREAD_LIVE 24
+
+static unsigned next_random(unsigned *seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+/*
+ * Each thread keeps up to THREAD_LIVE blocks of assorted sizes, filled with its
+ * own pattern, and frees and replaces them at random, checking the pattern.
+ */
+static void *thread_churn(void *arg) {
+	unsigned seed = (unsigned)(uintptr_t)arg;
+	unsigned char mark = (unsigned char)(uintptr_t)arg;
+	unsigned char *live[THREAD_LIVE] = { NULL };
+	size_t len[THREAD_LIVE] = { 0 };
+
+	for(int r = 0; r < THREAD_ROUNDS; r++) {
+		int i = next_random(&seed) % THREAD_LIVE;
+		if(live[i] != NULL) {
+			for(size_t j = 0; j < len[i]; j++)
+				if(live[i][j] != mark)
+					return "block was overwritten";
+			sf_free(live[i]);
+		}
+		len[i] = 1 + next_random(&seed) % (next_random(&seed) % 8 ? 200 : 1000);
+		live[i] = sf_malloc(len[i]);
+		if(live[i] == NULL)
+			return "sf_malloc failed";
+		memset(live[i], mark, len[i]);
+	}
+	for(int i = 0; i < THREAD_LIVE; i++)
+		if(live[i] != NULL)
+			sf_free(live[i]);
+	return NULL;
+}
+
+Test(sfmm_student_suite, threads_malloc_free, .timeout = TEST_TIMEOUT) {
+	pthread_t tid[THREADS];
+
+	cr_assert_eq(sf_enable_threads(), 0, "sf_enable_threads failed!");
+	for(uintptr_t t = 0; t < THREADS; t++)
+		cr_assert_eq(pthread_create(&tid[t], NULL, thread_churn, (void *)(t + 1)), 0,
+			     "pthread_create failed!");
+	for(int t = 0; t < THREADS; t++) {
+		void *err;
+		pthread_join(tid[t], &err);
+		cr_assert_null(err, "Thread %d: %s", t, (char *)err);
+	}
+
+	// The threads' caches have been given back, and everything coalesced.
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_fragmentation() == 0.0, "Blocks are still allocated!");
+}
+
+static pthread_mutex_t double_free_hold = PTHREAD_MUTEX_INITIALIZER;
+static int double_free_done = 0;
+
+/*
+ * Frees a block into the thread's cache, then stays alive, so that the block
+ * stays there, until the test is over.
+ */
+static void *thread_free_and_wait(void *arg) {
+	sf_free(arg);
+	__atomic_store_n(&double_free_done, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&double_free_hold);
+	return NULL;
+}
+
+Test(sfmm_student_suite, threads_double_free, .signal = SIGABRT, .timeout = TEST_TIMEOUT) {
+	pthread_t tid;
+
+	cr_assert_eq(sf_enable_threads(), 0, "sf_enable_threads failed!");
+	void *x = sf_malloc(8);
+	pthread_mutex_lock(&double_free_hold);
+	cr_assert_eq(pthread_create(&tid, NULL, thread_free_and_wait, x), 0,
+		     "pthread_create failed!");
+	while(!__atomic_load_n(&double_free_done, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	// x is in the other thread's cache, not this one's.
+	sf_free(x);
+	cr_assert_fail("SIGABRT should have been received");
+}
+
+Test(sfmm_student_suite, malloc_good_fit, .timeout = TEST_TIMEOUT) {
+	// Three free blocks in the list for (256, 512], kept apart by allocated ones,
+	// with the largest at the front of the list.
+	void *x = sf_malloc(496);
+	void *a = sf_malloc(8);
+	void *y = sf_malloc(368);
+	void *b = sf_malloc(8);
+	void *z = sf_malloc(304);
+	void *c = sf_malloc(8);
+	sf_free(z);
+	sf_free(y);
+	sf_free(x);
+
+	void *w = sf_malloc(304);
+	cr_assert(w == z, "The block of the exact size was not chosen!");
+	assert_free_block_count(512, 1);
+	assert_free_block_count(384, 1);
+	(void)a; (void)b; (void)c;
+}
+
+Test(sfmm_student_suite, allocated_total_matches_heap, .timeout = TEST_TIMEOUT) {
+	void *p[40];
+	for(int i = 0; i < 40; i++)
+		p[i] = sf_malloc(1 + 37 * i % 300);
+	for(int i = 0; i < 40; i += 3)
+		sf_free(p[i]);                      // quick lists fill up and are flushed
+	for(int i = 1; i < 40; i += 3)
+		p[i] = sf_realloc(p[i], 8);         // shrinks in place, splitting
+	for(int i = 2; i < 40; i += 3)
+		p[i] = sf_realloc(p[i], 400);       // moves
+
+	size_t walked = 0;
+	for(sf_block *bp = (sf_block *)((char *)sf_mem_start() + 40);
+	    bp < (sf_block *)((char *)sf_mem_end() - 8);
+	    bp = (sf_block *)((char *)bp + ((bp->header ^ sf_magic()) & 0xFFFFFFF0LU)))
+		if((bp->header ^ sf_magic()) & 0x1)
+			walked += (bp->header ^ sf_magic()) & 0xFFFFFFF0LU;
+	cr_assert_eq(total_allocated_blocks_size, walked,
+		     "Allocated blocks total %lu, but the heap holds %lu",
+		     total_allocated_blocks_size, walked);
+}
+
+Test(sfmm_student_suite, heap_growth_geometric, .timeout = TEST_TIMEOUT) {
+	sf_set_heap_growth(4);
+	void *w = sf_malloc(8);     // the first page
+	void *x = sf_malloc(8000);  // needs 1 more page, grows by 1: 2 pages
+	void *y = sf_malloc(8000);  // needs 2 more pages, grows by 2: 4 pages
+	void *z = sf_malloc(100);   // fits in what is left
+	void *u = sf_malloc(8000);  // needs 2 more pages, grows by 4 (the cap): 8 pages
+
+	cr_assert_not_null(u, "u is NULL!");
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), 8 * PAGE_SZ,
+		     "Heap is %ld bytes, not 8 pages!", (char *)sf_mem_end() - (char *)sf_mem_start());
+	assert_free_block_count(0, 1);
+	assert_free_block_count(8512, 1);
+	(void)w; (void)x; (void)y; (void)z;
+}
+
+Test(sfmm_student_suite, memalign_64, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(8);  // so the next payload is not already aligned
+	void *y = sf_memalign(64, 200);
+	void *z = sf_memalign(4096, 100);
+
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert_not_null(z, "z is NULL!");
+	cr_assert((uintptr_t)y % 64 == 0, "y (%p) is not 64-byte aligned!", y);
+	cr_assert((uintptr_t)z % 4096 == 0, "z (%p) is not 4096-byte aligned!", z);
+	cr_assert(sf_malloc_usable_size(y) >= 200, "y is too small!");
+	memset(y, 0xab, 200);
+	memset(z, 0xcd, 100);
+
+	// The padding before and after each block went back to the free lists, so
+	// freeing y leaves one free block from x to z, and another after z.
+	sf_free(x);
+	sf_free(y);
+	sf_free(z);
+	assert_quick_list_block_count(0, 2);
+	assert_free_block_count(0, 2);
+	cr_assert_null(sf_memalign(48, 100), "An alignment of 48 was accepted!");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, calloc_zeroed, .timeout = TEST_TIMEOUT) {
+	unsigned char *x = sf_malloc(400);
+	memset(x, 0xff, 400);
+	sf_free(x);
+
+	unsigned char *y = sf_calloc(100, 4);
+	cr_assert_eq(y, x, "The freed block was not reused!");
+	for(int i = 0; i < 400; i++)
+		cr_assert_eq(y[i], 0, "Byte %d is not zero!", i);
+	cr_assert_eq(sf_malloc_usable_size(y), 400, "Usable size is %lu, not 400!",
+		     sf_malloc_usable_size(y));
+
+	sf_errno = 0;
+	cr_assert_null(sf_calloc(SIZE_MAX / 8, 16), "An overflowing calloc succeeded!");
+	cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+	cr_assert_null(sf_malloc(SIZE_MAX), "An overflowing malloc succeeded!");
+}
+
+Test(sfmm_student_suite, realloc_grow_in_place, .timeout = TEST_TIMEOUT) {
+	char *x = sf_malloc(100);
+	void *y = sf_malloc(100);
+	memset(x, 'x', 100);
+	sf_free(y);                     // y goes to a quick list, so x cannot grow into it
+	char *z = sf_realloc(x, 200);
+	cr_assert(z != x, "x grew into a block on a quick list!");
+
+	// z is last before the free rest of the page: it grows into it, then past
+	// the end of the heap.
+	char *w = sf_realloc(z, 3000);
+	cr_assert(w == z, "z was moved instead of grown into the free block!");
+	char *v = sf_realloc(w, 10000);
+	cr_assert(v == w, "w was moved instead of grown at the end of the heap!");
+	for(int i = 0; i < 100; i++)
+		cr_assert_eq(v[i], 'x', "Byte %d was lost!", i);
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), 3 * PAGE_SZ,
+		     "Heap grew more than needed!");
+	assert_quick_list_block_count(0, 2);
+	assert_free_block_count(0, 1);
+}